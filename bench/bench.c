@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "htable.h"
+#include "node.h"
+#include "pass.h"
+#include "type.h"
+
+// Benchmarks print timings and statistics instead of checking results, and
+// are meant to be run on a release build (see ANF_BENCH in CMakeLists.txt)
+
+#define BENCH_NNODES 400000
+#define BENCH_NKEYS  1000000
+#define BENCH_STRIDE 4096
+#define BENCH_NFNS   16384
+
+HSET_DEFAULT(u64_set, uint64_t)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Distances beyond the last bucket of the statistics are counted as the last bucket
+static void print_dibs(const htable_t* table) {
+    htable_stats_t stats = htable_stats(table);
+    size_t total = 0;
+    for (size_t i = 0; i < HTABLE_DIB_BUCKETS; ++i)
+        total += i * stats.dibs[i];
+    printf("    load %.0f%%, average distance %.2f, maximum distance %zu\n",
+        100.0 * (double)stats.nelems / (double)stats.cap,
+        stats.nelems > 0 ? (double)total / (double)stats.nelems : 0.0,
+        stats.max_dib);
+}
+
+// Hash-consing throughput: distinct additions are created, and then looked up again
+static void bench_hashcons(void) {
+    mod_t* mod = mod_create();
+    const node_t* fn = node_fn(mod, type_fn(mod, type_i32(mod), type_i32(mod)), FN_EXPORTED, NULL);
+    const node_t* param = node_param(mod, fn, NULL);
+    double start = now();
+    for (int32_t i = 0; i < BENCH_NNODES; ++i)
+        node_add(mod, param, node_i32(mod, i), NULL);
+    double created = now();
+    for (int32_t i = 0; i < BENCH_NNODES; ++i)
+        node_add(mod, param, node_i32(mod, i), NULL);
+    double found = now();
+    printf("hashcons: %d additions created in %.3fs, found again in %.3fs\n",
+        BENCH_NNODES, created - start, found - created);
+    print_dibs(mod->nodes.table);
+    mod_destroy(mod);
+}
+
+// Distribution of keys that only differ in their upper bits
+static void bench_strided(void) {
+    u64_set_t set = u64_set_create();
+    double start = now();
+    for (uint64_t i = 0; i < BENCH_NKEYS; ++i)
+        u64_set_insert(&set, i * BENCH_STRIDE);
+    double inserted = now();
+    size_t nfound = 0;
+    for (uint64_t i = 0; i < BENCH_NKEYS; ++i)
+        nfound += u64_set_lookup(&set, i * BENCH_STRIDE) != NULL;
+    double found = now();
+    printf("strided: %zu keys with a stride of %d inserted in %.3fs, found again in %.3fs\n",
+        nfound, BENCH_STRIDE, inserted - start, found - inserted);
+    print_dibs(set.table);
+    u64_set_destroy(&set);
+}
+
+static void rewrite_body(mod_t* mod, const scope_t* scope, void* data) {
+    (void)data;
+    const node_t* fn = scope->entry;
+    const node_t* param = node_param(mod, fn, NULL);
+    node_bind(mod, fn, 0, node_add(mod, fn->ops[0], node_mul(mod, param, param, NULL), NULL));
+}
+
+// Cost of the pass driver per function, which should not grow with the number of functions
+static void bench_pass(void) {
+    for (size_t nfns = BENCH_NFNS / 16; nfns <= BENCH_NFNS; nfns *= 2) {
+        mod_t* mod = mod_create();
+        const type_t* fn_type = type_fn(mod, type_i32(mod), type_i32(mod));
+        for (size_t i = 0; i < nfns; ++i) {
+            const node_t* fn = node_fn(mod, fn_type, FN_EXPORTED, NULL);
+            const node_t* param = node_param(mod, fn, NULL);
+            node_bind(mod, fn, 0, node_add(mod, param, node_i32(mod, i % 8), NULL));
+        }
+        double start = now();
+        pass_run_on_fns(mod, rewrite_body, NULL, 1);
+        double end = now();
+        printf("pass: %zu functions rewritten in %.3fs\n", nfns, end - start);
+        mod_destroy(mod);
+    }
+}
+
+typedef struct {
+    const char* name;
+    void (*bench_fn)(void);
+} bench_t;
+
+int main(int argc, char** argv) {
+    bench_t benches[] = {
+        {"hashcons", bench_hashcons},
+        {"strided",  bench_strided},
+        {"pass",     bench_pass}
+    };
+    const size_t nbenches = sizeof(benches) / sizeof(benches[0]);
+    if (argc == 1) {
+        for (size_t i = 0; i < nbenches; ++i)
+            benches[i].bench_fn();
+        return 0;
+    }
+    for (int i = 1; i < argc; ++i) {
+        size_t j = 0;
+        while (j < nbenches && strcmp(benches[j].name, argv[i]))
+            j++;
+        if (j == nbenches) {
+            fprintf(stderr, "usage: anf_bench [benchmark]...\n");
+            return 1;
+        }
+        benches[j].bench_fn();
+    }
+    return 0;
+}
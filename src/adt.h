@@ -9,14 +9,17 @@
 #include "hash.h"
 #include "util.h"
 
-#define VEC_DEFAULT_CAP   64
+#define VEC_DEFAULT_CAP   16
 #define HMAP_DEFAULT_CAP  64
 #define HSET_DEFAULT_CAP  64
-#define TMP_BUF_STACK_CAP 16
+#define OHSET_DEFAULT_CAP 64
+#define BITSET_DEFAULT_CAP 256
+#define SPARSE_SET_DEFAULT_CAP 64
+#define TMP_BUF_STACK_CAP 256
 
 #define FORALL_HMAP(hmap, key_t, key, value_t, value, ...) \
     for (size_t i = 0; i < (hmap).table->cap; ++i) { \
-        if ((hmap).table->hashes[i] & OCCUPIED_HASH_MASK) { \
+        if (htable_is_occupied((hmap).table, i)) { \
             struct pair_s { key_t key; value_t value; }; \
             struct pair_s* pair = ((struct pair_s*)(hmap).table->elems) + i; \
             key_t key     = pair->key; \
@@ -49,17 +52,18 @@
     } \
     static inline bool hmap##_insert(hmap##_t* map, key_t k, value_t v) { \
         if (!map->table) *map = hmap##_create(); \
-        struct { key_t key; value_t value; } elem = { .key = k, .value = v }; \
-        return htable_insert(map->table, &elem, hash(&elem)); \
+        struct pair_s { key_t key; value_t value; } elem = { .key = k, .value = v }; \
+        return htable_insert_with(map->table, &elem, hash(&elem), sizeof(struct pair_s), cmp); \
     } \
     static inline bool hmap##_remove(hmap##_t* map, key_t k) { \
         if (!map->table) return false; \
-        return htable_remove(map->table, &k, hash(&k)); \
+        struct pair_s { key_t key; value_t value; }; \
+        return htable_remove_with(map->table, &k, hash(&k), sizeof(struct pair_s), cmp); \
     } \
     static inline const value_t* hmap##_lookup(const hmap##_t* map, key_t k) { \
         if (!map->table) return NULL; \
-        size_t index = htable_lookup(map->table, &k, hash(&k)); \
-        struct pair_s { key_t key; const value_t value; };\
+        struct pair_s { key_t key; const value_t value; }; \
+        size_t index = htable_lookup_with(map->table, &k, hash(&k), sizeof(struct pair_s), cmp); \
         return index != INVALID_INDEX ? &((struct pair_s*)map->table->elems)[index].value : NULL; \
     } \
     static inline void hmap##_swap(hmap##_t* a, hmap##_t* b) { \
@@ -79,7 +83,7 @@
 
 #define FORALL_HSET(hset, value_t, value, ...) \
     for (size_t i = 0; i < (hset).table->cap; ++i) { \
-        if ((hset).table->hashes[i] & OCCUPIED_HASH_MASK) { \
+        if (htable_is_occupied((hset).table, i)) { \
             value_t value = ((value_t*)(hset).table->elems)[i]; \
             __VA_ARGS__ \
         } \
@@ -108,15 +112,15 @@
     } \
     static inline bool hset##_insert(hset##_t* set, value_t v) { \
         if (!set->table) *set = hset##_create(); \
-        return htable_insert(set->table, &v, hash(&v)); \
+        return htable_insert_with(set->table, &v, hash(&v), sizeof(value_t), cmp); \
     } \
     static inline bool hset##_remove(hset##_t* set, value_t v) { \
         if (!set->table) return false; \
-        return htable_remove(set->table, &v, hash(&v)); \
+        return htable_remove_with(set->table, &v, hash(&v), sizeof(value_t), cmp); \
     } \
     static inline const value_t* hset##_lookup(const hset##_t* set, value_t v) { \
         if (!set->table) return NULL; \
-        size_t index = htable_lookup(set->table, &v, hash(&v)); \
+        size_t index = htable_lookup_with(set->table, &v, hash(&v), sizeof(value_t), cmp); \
         return index != INVALID_INDEX ? &((const value_t*)set->table->elems)[index] : NULL; \
     } \
     static inline void hset##_swap(hset##_t* a, hset##_t* b) { \
@@ -134,6 +138,201 @@
     } \
     HSET(hset, value_t, hset##_cmp, hset##_hash)
 
+#define FORALL_OHSET(ohset, value_t, value, ...) \
+    for (size_t i = 0; i < (ohset).nentries; ++i) { \
+        if ((ohset).entries[i].live) { \
+            value_t value = (ohset).entries[i].elem; \
+            __VA_ARGS__ \
+        } \
+    }
+
+// Ordered hash sets keep their elements in a dense array, in insertion order,
+// and use a hash table to map each element to its index in that array.
+// Removed elements leave holes, which are compacted when they become the majority.
+#define OHSET(ohset, value_t, cmp, hash) \
+    typedef struct { value_t value; uint32_t index; } ohset##_index_t; \
+    typedef struct { value_t elem; bool live; } ohset##_entry_t; \
+    typedef struct { htable_t* table; size_t nelems; size_t nentries; size_t cap; ohset##_entry_t* entries; } ohset##_t; \
+    static inline ohset##_t ohset##_create_with_cap(size_t cap) { \
+        return (ohset##_t) { \
+            .table = cap > 0 ? htable_create(sizeof(ohset##_index_t), cap, cmp) : NULL, \
+            .nelems = 0, \
+            .nentries = 0, \
+            .cap = cap, \
+            .entries = cap > 0 ? xmalloc(sizeof(ohset##_entry_t) * cap) : NULL \
+        }; \
+    } \
+    static inline ohset##_t ohset##_create(void) { \
+        return ohset##_create_with_cap(OHSET_DEFAULT_CAP); \
+    } \
+    static inline void ohset##_destroy(ohset##_t* set) { \
+        if (set->table) htable_destroy(set->table); \
+        free(set->entries); \
+    } \
+    static inline void ohset##_clear(ohset##_t* set) { \
+        if (set->table) htable_clear(set->table); \
+        set->nelems = set->nentries = 0; \
+    } \
+    static inline bool ohset##_insert(ohset##_t* set, value_t v) { \
+        if (!set->table) *set = ohset##_create(); \
+        ohset##_index_t elem = { .value = v, .index = set->nentries }; \
+        if (!htable_insert_with(set->table, &elem, hash(&elem), sizeof(ohset##_index_t), cmp)) \
+            return false; \
+        if (set->nentries >= set->cap) { \
+            set->cap *= 2; \
+            set->entries = xrealloc(set->entries, sizeof(ohset##_entry_t) * set->cap); \
+        } \
+        set->entries[set->nentries++] = (ohset##_entry_t) { .elem = v, .live = true }; \
+        set->nelems++; \
+        return true; \
+    } \
+    static inline void ohset##_compact(ohset##_t* set) { \
+        uint32_t* indices = xmalloc(sizeof(uint32_t) * set->nentries); \
+        size_t nentries = 0; \
+        for (size_t i = 0; i < set->nentries; ++i) { \
+            indices[i] = nentries; \
+            if (set->entries[i].live) \
+                set->entries[nentries++] = set->entries[i]; \
+        } \
+        for (size_t i = 0; i < set->table->cap; ++i) { \
+            if (htable_is_occupied(set->table, i)) { \
+                ohset##_index_t* elem = ((ohset##_index_t*)set->table->elems) + i; \
+                elem->index = indices[elem->index]; \
+            } \
+        } \
+        set->nentries = nentries; \
+        free(indices); \
+    } \
+    static inline bool ohset##_remove(ohset##_t* set, value_t v) { \
+        if (!set->table) return false; \
+        size_t index = htable_lookup_with(set->table, &v, hash(&v), sizeof(ohset##_index_t), cmp); \
+        if (index == INVALID_INDEX) return false; \
+        set->entries[((ohset##_index_t*)set->table->elems)[index].index].live = false; \
+        htable_remove_by_index(set->table, index); \
+        set->nelems--; \
+        /* Removing the last elements, as when undoing insertions, leaves no hole */ \
+        while (set->nentries > 0 && !set->entries[set->nentries - 1].live) \
+            set->nentries--; \
+        if ((set->nentries - set->nelems) * 2 > set->nentries) \
+            ohset##_compact(set); \
+        return true; \
+    } \
+    static inline const value_t* ohset##_lookup(const ohset##_t* set, value_t v) { \
+        if (!set->table) return NULL; \
+        size_t index = htable_lookup_with(set->table, &v, hash(&v), sizeof(ohset##_index_t), cmp); \
+        return index != INVALID_INDEX ? &set->entries[((ohset##_index_t*)set->table->elems)[index].index].elem : NULL; \
+    }
+
+// Bit sets and sparse sets store values identified by a small integer,
+// which the given function computes. Their size is proportional to the
+// largest identifier, but membership tests do not require any hashing.
+#define BITSET(bitset, value_t, id) \
+    typedef struct { size_t nwords; uint64_t* words; } bitset##_t; \
+    static inline bitset##_t bitset##_create_with_cap(size_t cap) { \
+        size_t nwords = (cap + 63) / 64; \
+        return (bitset##_t) { \
+            .nwords = nwords, \
+            .words = nwords > 0 ? xcalloc(nwords, sizeof(uint64_t)) : NULL \
+        }; \
+    } \
+    static inline bitset##_t bitset##_create(void) { \
+        return bitset##_create_with_cap(BITSET_DEFAULT_CAP); \
+    } \
+    static inline void bitset##_destroy(bitset##_t* set) { \
+        free(set->words); \
+    } \
+    static inline void bitset##_clear(bitset##_t* set) { \
+        memset(set->words, 0, sizeof(uint64_t) * set->nwords); \
+    } \
+    static inline bool bitset##_insert(bitset##_t* set, value_t v) { \
+        size_t i = id(v); \
+        if (i / 64 >= set->nwords) { \
+            size_t nwords = set->nwords > 0 ? set->nwords : 1; \
+            while (i / 64 >= nwords) nwords *= 2; \
+            set->words = xrealloc(set->words, sizeof(uint64_t) * nwords); \
+            memset(set->words + set->nwords, 0, sizeof(uint64_t) * (nwords - set->nwords)); \
+            set->nwords = nwords; \
+        } \
+        uint64_t bit = UINT64_C(1) << (i % 64); \
+        bool inserted = !(set->words[i / 64] & bit); \
+        set->words[i / 64] |= bit; \
+        return inserted; \
+    } \
+    static inline bool bitset##_remove(bitset##_t* set, value_t v) { \
+        size_t i = id(v); \
+        if (i / 64 >= set->nwords) return false; \
+        uint64_t bit = UINT64_C(1) << (i % 64); \
+        bool removed = set->words[i / 64] & bit; \
+        set->words[i / 64] &= ~bit; \
+        return removed; \
+    } \
+    static inline bool bitset##_lookup(const bitset##_t* set, value_t v) { \
+        size_t i = id(v); \
+        return i / 64 < set->nwords && (set->words[i / 64] & (UINT64_C(1) << (i % 64))); \
+    }
+
+#define FORALL_SPARSE_SET(sset, value_t, value, ...) \
+    for (size_t i = 0; i < (sset).nelems; ++i) { \
+        value_t value = (sset).elems[i]; \
+        __VA_ARGS__ \
+    }
+
+// Sparse sets keep their elements in a dense array, which makes clearing
+// them and iterating over them proportional to the number of elements
+#define SPARSE_SET(sset, value_t, id) \
+    typedef struct { size_t cap; size_t nelems; value_t* elems; size_t nindices; uint32_t* indices; } sset##_t; \
+    static inline sset##_t sset##_create_with_cap(size_t cap) { \
+        return (sset##_t) { \
+            .cap = cap, \
+            .nelems = 0, \
+            .elems = cap > 0 ? xmalloc(sizeof(value_t) * cap) : NULL, \
+            .nindices = cap, \
+            .indices = cap > 0 ? xcalloc(cap, sizeof(uint32_t)) : NULL \
+        }; \
+    } \
+    static inline sset##_t sset##_create(void) { \
+        return sset##_create_with_cap(SPARSE_SET_DEFAULT_CAP); \
+    } \
+    static inline void sset##_destroy(sset##_t* set) { \
+        free(set->elems); \
+        free(set->indices); \
+    } \
+    static inline void sset##_clear(sset##_t* set) { \
+        set->nelems = 0; \
+    } \
+    static inline bool sset##_lookup(const sset##_t* set, value_t v) { \
+        size_t i = id(v); \
+        if (i >= set->nindices) return false; \
+        size_t index = set->indices[i]; \
+        return index < set->nelems && id(set->elems[index]) == i; \
+    } \
+    static inline bool sset##_insert(sset##_t* set, value_t v) { \
+        if (sset##_lookup(set, v)) return false; \
+        size_t i = id(v); \
+        if (i >= set->nindices) { \
+            size_t nindices = set->nindices > 0 ? set->nindices : 1; \
+            while (i >= nindices) nindices *= 2; \
+            set->indices = xrealloc(set->indices, sizeof(uint32_t) * nindices); \
+            memset(set->indices + set->nindices, 0, sizeof(uint32_t) * (nindices - set->nindices)); \
+            set->nindices = nindices; \
+        } \
+        if (set->nelems >= set->cap) { \
+            set->cap = set->cap > 0 ? set->cap * 2 : SPARSE_SET_DEFAULT_CAP; \
+            set->elems = xrealloc(set->elems, sizeof(value_t) * set->cap); \
+        } \
+        set->indices[i] = set->nelems; \
+        set->elems[set->nelems++] = v; \
+        return true; \
+    } \
+    static inline bool sset##_remove(sset##_t* set, value_t v) { \
+        if (!sset##_lookup(set, v)) return false; \
+        size_t index = set->indices[id(v)]; \
+        value_t last = set->elems[--set->nelems]; \
+        set->elems[index] = last; \
+        set->indices[id(last)] = index; \
+        return true; \
+    }
+
 #define FORALL_VEC(vec, value_t, value, ...) \
     for (size_t i = 0; i < vec.nelems; ++i) { \
         value_t value = vec.elems[i]; \
@@ -149,8 +348,9 @@
             .elems = cap > 0 ? xmalloc(sizeof(value_t) * cap) : NULL \
         }; \
     } \
+    /* Memory is only allocated on the first push */ \
     static inline vec##_t vec##_create(void) { \
-        return vec##_create_with_cap(VEC_DEFAULT_CAP); \
+        return vec##_create_with_cap(0); \
     } \
     static inline void vec##_destroy(vec##_t* vec) { \
         free(vec->elems); \
@@ -158,21 +358,22 @@
     static inline void vec##_clear(vec##_t* vec) { \
         vec->nelems = 0; \
     } \
-    static inline void vec##_push(vec##_t* vec, value_t v) { \
-        if (vec->nelems >= vec->cap) { \
-            vec->cap *= 2; \
+    static inline void vec##_reserve(vec##_t* vec, size_t cap) { \
+        if (cap > vec->cap) { \
+            size_t new_cap = vec->cap > 0 ? vec->cap * 2 : VEC_DEFAULT_CAP; \
+            vec->cap = new_cap > cap ? new_cap : cap; \
             vec->elems = xrealloc(vec->elems, sizeof(value_t) * vec->cap); \
         } \
+    } \
+    static inline void vec##_push(vec##_t* vec, value_t v) { \
+        vec##_reserve(vec, vec->nelems + 1); \
         vec->elems[vec->nelems++] = v; \
     } \
     static inline value_t vec##_pop(vec##_t* vec) { \
         return vec->elems[--vec->nelems]; \
     } \
     static inline void vec##_resize(vec##_t* vec, size_t nelems) { \
-        if (nelems > vec->cap) { \
-            vec->cap = nelems; \
-            vec->elems = xrealloc(vec->elems, sizeof(value_t) * vec->cap); \
-        } \
+        vec##_reserve(vec, nelems); \
         vec->nelems = nelems; \
     } \
     static inline void vec##_shrink(vec##_t* vec) { \
@@ -192,6 +393,49 @@
         *b = tmp; \
     }
 
+#define FORALL_SMALL_VEC(vec, value_t, value, ...) \
+    for (size_t i = 0; i < (vec).nelems; ++i) { \
+        value_t value = ((vec).heap_elems ? (vec).heap_elems : (vec).inline_elems)[i]; \
+        __VA_ARGS__ \
+    }
+
+// Small vectors store up to n elements inline, and only go to the heap when they grow past that.
+// Since they may be copied, the elements must be accessed through small_vec_elems().
+#define SMALL_VEC(vec, value_t, n) \
+    typedef struct { size_t cap; size_t nelems; value_t* heap_elems; value_t inline_elems[n]; } vec##_t; \
+    static inline vec##_t vec##_create(void) { \
+        return (vec##_t) { .cap = n, .nelems = 0, .heap_elems = NULL }; \
+    } \
+    static inline void vec##_destroy(vec##_t* vec) { \
+        free(vec->heap_elems); \
+    } \
+    static inline void vec##_clear(vec##_t* vec) { \
+        vec->nelems = 0; \
+    } \
+    static inline value_t* vec##_elems(vec##_t* vec) { \
+        return vec->heap_elems ? vec->heap_elems : vec->inline_elems; \
+    } \
+    static inline void vec##_reserve(vec##_t* vec, size_t cap) { \
+        if (cap > vec->cap) { \
+            size_t new_cap = vec->cap * 2 > cap ? vec->cap * 2 : cap; \
+            if (vec->heap_elems) { \
+                vec->heap_elems = xrealloc(vec->heap_elems, sizeof(value_t) * new_cap); \
+            } else { \
+                vec->heap_elems = xmalloc(sizeof(value_t) * new_cap); \
+                memcpy(vec->heap_elems, vec->inline_elems, sizeof(value_t) * vec->nelems); \
+            } \
+            vec->cap = new_cap; \
+        } \
+    } \
+    static inline void vec##_push(vec##_t* vec, value_t v) { \
+        vec##_reserve(vec, vec->nelems + 1); \
+        vec##_elems(vec)[vec->nelems++] = v; \
+    } \
+    static inline value_t vec##_pop(vec##_t* vec) { \
+        return vec##_elems(vec)[--vec->nelems]; \
+    }
+
+// Temporary buffers live on the stack when they are smaller than TMP_BUF_STACK_CAP bytes
 #define TMP_BUF_ALLOC(buf, value_t, n) \
     const bool buf##_on_stack = n * sizeof(value_t) <= TMP_BUF_STACK_CAP; \
     value_t buf##_elems[buf##_on_stack ? n : 1]; \
@@ -0,0 +1,412 @@
+#include <stdlib.h>
+
+#include "cfg.h"
+#include "util.h"
+
+VEC(index_vec, size_t)
+VEC(loop_vec, cfg_loop_t)
+
+static int compare_ids(const void* ptr1, const void* ptr2) {
+    uint32_t left  = (*(const node_t**)ptr1)->id;
+    uint32_t right = (*(const node_t**)ptr2)->id;
+    return left < right ? -1 : (left > right ? 1 : 0);
+}
+
+static inline void add_succ(index_vec_t* succs, size_t first, size_t block) {
+    for (size_t i = first; i < succs->nelems; ++i) {
+        if (succs->elems[i] == block)
+            return;
+    }
+    index_vec_push(succs, block);
+}
+
+// Adds the blocks that the given value may evaluate to, or that are stored in
+// it, to the successors, and returns true if it may evaluate to another function
+static bool add_targets(const cfg_t* cfg, const node_t* value, index_vec_t* succs, size_t first, size_t* ntargets, node_vec_t* stack, node_set_t* done) {
+    bool escapes = false;
+    node_set_clear(done);
+    node_set_insert(done, value);
+    node_vec_push(stack, value);
+    while (stack->nelems > 0) {
+        const node_t* node = node_vec_pop(stack);
+        size_t begin = 0, end = 0;
+        switch (node->tag) {
+            case NODE_FN:
+                {
+                    const size_t* block = cont2block_lookup(&cfg->cont2block, node);
+                    if (block) {
+                        add_succ(succs, first, *block);
+                        (*ntargets)++;
+                    } else
+                        escapes = true;
+                }
+                break;
+            case NODE_SELECT:
+                begin = 1, end = 3;
+                break;
+            case NODE_TUPLE:
+            case NODE_ARRAY:
+            case NODE_STRUCT:
+            case NODE_INSERT:
+                end = node->nops;
+                break;
+            default:
+                escapes |= node->type->tag == TYPE_FN;
+                break;
+        }
+        for (size_t i = begin; i < end; ++i) {
+            if (node_set_insert(done, node->ops[i]))
+                node_vec_push(stack, node->ops[i]);
+        }
+    }
+    return escapes;
+}
+
+static void add_succs(const cfg_t* cfg, size_t block, index_vec_t* succs, node_vec_t* stack, node_set_t* done) {
+    const node_t* body = cfg->blocks[block].cont->ops[0];
+    if (body->tag != NODE_APP)
+        return;
+    size_t first = succs->nelems, ncallees = 0, nconts = 0;
+    bool escapes = add_targets(cfg, body->ops[0], succs, first, &ncallees, stack, done);
+    add_targets(cfg, body->ops[1], succs, first, &nconts, stack, done);
+    if (escapes && nconts == 0)
+        add_succ(succs, first, cfg_exit(cfg));
+}
+
+// Post order of the blocks reachable from the given one, following either the
+// successors or the predecessors. Returns the number of blocks in that order.
+static size_t post_order(const cfg_t* cfg, size_t root, bool backward, size_t* order) {
+    size_t norder = 0;
+    size_t* next = xmalloc(sizeof(size_t) * cfg->nblocks);
+    for (size_t i = 0; i < cfg->nblocks; ++i)
+        next[i] = INVALID_INDEX;
+    index_vec_t stack = index_vec_create();
+    next[root] = 0;
+    index_vec_push(&stack, root);
+    while (stack.nelems > 0) {
+        size_t block = stack.elems[stack.nelems - 1];
+        const cfg_block_t* ptr = &cfg->blocks[block];
+        size_t nedges = backward ? ptr->npreds : ptr->nsuccs;
+        if (next[block] < nedges) {
+            size_t target = (backward ? ptr->preds : ptr->succs)[next[block]++];
+            if (next[target] == INVALID_INDEX) {
+                next[target] = 0;
+                index_vec_push(&stack, target);
+            }
+        } else {
+            order[norder++] = block;
+            index_vec_pop(&stack);
+        }
+    }
+    index_vec_destroy(&stack);
+    free(next);
+    return norder;
+}
+
+static inline size_t intersect(const size_t* doms, const size_t* numbers, size_t left, size_t right) {
+    while (left != right) {
+        while (numbers[left] < numbers[right])
+            left = doms[left];
+        while (numbers[right] < numbers[left])
+            right = doms[right];
+    }
+    return left;
+}
+
+// Cooper, Harvey and Kennedy's iterative algorithm, on the reversed graph for post-dominators
+static void compute_dominators(cfg_t* cfg, bool post) {
+    size_t root = post ? cfg_exit(cfg) : 0;
+    size_t* order   = xmalloc(sizeof(size_t) * cfg->nblocks);
+    size_t* numbers = xmalloc(sizeof(size_t) * cfg->nblocks);
+    size_t* doms    = xmalloc(sizeof(size_t) * cfg->nblocks);
+    for (size_t i = 0; i < cfg->nblocks; ++i)
+        doms[i] = INVALID_INDEX;
+    size_t norder = post_order(cfg, root, post, order);
+    for (size_t i = 0; i < norder; ++i)
+        numbers[order[i]] = i;
+
+    doms[root] = root;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        // Reverse post order, without the root, which comes last in post order
+        for (size_t i = norder - 1; i-- > 0;) {
+            size_t block = order[i];
+            const cfg_block_t* ptr = &cfg->blocks[block];
+            size_t nedges = post ? ptr->nsuccs : ptr->npreds;
+            const size_t* edges = post ? ptr->succs : ptr->preds;
+            size_t dom = INVALID_INDEX;
+            for (size_t j = 0; j < nedges; ++j) {
+                if (doms[edges[j]] == INVALID_INDEX)
+                    continue;
+                dom = dom == INVALID_INDEX ? edges[j] : intersect(doms, numbers, edges[j], dom);
+            }
+            if (doms[block] != dom) {
+                doms[block] = dom;
+                changed = true;
+            }
+        }
+    }
+    doms[root] = INVALID_INDEX;
+    for (size_t i = 0; i < cfg->nblocks; ++i) {
+        if (post) cfg->blocks[i].ipdom = doms[i];
+        else      cfg->blocks[i].idom  = doms[i];
+    }
+    free(order);
+    free(numbers);
+    free(doms);
+}
+
+static inline size_t outermost_loop(const loop_vec_t* loops, size_t loop) {
+    while (loops->elems[loop].parent != INVALID_INDEX)
+        loop = loops->elems[loop].parent;
+    return loop;
+}
+
+static void compute_loops(cfg_t* cfg) {
+    loop_vec_t loops = loop_vec_create();
+    index_vec_t blocks = index_vec_create();
+    index_vec_t stack = index_vec_create();
+    size_t* seen = xmalloc(sizeof(size_t) * cfg->nblocks);
+    for (size_t i = 0; i < cfg->nblocks; ++i)
+        seen[i] = INVALID_INDEX;
+
+    // Headers are dominated by the headers of the loops that contain them, so
+    // visiting them backwards in reverse post order finds inner loops first
+    for (size_t header = cfg->nreachable; header-- > 0;) {
+        const cfg_block_t* ptr = &cfg->blocks[header];
+        for (size_t i = 0; i < ptr->npreds; ++i) {
+            if (cfg_dominates(cfg, header, ptr->preds[i]))
+                index_vec_push(&stack, ptr->preds[i]);
+        }
+        if (stack.nelems == 0)
+            continue;
+
+        size_t loop = loops.nelems, first = blocks.nelems;
+        loop_vec_push(&loops, (cfg_loop_t) { .header = header, .parent = INVALID_INDEX, .blocks = NULL });
+        seen[header] = loop;
+        index_vec_push(&blocks, header);
+        cfg->blocks[header].loop = loop;
+        while (stack.nelems > 0) {
+            size_t block = index_vec_pop(&stack);
+            if (seen[block] == loop)
+                continue;
+            seen[block] = loop;
+            index_vec_push(&blocks, block);
+            // Blocks of inner loops are attached through the outermost loop that contains them
+            if (cfg->blocks[block].loop == INVALID_INDEX)
+                cfg->blocks[block].loop = loop;
+            else {
+                size_t inner = outermost_loop(&loops, cfg->blocks[block].loop);
+                if (inner != loop)
+                    loops.elems[inner].parent = loop;
+            }
+            const cfg_block_t* block_ptr = &cfg->blocks[block];
+            for (size_t i = 0; i < block_ptr->npreds; ++i) {
+                size_t pred = block_ptr->preds[i];
+                if (pred < cfg->nreachable && seen[pred] != loop)
+                    index_vec_push(&stack, pred);
+            }
+        }
+        // Blocks are attached once the walk is over, since the vector may grow
+        loops.elems[loop].nblocks = blocks.nelems - first;
+    }
+
+    // Parents are found after the loops they contain
+    size_t first = 0;
+    for (size_t i = 0; i < loops.nelems; ++i) {
+        loops.elems[i].blocks = blocks.elems + first;
+        first += loops.elems[i].nblocks;
+    }
+    for (size_t i = loops.nelems; i-- > 0;) {
+        size_t parent = loops.elems[i].parent;
+        loops.elems[i].depth = parent == INVALID_INDEX ? 1 : loops.elems[parent].depth + 1;
+    }
+    cfg->loops  = loops.elems;
+    cfg->nloops = loops.nelems;
+    cfg->loop_blocks = blocks.elems;
+    index_vec_destroy(&stack);
+    free(seen);
+}
+
+// The parent of a continuation is the one with the smallest scope that contains
+// it. Continuations with the same scope depend on each other's parameters, in
+// which case the first block is the parent of the others.
+static void compute_nesting(mod_t* mod, cfg_t* cfg, const scope_t* entry_scope) {
+    size_t nconts = cfg_exit(cfg);
+    size_t* sizes = xmalloc(sizeof(size_t) * nconts);
+    size_t* own   = xmalloc(sizeof(size_t) * nconts);
+    for (size_t i = 1; i < nconts; ++i) {
+        cfg->blocks[i].parent = 0;
+        sizes[i] = entry_scope->nodes.table->nelems;
+    }
+    own[0] = entry_scope->nodes.table->nelems;
+
+    scope_t scope = { .entry = NULL, .nodes = node_set_create() };
+    for (size_t block = 1; block < nconts; ++block) {
+        scope.entry = cfg->blocks[block].cont;
+        node_set_clear(&scope.nodes);
+        scope_compute(mod, &scope);
+        own[block] = scope.nodes.table->nelems;
+        FORALL_HSET(scope.nodes, const node_t*, node, {
+            size_t nested = node->tag == NODE_FN ? cfg_find_block(cfg, node) : INVALID_INDEX;
+            if (nested == INVALID_INDEX || nested == block || nested == 0)
+                continue;
+            if (nested < block && own[nested] == own[block])
+                continue;
+            if (own[block] < sizes[nested]) {
+                cfg->blocks[nested].parent = block;
+                sizes[nested] = own[block];
+            }
+        })
+    }
+    node_set_destroy(&scope.nodes);
+    free(sizes);
+    free(own);
+}
+
+cfg_t* cfg_compute(mod_t* mod, const scope_t* scope) {
+    // Continuations are numbered by identifier, and then in reverse post order
+    node_vec_t conts = node_vec_create();
+    node_vec_push(&conts, scope->entry);
+    FORALL_HSET(scope->nodes, const node_t*, node, {
+        if (node != scope->entry && node->tag == NODE_FN && type_is_cn(node->type))
+            node_vec_push(&conts, node);
+    })
+    qsort(conts.elems + 1, conts.nelems - 1, sizeof(const node_t*), compare_ids);
+
+    size_t nblocks = conts.nelems + 1;
+    cfg_t* cfg = xmalloc(sizeof(cfg_t));
+    cfg->entry      = scope->entry;
+    cfg->nblocks    = nblocks;
+    cfg->blocks     = xmalloc(sizeof(cfg_block_t) * nblocks);
+    cfg->cont2block = cont2block_create();
+    for (size_t i = 0; i < nblocks; ++i) {
+        cfg->blocks[i] = (cfg_block_t) {
+            .cont   = i < conts.nelems ? conts.elems[i] : NULL,
+            .idom   = INVALID_INDEX,
+            .ipdom  = INVALID_INDEX,
+            .parent = INVALID_INDEX,
+            .loop   = INVALID_INDEX
+        };
+        if (i < conts.nelems)
+            cont2block_insert(&cfg->cont2block, conts.elems[i], i);
+    }
+    node_vec_destroy(&conts);
+
+    index_vec_t succs = index_vec_create();
+    node_vec_t stack = node_vec_create();
+    node_set_t done = node_set_create();
+    size_t* offsets = xmalloc(sizeof(size_t) * (nblocks + 1));
+    for (size_t i = 0; i < nblocks; ++i) {
+        offsets[i] = succs.nelems;
+        if (cfg->blocks[i].cont)
+            add_succs(cfg, i, &succs, &stack, &done);
+    }
+    offsets[nblocks] = succs.nelems;
+    for (size_t i = 0; i < nblocks; ++i) {
+        cfg->blocks[i].succs  = succs.elems + offsets[i];
+        cfg->blocks[i].nsuccs = offsets[i + 1] - offsets[i];
+    }
+    node_vec_destroy(&stack);
+    node_set_destroy(&done);
+
+    // Renumber the blocks, keeping the exit last
+    size_t* order = xmalloc(sizeof(size_t) * nblocks);
+    size_t* new_indices = xmalloc(sizeof(size_t) * nblocks);
+    for (size_t i = 0; i < nblocks; ++i)
+        new_indices[i] = INVALID_INDEX;
+    size_t norder = post_order(cfg, 0, false, order), nreachable = 0;
+    for (size_t i = norder; i-- > 0;) {
+        if (order[i] != nblocks - 1)
+            new_indices[order[i]] = nreachable++;
+    }
+    size_t nindices = nreachable;
+    for (size_t i = 0; i < nblocks - 1; ++i) {
+        if (new_indices[i] == INVALID_INDEX)
+            new_indices[i] = nindices++;
+    }
+    new_indices[nblocks - 1] = nblocks - 1;
+
+    cfg_block_t* blocks = xmalloc(sizeof(cfg_block_t) * nblocks);
+    for (size_t i = 0; i < nblocks; ++i) {
+        blocks[new_indices[i]] = cfg->blocks[i];
+        blocks[new_indices[i]].npreds = 0;
+    }
+    cont2block_clear(&cfg->cont2block);
+    for (size_t i = 0; i < nblocks - 1; ++i)
+        cont2block_insert(&cfg->cont2block, blocks[i].cont, i);
+
+    // Successors are stored first, followed by the predecessors
+    size_t nedges = succs.nelems;
+    cfg->edges = xmalloc(sizeof(size_t) * (2 * nedges + 1));
+    size_t first = 0;
+    for (size_t i = 0; i < nblocks; ++i) {
+        size_t* edges = cfg->edges + first;
+        for (size_t j = 0; j < blocks[i].nsuccs; ++j) {
+            edges[j] = new_indices[blocks[i].succs[j]];
+            blocks[edges[j]].npreds++;
+        }
+        blocks[i].succs = edges;
+        first += blocks[i].nsuccs;
+    }
+    for (size_t i = 0; i < nblocks; ++i) {
+        offsets[i] = first;
+        blocks[i].preds = cfg->edges + first;
+        first += blocks[i].npreds;
+    }
+    for (size_t i = 0; i < nblocks; ++i) {
+        for (size_t j = 0; j < blocks[i].nsuccs; ++j)
+            cfg->edges[offsets[blocks[i].succs[j]]++] = i;
+    }
+    free(cfg->blocks);
+    cfg->blocks = blocks;
+    cfg->nreachable = nreachable;
+    index_vec_destroy(&succs);
+    free(offsets);
+    free(order);
+    free(new_indices);
+
+    compute_dominators(cfg, false);
+    compute_dominators(cfg, true);
+    compute_loops(cfg);
+    compute_nesting(mod, cfg, scope);
+    return cfg;
+}
+
+void cfg_destroy(cfg_t* cfg) {
+    cont2block_destroy(&cfg->cont2block);
+    free(cfg->blocks);
+    free(cfg->edges);
+    free(cfg->loops);
+    free(cfg->loop_blocks);
+    free(cfg);
+}
+
+const cfg_t* cfg_get(mod_t* mod, const node_t* fn) {
+    cached_scope_t* cached = (cached_scope_t*)scope_get(mod, fn);
+    if (!cached->cfg)
+        cached->cfg = cfg_compute(mod, &cached->scope);
+    return cached->cfg;
+}
+
+size_t cfg_find_block(const cfg_t* cfg, const node_t* cont) {
+    const size_t* block = cont2block_lookup(&cfg->cont2block, cont);
+    return block ? *block : INVALID_INDEX;
+}
+
+bool cfg_dominates(const cfg_t* cfg, size_t dom, size_t block) {
+    for (; block != INVALID_INDEX; block = cfg->blocks[block].idom) {
+        if (block == dom)
+            return true;
+    }
+    return false;
+}
+
+bool cfg_post_dominates(const cfg_t* cfg, size_t pdom, size_t block) {
+    for (; block != INVALID_INDEX; block = cfg->blocks[block].ipdom) {
+        if (block == pdom)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,66 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include "scope.h"
+
+typedef struct cfg_block_s cfg_block_t;
+typedef struct cfg_loop_s  cfg_loop_t;
+
+HMAP_DEFAULT(cont2block, const node_t*, size_t)
+
+// Blocks are the continuations of a scope, along with the entry function and a
+// virtual exit. Indices that do not refer to any block are INVALID_INDEX.
+struct cfg_block_s {
+    const node_t* cont;     // NULL for the exit
+    const size_t* succs;
+    const size_t* preds;
+    size_t nsuccs;
+    size_t npreds;
+    size_t idom;            // Immediate dominator
+    size_t ipdom;           // Immediate post-dominator
+    size_t parent;          // Innermost continuation whose scope contains this one
+    size_t loop;            // Innermost loop that contains the block
+};
+
+// Natural loop, made of the blocks that reach a back edge to its header
+// without going through the header
+struct cfg_loop_s {
+    size_t header;
+    size_t parent;
+    size_t depth;           // One for outermost loops
+    const size_t* blocks;   // Starts with the header
+    size_t nblocks;
+};
+
+// A block jumps to the continuations that the callee of its body may evaluate
+// to, and to those passed as arguments, through which a call returns. Calls
+// to other functions go to the exit when no continuation is passed to them.
+struct cfg_s {
+    const node_t* entry;
+    cfg_block_t*  blocks;       // Reachable blocks come first, in reverse post order
+    size_t        nblocks;      // Including the exit, which is the last block
+    size_t        nreachable;   // Number of blocks reachable from the entry
+    cfg_loop_t*   loops;        // Inner loops come before the loops that contain them
+    size_t        nloops;
+    cont2block_t  cont2block;
+    size_t*       edges;
+    size_t*       loop_blocks;
+};
+
+cfg_t* cfg_compute(mod_t*, const scope_t*);
+void cfg_destroy(cfg_t*);
+
+// Returns the control flow graph of a function, which is cached along with its
+// scope (see scope_get()) and may be used until that scope is requested again
+const cfg_t* cfg_get(mod_t*, const node_t*);
+
+// Returns the block of a continuation, or INVALID_INDEX if it is not in the graph
+size_t cfg_find_block(const cfg_t*, const node_t*);
+bool cfg_dominates(const cfg_t*, size_t, size_t);
+bool cfg_post_dominates(const cfg_t*, size_t, size_t);
+
+static inline size_t cfg_exit(const cfg_t* cfg) {
+    return cfg->nblocks - 1;
+}
+
+#endif // CFG_H
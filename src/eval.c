@@ -124,7 +124,7 @@ bool partial_eval(mod_t* mod) {
         node2node_insert(&new_nodes, &fn->node, &fn->node);
         node2node_insert(&new_nodes, node_param(mod, fn, NULL), app->ops[1]);
 
-        node_replace(app, node_rewrite(mod, fn->node.ops[0], &new_nodes, &new_types, REWRITE_FNS));
+        node_replace(mod, app, node_rewrite(mod, fn->node.ops[0], &new_nodes, &new_types, REWRITE_FNS));
     })
     node_set_destroy(&scope.nodes);
     node_set_destroy(&fvs);
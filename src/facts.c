@@ -0,0 +1,426 @@
+#include "facts.h"
+#include "util.h"
+
+static inline bool is_int(const type_t* type) {
+    return type_is_i(type) || type_is_u(type);
+}
+
+static inline bool is_signed(const type_t* type) {
+    return type_is_i(type) && type->tag != TYPE_BOOL;
+}
+
+static inline uint64_t low_bits(size_t n) {
+    return n >= 64 ? UINT64_MAX : (UINT64_C(1) << n) - 1;
+}
+
+static inline uint64_t width_mask(const type_t* type) {
+    return low_bits(type_bitwidth(type));
+}
+
+// Sign bit of the type, or 0 for unsigned types
+static inline uint64_t sign_bit(const type_t* type) {
+    return is_signed(type) ? UINT64_C(1) << (type_bitwidth(type) - 1) : 0;
+}
+
+// Value of the type represented on 64 bits, as in the bounds of the facts
+static inline uint64_t canonical(const type_t* type, uint64_t value) {
+    value &= width_mask(type);
+    return value & sign_bit(type) ? value | ~width_mask(type) : value;
+}
+
+// Compares two values of the type, in the order of the type
+static inline bool less(const type_t* type, uint64_t left, uint64_t right) {
+    if (is_signed(type))
+        return (int64_t)left < (int64_t)right;
+    return left < right;
+}
+
+// Sets every bit below the highest bit set
+static inline uint64_t smear(uint64_t value) {
+    value |= value >> 1;
+    value |= value >> 2;
+    value |= value >> 4;
+    value |= value >> 8;
+    value |= value >> 16;
+    value |= value >> 32;
+    return value;
+}
+
+// Number of low bits that are known to be zero
+static inline size_t trailing_zeros(const type_t* type, const node_facts_t* facts) {
+    size_t w = type_bitwidth(type), n = 0;
+    while (n < w && (facts->zeros >> n) & 1) n++;
+    return n;
+}
+
+static inline node_facts_t top(const type_t* type) {
+    return (node_facts_t) {
+        .zeros = 0,
+        .ones  = 0,
+        .min   = canonical(type, sign_bit(type)),
+        .max   = width_mask(type) & ~sign_bit(type)
+    };
+}
+
+static inline node_facts_t exact(const type_t* type, uint64_t value) {
+    value = canonical(type, value);
+    return (node_facts_t) {
+        .zeros = ~value & width_mask(type),
+        .ones  =  value & width_mask(type),
+        .min   = value,
+        .max   = value
+    };
+}
+
+// Makes the bits and the bounds agree with each other
+static node_facts_t normalize(const type_t* type, node_facts_t facts) {
+    uint64_t mask = width_mask(type);
+    uint64_t sign = sign_bit(type);
+    // The bits give bounds where the unknown bits are either all set or all clear
+    uint64_t unknown = mask & ~(facts.zeros | facts.ones);
+    uint64_t min = canonical(type, facts.ones | (unknown & sign));
+    uint64_t max = canonical(type, facts.ones | (unknown & ~sign));
+    if (less(type, facts.min, min)) facts.min = min;
+    if (less(type, max, facts.max)) facts.max = max;
+    // The values between the bounds all share the leading bits of the bounds
+    uint64_t common = mask & ~smear((facts.min ^ facts.max) & mask);
+    facts.zeros |= common & ~facts.min;
+    facts.ones  |= common &  facts.min;
+    // Contradictions can only happen in code that never runs
+    if (less(type, facts.max, facts.min) || (facts.zeros & facts.ones))
+        return top(type);
+    return facts;
+}
+
+// Sets bounds computed on 64 bits, unless the operation can wrap around
+static inline void set_bounds(const type_t* type, node_facts_t* facts, int64_t min, int64_t max) {
+    if (canonical(type, (uint64_t)min) == (uint64_t)min &&
+        canonical(type, (uint64_t)max) == (uint64_t)max) {
+        facts->min = (uint64_t)min;
+        facts->max = (uint64_t)max;
+    }
+}
+
+// Returns 1 if the comparison always holds, 0 if it never does, and -1 otherwise
+static int compare(uint32_t tag, const type_t* type, const node_facts_t* left, const node_facts_t* right) {
+    bool lt = less(type, left->max, right->min);
+    bool gt = less(type, right->max, left->min);
+    bool le = !less(type, right->min, left->max);
+    bool ge = !less(type, left->min, right->max);
+    bool eq = node_facts_is_const(left) && node_facts_is_const(right) && left->min == right->min;
+    bool ne = lt || gt || (left->zeros & right->ones) || (left->ones & right->zeros);
+    switch (tag) {
+        case NODE_CMPGT: return gt ? 1 : le ? 0 : -1;
+        case NODE_CMPGE: return ge ? 1 : lt ? 0 : -1;
+        case NODE_CMPLT: return lt ? 1 : ge ? 0 : -1;
+        case NODE_CMPLE: return le ? 1 : gt ? 0 : -1;
+        case NODE_CMPNE: return ne ? 1 : eq ? 0 : -1;
+        case NODE_CMPEQ: return eq ? 1 : ne ? 0 : -1;
+        default:
+            assert(false);
+            return -1;
+    }
+}
+
+static node_facts_t eval(uint32_t tag, const type_t* type, const node_t** ops, const node_facts_t* op_facts) {
+    const node_facts_t* a = &op_facts[0];
+    const node_facts_t* b = &op_facts[1];
+    size_t w = type_bitwidth(type);
+    uint64_t mask = width_mask(type);
+    node_facts_t res = top(type);
+    switch (tag) {
+        case NODE_CMPGT:
+        case NODE_CMPGE:
+        case NODE_CMPLT:
+        case NODE_CMPLE:
+        case NODE_CMPNE:
+        case NODE_CMPEQ:
+            {
+                int cmp = compare(tag, ops[0]->type, a, b);
+                return cmp < 0 ? top(type) : exact(type, cmp);
+            }
+        case NODE_EXTEND:
+            {
+                const type_t* from = ops[0]->type;
+                // Booleans are extended to 0 or -1
+                if (from->tag == TYPE_BOOL) {
+                    if (node_facts_is_const(a))
+                        return exact(type, a->min ? UINT64_MAX : 0);
+                    res.min = UINT64_MAX;
+                    res.max = 0;
+                    break;
+                }
+                if (is_signed(from)) {
+                    res.zeros = canonical(from, a->zeros) & mask;
+                    res.ones  = canonical(from, a->ones)  & mask;
+                } else {
+                    res.zeros = a->zeros | (mask & ~width_mask(from));
+                    res.ones  = a->ones;
+                }
+                res.min = a->min;
+                res.max = a->max;
+            }
+            break;
+        case NODE_TRUNC:
+            res.zeros = a->zeros & mask;
+            res.ones  = a->ones  & mask;
+            // The bounds stay the same when they can be represented in the smaller type
+            if (canonical(type, a->min) == a->min && canonical(type, a->max) == a->max) {
+                res.min = a->min;
+                res.max = a->max;
+            }
+            break;
+        case NODE_AND:
+            res.zeros = a->zeros | b->zeros;
+            res.ones  = a->ones  & b->ones;
+            if (!is_signed(type))
+                res.max = a->max < b->max ? a->max : b->max;
+            break;
+        case NODE_OR:
+            res.zeros = a->zeros & b->zeros;
+            res.ones  = a->ones  | b->ones;
+            if (!is_signed(type))
+                res.min = a->min > b->min ? a->min : b->min;
+            break;
+        case NODE_XOR:
+            res.zeros = (a->zeros & b->zeros) | (a->ones & b->ones);
+            res.ones  = (a->zeros & b->ones)  | (a->ones & b->zeros);
+            break;
+        case NODE_ADD:
+        case NODE_SUB:
+            {
+                // The low bits that are zero in both operands stay zero
+                size_t tz_a = trailing_zeros(type, a), tz_b = trailing_zeros(type, b);
+                res.zeros = low_bits(tz_a < tz_b ? tz_a : tz_b);
+                if (!is_signed(type)) {
+                    if (tag == NODE_ADD && a->max <= mask - b->max) {
+                        res.min = a->min + b->min;
+                        res.max = a->max + b->max;
+                    } else if (tag == NODE_SUB && a->min >= b->max) {
+                        res.min = a->min - b->max;
+                        res.max = a->max - b->min;
+                    }
+                } else if (w <= 32) {
+                    int64_t a_min = (int64_t)a->min, a_max = (int64_t)a->max;
+                    int64_t b_min = (int64_t)b->min, b_max = (int64_t)b->max;
+                    if (tag == NODE_ADD)
+                        set_bounds(type, &res, a_min + b_min, a_max + b_max);
+                    else
+                        set_bounds(type, &res, a_min - b_max, a_max - b_min);
+                }
+            }
+            break;
+        case NODE_MUL:
+            res.zeros = low_bits(trailing_zeros(type, a) + trailing_zeros(type, b)) & mask;
+            if (!is_signed(type)) {
+                if (b->max == 0 || a->max <= mask / b->max) {
+                    res.min = a->min * b->min;
+                    res.max = a->max * b->max;
+                }
+            } else if (w <= 32) {
+                int64_t p[] = {
+                    (int64_t)a->min * (int64_t)b->min,
+                    (int64_t)a->min * (int64_t)b->max,
+                    (int64_t)a->max * (int64_t)b->min,
+                    (int64_t)a->max * (int64_t)b->max
+                };
+                int64_t min = p[0], max = p[0];
+                for (size_t i = 1; i < 4; ++i) {
+                    min = p[i] < min ? p[i] : min;
+                    max = p[i] > max ? p[i] : max;
+                }
+                set_bounds(type, &res, min, max);
+            }
+            break;
+        case NODE_DIV:
+        case NODE_REM:
+            // Only non-negative dividends and positive divisors are considered
+            if ((is_signed(type) && (int64_t)a->min < 0) || !less(type, 0, b->min))
+                break;
+            if (tag == NODE_DIV) {
+                res.min = a->min / b->max;
+                res.max = a->max / b->min;
+            } else {
+                res.min = 0;
+                res.max = a->max < b->max - 1 ? a->max : b->max - 1;
+            }
+            break;
+        case NODE_LSHFT:
+            if (node_facts_is_const(b) && b->min < w) {
+                size_t k = b->min;
+                res.zeros = ((a->zeros << k) | low_bits(k)) & mask;
+                res.ones  = (a->ones << k) & mask;
+                if (!is_signed(type) && a->max <= mask >> k) {
+                    res.min = a->min << k;
+                    res.max = a->max << k;
+                }
+            } else {
+                res.zeros = low_bits(trailing_zeros(type, a));
+            }
+            break;
+        case NODE_RSHFT:
+            if (node_facts_is_const(b) && b->min < w) {
+                size_t k = b->min;
+                if (is_signed(type)) {
+                    res.zeros = (uint64_t)((int64_t)canonical(type, a->zeros) >> k) & mask;
+                    res.ones  = (uint64_t)((int64_t)canonical(type, a->ones)  >> k) & mask;
+                    res.min = (uint64_t)((int64_t)a->min >> k);
+                    res.max = (uint64_t)((int64_t)a->max >> k);
+                } else {
+                    res.zeros = (a->zeros >> k) | (mask & ~(mask >> k));
+                    res.ones  = a->ones >> k;
+                    res.min = a->min >> k;
+                    res.max = a->max >> k;
+                }
+            } else if (!less(type, a->min, 0)) {
+                // Shifting moves the value towards zero
+                res.min = 0;
+                res.max = a->max;
+            } else if (less(type, a->max, 0)) {
+                res.min = a->min;
+                res.max = UINT64_MAX;
+            } else {
+                res.min = a->min;
+                res.max = a->max;
+            }
+            break;
+        case NODE_SELECT:
+            {
+                const node_facts_t* c = &op_facts[0];
+                const node_facts_t* t = &op_facts[1];
+                const node_facts_t* f = &op_facts[2];
+                if (node_facts_is_const(c))
+                    return c->min ? *t : *f;
+                res.zeros = t->zeros & f->zeros;
+                res.ones  = t->ones  & f->ones;
+                res.min = less(type, t->min, f->min) ? t->min : f->min;
+                res.max = less(type, t->max, f->max) ? f->max : t->max;
+            }
+            break;
+        default:
+            break;
+    }
+    return normalize(type, res);
+}
+
+// Returns true if the facts about the node are computed from those of its operands
+static inline bool depends_on_ops(const node_t* node) {
+    switch (node->tag) {
+        case NODE_CMPGT:
+        case NODE_CMPGE:
+        case NODE_CMPLT:
+        case NODE_CMPLE:
+        case NODE_CMPNE:
+        case NODE_CMPEQ:
+            return is_int(node->ops[0]->type);
+        case NODE_EXTEND:
+        case NODE_TRUNC:
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_REM:
+        case NODE_AND:
+        case NODE_OR:
+        case NODE_XOR:
+        case NODE_LSHFT:
+        case NODE_RSHFT:
+        case NODE_SELECT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static node_facts_t facts_uncached(const node_t* node, size_t depth) {
+    if (node->tag == NODE_LITERAL)
+        return exact(node->type, node_value_u(node));
+    if (!depends_on_ops(node))
+        return top(node->type);
+    node_facts_t op_facts[3];
+    assert(node->nops <= 3);
+    for (size_t i = 0; i < node->nops; ++i) {
+        op_facts[i] = depth > 0 || node->ops[i]->tag == NODE_LITERAL
+            ? facts_uncached(node->ops[i], depth > 0 ? depth - 1 : 0)
+            : top(node->ops[i]->type);
+    }
+    return eval(node->tag, node->type, node->ops, op_facts);
+}
+
+static inline const node_facts_t* lookup_facts(const mod_t* mod, const node_t* node) {
+    if (node->id >= mod->facts_cache.nelems)
+        return NULL;
+    const node_facts_t* facts = &mod->facts_cache.elems[node->id];
+    // Entries that have not been computed yet are contradictory
+    return facts->zeros & facts->ones ? NULL : facts;
+}
+
+static inline void insert_facts(mod_t* mod, const node_t* node, node_facts_t facts) {
+    size_t nelems = mod->facts_cache.nelems;
+    if (node->id >= nelems) {
+        facts_cache_resize(&mod->facts_cache, node->id + 1);
+        for (size_t i = nelems; i < node->id; ++i)
+            mod->facts_cache.elems[i] = (node_facts_t) { .zeros = UINT64_MAX, .ones = UINT64_MAX };
+    }
+    mod->facts_cache.elems[node->id] = facts;
+}
+
+node_facts_t node_facts(mod_t* mod, const node_t* node) {
+    assert(is_int(node->type));
+    // In concurrent mode, the cache of the module cannot be shared
+    if (mod->conc)
+        return facts_uncached(node, MOD_FACTS_DEPTH);
+    const node_facts_t* cached = lookup_facts(mod, node);
+    if (cached)
+        return *cached;
+
+    // Post order walk over the operands whose facts are not known yet
+    node_small_vec_t stack = node_small_vec_create();
+    node_small_vec_push(&stack, node);
+    while (stack.nelems > 0) {
+        const node_t* cur = node_small_vec_elems(&stack)[stack.nelems - 1];
+        if (lookup_facts(mod, cur)) {
+            node_small_vec_pop(&stack);
+            continue;
+        }
+        if (!depends_on_ops(cur)) {
+            insert_facts(mod, cur, facts_uncached(cur, 0));
+            node_small_vec_pop(&stack);
+            continue;
+        }
+        size_t nelems = stack.nelems;
+        for (size_t i = 0; i < cur->nops; ++i) {
+            if (!lookup_facts(mod, cur->ops[i]))
+                node_small_vec_push(&stack, cur->ops[i]);
+        }
+        if (stack.nelems != nelems)
+            continue;
+        node_facts_t op_facts[3];
+        assert(cur->nops <= 3);
+        for (size_t i = 0; i < cur->nops; ++i)
+            op_facts[i] = *lookup_facts(mod, cur->ops[i]);
+        insert_facts(mod, cur, eval(cur->tag, cur->type, cur->ops, op_facts));
+        node_small_vec_pop(&stack);
+    }
+    node_small_vec_destroy(&stack);
+    return *lookup_facts(mod, node);
+}
+
+bool node_facts_is_const(const node_facts_t* facts) {
+    return facts->min == facts->max;
+}
+
+const node_t* node_fold_facts(mod_t* mod, uint32_t tag, const type_t* type, size_t nops, const node_t** ops) {
+    assert(nops <= 3);
+    // Only integers and booleans are tracked
+    if (!is_int(type))
+        return NULL;
+    node_facts_t op_facts[3];
+    for (size_t i = 0; i < nops; ++i) {
+        if (!is_int(ops[i]->type))
+            return NULL;
+        op_facts[i] = node_facts(mod, ops[i]);
+    }
+    node_facts_t facts = eval(tag, type, ops, op_facts);
+    return node_facts_is_const(&facts) ? node_int_literal(mod, type, facts.min) : NULL;
+}
@@ -0,0 +1,17 @@
+#ifndef FACTS_H
+#define FACTS_H
+
+#include "node.h"
+
+// Known bits and bounds of the value of an integer or boolean node. They are
+// computed lazily from the operands, and cached in the module by identifier.
+node_facts_t node_facts(mod_t*, const node_t*);
+
+// Returns true if the facts only allow one value, which is then their minimum
+bool node_facts_is_const(const node_facts_t*);
+
+// Returns the literal that the given operation would always produce, according
+// to the facts about its operands, or NULL if there is no such literal
+const node_t* node_fold_facts(mod_t*, uint32_t, const type_t*, size_t, const node_t**);
+
+#endif // FACTS_H
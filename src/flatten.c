@@ -155,7 +155,7 @@ bool flatten_tuples(mod_t* mod) {
         use_t* use = fn->node.uses;
         while (use) {
             if (use->user != flat_fn->ops[0])
-                node_replace(use->user, node_rewrite(mod, use->user, &new_nodes, &new_types, 0));
+                node_replace(mod, use->user, node_rewrite(mod, use->user, &new_nodes, &new_types, 0));
             use = use->next;
         }
     })
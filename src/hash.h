@@ -1,46 +1,74 @@
 #ifndef HASH_H
 #define HASH_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+// Hashing is done one 64-bit word at a time, by mixing each word into the
+// current hash with a multiplication (as in wyhash). Smaller integers and
+// trailing bytes are zero-extended to 64 bits.
+#define HASH_SECRET0 UINT64_C(0xa0761d6478bd642f)
+#define HASH_SECRET1 UINT64_C(0xe7037ed1a0b428db)
+
+static inline uint64_t hash_mum(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    // Portable 64x64 -> 128 bits multiplication
+    uint64_t ha = a >> 32, la = (uint32_t)a;
+    uint64_t hb = b >> 32, lb = (uint32_t)b;
+    uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+    uint64_t mid = (ll >> 32) + (uint32_t)hl + (uint32_t)lh;
+    uint64_t lo = (mid << 32) | (uint32_t)ll;
+    uint64_t hi = hh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+    return lo ^ hi;
+#endif
+}
 
 static inline uint32_t hash_init() {
     return 0x811C9DC5;
 }
 
+static inline uint32_t hash_uint64(uint32_t h, uint64_t d) {
+    uint64_t r = hash_mum(h ^ HASH_SECRET0, d ^ HASH_SECRET1);
+    return (uint32_t)(r ^ (r >> 32));
+}
+
 static inline uint32_t hash_uint8(uint32_t h, uint8_t d) {
-    return (h * 16777619) ^ d;
+    return hash_uint64(h, d);
 }
 
 static inline uint32_t hash_uint16(uint32_t h, uint16_t d) {
-    return hash_uint8(hash_uint8(h, d), d >> 8);
+    return hash_uint64(h, d);
 }
 
 static inline uint32_t hash_uint32(uint32_t h, uint32_t d) {
-    return hash_uint16(hash_uint16(h, d), d >> 16);
-}
-
-static inline uint32_t hash_uint64(uint32_t h, uint64_t d) {
-    return hash_uint32(hash_uint32(h, d), d >> 32);
+    return hash_uint64(h, d);
 }
 
 static inline uint32_t hash_bytes(uint32_t h, const void* ptr, size_t nbytes) {
     const uint8_t* byte_ptr = ptr;
-    for (size_t i = 0; i < nbytes; ++i, byte_ptr++)
-        h = hash_uint8(h, *byte_ptr);
+    for (; nbytes >= 8; nbytes -= 8, byte_ptr += 8) {
+        uint64_t d;
+        memcpy(&d, byte_ptr, 8);
+        h = hash_uint64(h, d);
+    }
+    if (nbytes > 0) {
+        uint64_t d = 0;
+        memcpy(&d, byte_ptr, nbytes);
+        h = hash_uint64(h, d ^ ((uint64_t)nbytes << 56));
+    }
     return h;
 }
 
 static inline uint32_t hash_ptr(uint32_t h, const void* ptr) {
-    return hash_bytes(h, &ptr, sizeof(void*));
+    return hash_uint64(h, (uintptr_t)ptr);
 }
 
 static inline uint32_t hash_str(uint32_t h, const char* ptr) {
-    char c = *ptr;
-    while (c != 0) {
-        h = hash_uint8(h, c);
-        c = *(++ptr);
-    }
-    return h;
+    return hash_bytes(h, ptr, strlen(ptr));
 }
 
 #endif // HASH_H
@@ -5,148 +5,136 @@
 #include "htable.h"
 #include "util.h"
 
-static inline void* htable_elem(void* elems, size_t index, size_t esize) {
-    return ((uint8_t*)elems) + index * esize;
+#define HTABLE_MIN_CAP       16
+// A clear is sparse when less than 1/HTABLE_SPARSE_RATIO of the slots are used
+#define HTABLE_SPARSE_RATIO  8
+// Number of consecutive sparse clears after which a table shrinks
+#define HTABLE_SHRINK_ROUNDS 8
+
+#ifdef HTABLE_SWISS
+
+// Number of groups probed before reaching the group of the given slot
+static inline size_t htable_slot_dib(const htable_t* table, size_t index) {
+    size_t group = htable_group(table->hashes[index], table->cap);
+    size_t dib = 0;
+    while (group != index / HTABLE_GROUP_SIZE) {
+        dib++;
+        group = (group + dib) & (htable_ngroups(table->cap) - 1);
+    }
+    return dib;
 }
 
-static inline size_t htable_index(uint32_t hash, size_t cap) {
-    return hash & (cap - 1);
+static void htable_alloc(htable_t* table, size_t cap) {
+    cap = cap < HTABLE_GROUP_SIZE ? HTABLE_GROUP_SIZE : cap;
+    table->cap      = cap;
+    table->nelems   = 0;
+    table->ndeleted = 0;
+    table->epoch    = 1;
+    table->elems    = xmalloc(table->esize * cap);
+    table->hashes   = xmalloc(sizeof(uint32_t) * cap);
+    table->ctrl     = xmalloc(cap);
+    table->epochs   = xcalloc(htable_ngroups(cap), sizeof(uint8_t));
+    memset(table->ctrl, HTABLE_CTRL_EMPTY, cap);
 }
 
-static inline size_t htable_dib(size_t index, size_t expected_index, size_t cap) {
-    return index < expected_index ? (cap + index) - expected_index : index - expected_index;
+static void htable_free(htable_t* table) {
+    free(table->elems);
+    free(table->hashes);
+    free(table->ctrl);
+    free(table->epochs);
 }
 
-static inline bool htable_insert_internal(const void* restrict elem, uint32_t hash,
-                                          void* restrict elems, uint32_t* hashes,
-                                          size_t esize, size_t cap,
-                                          cmpfn_t cmp_fn, bool cmp) {
-    size_t index  = htable_index(hash, cap);
-    size_t dib    = 0;
+static void htable_reset_epochs(htable_t* table) {
+    memset(table->epochs, 0, htable_ngroups(table->cap));
+    table->epoch = 1;
+}
 
-    uint8_t tmp_elem[esize];
-    uint8_t cur_elem[esize];
-    memcpy(cur_elem, elem, esize);
+void htable_rehash(htable_t* table, size_t new_cap) {
+    assert((new_cap & (new_cap - 1)) == 0);
+    htable_t new_table = *table;
+    htable_alloc(&new_table, new_cap);
+    for (size_t i = 0; i < table->cap; ++i) {
+        if (!htable_is_occupied(table, i))
+            continue;
+        htable_place(&new_table, htable_elem(table->elems, i, table->esize), table->hashes[i], table->esize);
+    }
+    htable_free(table);
+    *table = new_table;
+    table->nrehashes++;
+}
 
-    while (true) {
-        uint32_t next_hash = hashes[index];
-        if (!(next_hash & OCCUPIED_HASH_MASK))
-            break;
-        next_hash &= ~OCCUPIED_HASH_MASK;
-
-        size_t next_index = htable_index(next_hash, cap);
-        size_t next_dib   = htable_dib(index, next_index, cap);
-        void* next_elem   = htable_elem(elems, index, esize);
-        if (cmp && next_hash == hash && cmp_fn(next_elem, cur_elem))
-            return false;
-
-        // Robin Hood hashing: swap the current element with the element to insert if
-        // its Distance to Initial Bucket is lower than that of the current element.
-        if (next_dib < dib) {
-            hashes[index] = hash | OCCUPIED_HASH_MASK;
-            memcpy(tmp_elem,  cur_elem,  esize);
-            memcpy(cur_elem,  next_elem, esize);
-            memcpy(next_elem, tmp_elem,  esize);
-            hash = next_hash;
-            dib  = next_dib;
-        }
-        dib++;
-        index++;
-        index = index >= cap ? 0 : index;
+void htable_remove_by_index(htable_t* table, size_t index) {
+    assert(htable_is_occupied(table, index));
+    // A group that still has an empty slot has never been full, which means that
+    // no probe sequence goes past it, and that the slot can be marked as empty
+    const uint8_t* group = table->ctrl + (index & ~(size_t)(HTABLE_GROUP_SIZE - 1));
+    if (htable_match(group, HTABLE_CTRL_EMPTY)) {
+        table->ctrl[index] = HTABLE_CTRL_EMPTY;
+    } else {
+        table->ctrl[index] = HTABLE_CTRL_DELETED;
+        table->ndeleted++;
     }
+    table->nelems--;
+    table->nremoves++;
+}
+
+#else // HTABLE_SWISS
 
-    hashes[index] = hash | OCCUPIED_HASH_MASK;
-    memcpy(htable_elem(elems, index, esize), cur_elem, esize);
-    return true;
+static inline size_t htable_slot_dib(const htable_t* table, size_t index) {
+    uint32_t hash = table->hashes[index];
+    return htable_dib(index, htable_index(hash, table->cap), table->cap);
 }
 
-htable_t* htable_create(size_t esize, size_t cap, cmpfn_t cmp_fn) {
-    assert((cap & (cap - 1)) == 0);
-    htable_t* table = xmalloc(sizeof(htable_t));
-    table->esize   = esize;
-    table->cap     = cap;
-    table->nelems  = 0;
-    table->elems   = xmalloc(esize * cap);
-    table->hashes  = xmalloc(sizeof(uint32_t) * cap);
-    table->cmp_fn  = cmp_fn;
-    memset(table->hashes, 0, sizeof(uint32_t) * cap);
-    return table;
+static void htable_alloc(htable_t* table, size_t cap) {
+    table->cap    = cap;
+    table->nelems = 0;
+    table->epoch  = 1;
+    table->elems  = xmalloc(table->esize * cap);
+    table->hashes = xmalloc(sizeof(uint32_t) * cap);
+    table->epochs = xcalloc(cap, sizeof(uint8_t));
 }
 
-void htable_destroy(htable_t* table) {
+static void htable_free(htable_t* table) {
     free(table->elems);
     free(table->hashes);
-    free(table);
+    free(table->epochs);
 }
 
-void htable_clear(htable_t* table) {
-    table->nelems = 0;
-    memset(table->hashes, 0, sizeof(uint32_t) * table->cap);
+static void htable_reset_epochs(htable_t* table) {
+    memset(table->epochs, 0, table->cap);
+    table->epoch = 1;
 }
 
 void htable_rehash(htable_t* table, size_t new_cap) {
     assert((new_cap & (new_cap - 1)) == 0);
-    void*     new_elems  = xmalloc(table->esize * new_cap);
-    uint32_t* new_hashes = xcalloc(new_cap, sizeof(uint32_t));
-
+    htable_t new_table = *table;
+    htable_alloc(&new_table, new_cap);
     for (size_t i = 0; i < table->cap; ++i) {
-        uint32_t hash = table->hashes[i];
-        if (!(hash & OCCUPIED_HASH_MASK))
+        if (!htable_is_occupied(table, i))
             continue;
-        hash &= ~OCCUPIED_HASH_MASK;
-
         const void* elem = htable_elem(table->elems, i, table->esize);
-        htable_insert_internal(elem, hash,
-                               new_elems, new_hashes,
-                               table->esize, new_cap,
-                               NULL, false);
+        uint32_t hash = table->hashes[i];
+        size_t index = htable_find_slot(&new_table, elem, hash, table->esize, NULL);
+        htable_place(&new_table, index, elem, hash, table->esize);
     }
-
-    free(table->elems);
-    free(table->hashes);
-    table->elems  = new_elems;
-    table->hashes = new_hashes;
-    table->cap    = new_cap;
-}
-
-bool htable_insert(htable_t* table, const void* elem, uint32_t hash) {
-    if (!htable_insert_internal(elem, hash & ~OCCUPIED_HASH_MASK,
-                                table->elems, table->hashes,
-                                table->esize, table->cap,
-                                table->cmp_fn, true))
-        return false;
-
-    table->nelems++;
-
-    // Test if the number of elements reaches 80% of the capacity
-    const size_t max_load_factor = 80;
-    if (table->nelems * 100 > max_load_factor * table->cap)
-        htable_rehash(table, table->cap * 2);
-    return true;
-}
-
-bool htable_remove(htable_t* table, const void* elem, uint32_t hash) {
-    size_t index = htable_lookup(table, elem, hash);
-    if (index == INVALID_INDEX)
-        return false;
-    htable_remove_by_index(table, index);
-    return true;
+    htable_free(table);
+    *table = new_table;
+    table->nrehashes++;
 }
 
 void htable_remove_by_index(htable_t* table, size_t index) {
-    assert(table->hashes[index] & OCCUPIED_HASH_MASK);
+    assert(htable_is_occupied(table, index));
 
     // Count number of buckets until an empty bucket or bucket with DIB=0 is found
     size_t prev = index;
     while (true) {
         index = htable_index(index + 1, table->cap);
 
-        uint32_t next_hash = table->hashes[index];
-        if (!(next_hash & OCCUPIED_HASH_MASK))
+        if (!htable_is_occupied(table, index))
             break;
-        next_hash &= ~OCCUPIED_HASH_MASK;
 
-        size_t next_index = htable_index(next_hash, table->cap);
+        uint32_t next_hash = table->hashes[index];
+        size_t next_index  = htable_index(next_hash, table->cap);
         size_t next_dib   = htable_dib(index, next_index, table->cap);
         if (next_dib == 0)
             break;
@@ -184,46 +172,121 @@ void htable_remove_by_index(htable_t* table, size_t index) {
         }
     }
     // Clear the last element of the chain
-    table->hashes[index] = 0;
+    table->epochs[index] = 0;
     table->nelems--;
+    table->nremoves++;
 }
 
-size_t htable_lookup(htable_t* table, const void* elem, uint32_t hash) {
-    hash = hash & ~OCCUPIED_HASH_MASK;
+#endif // HTABLE_SWISS
 
-    size_t index  = htable_index(hash, table->cap);
-    size_t dib    = 0;
+htable_t* htable_create(size_t esize, size_t cap, cmpfn_t cmp_fn) {
+    assert((cap & (cap - 1)) == 0);
+    htable_t* table = xmalloc(sizeof(htable_t));
+    table->esize     = esize;
+    table->cmp_fn    = cmp_fn;
+    table->nsparse_clears = 0;
+    table->sparse_peak    = 0;
+    table->ninserts  = 0;
+    table->nlookups  = 0;
+    table->nremoves  = 0;
+    table->nrehashes = 0;
+    htable_alloc(table, cap);
+    return table;
+}
 
-    while (true) {
-        uint32_t next_hash  = table->hashes[index];
-        if (!(next_hash & OCCUPIED_HASH_MASK))
-            return INVALID_INDEX;
-        next_hash &= ~OCCUPIED_HASH_MASK;
+void htable_destroy(htable_t* table) {
+    htable_free(table);
+    free(table);
+}
 
-        size_t next_index = htable_index(next_hash, table->cap);
-        size_t next_dib   = htable_dib(index, next_index, table->cap);
-        if (next_dib < dib)
-            return INVALID_INDEX;
+void htable_clear(htable_t* table) {
+    // Tables that stay mostly empty for several rounds are shrunk, which is
+    // cheap since there is nothing to rehash
+    if (table->nelems * HTABLE_SPARSE_RATIO < table->cap) {
+        table->sparse_peak = table->nelems > table->sparse_peak ? table->nelems : table->sparse_peak;
+        table->nsparse_clears++;
+    } else {
+        table->sparse_peak    = 0;
+        table->nsparse_clears = 0;
+    }
+    if (table->nsparse_clears >= HTABLE_SHRINK_ROUNDS && table->cap > HTABLE_MIN_CAP) {
+        size_t cap = HTABLE_MIN_CAP;
+        while (cap < table->sparse_peak * (HTABLE_SPARSE_RATIO / 2))
+            cap *= 2;
+        table->sparse_peak    = 0;
+        table->nsparse_clears = 0;
+        htable_free(table);
+        htable_alloc(table, cap);
+        return;
+    }
 
-        void* next_elem = htable_elem(table->elems, index, table->esize);
-        if (next_hash == hash && table->cmp_fn(next_elem, elem))
-            return index;
+    table->nelems = 0;
+#ifdef HTABLE_SWISS
+    table->ndeleted = 0;
+#endif
+    if (table->epoch == HTABLE_MAX_EPOCH)
+        htable_reset_epochs(table);
+    else
+        table->epoch++;
+}
 
-        dib++;
-        index++;
-        index = index >= table->cap ? 0 : index;
-    }
+bool htable_insert(htable_t* table, const void* elem, uint32_t hash) {
+    return htable_insert_with(table, elem, hash, table->esize, table->cmp_fn);
+}
+
+bool htable_remove(htable_t* table, const void* elem, uint32_t hash) {
+    return htable_remove_with(table, elem, hash, table->esize, table->cmp_fn);
+}
+
+size_t htable_lookup(htable_t* table, const void* elem, uint32_t hash) {
+    return htable_lookup_with(table, elem, hash, table->esize, table->cmp_fn);
 }
 
 htable_t* htable_copy(const htable_t* from) {
     htable_t* table = xmalloc(sizeof(htable_t));
-    table->esize   = from->esize;
-    table->cap     = from->cap;
-    table->nelems  = from->nelems;
-    table->elems   = xmalloc(from->esize * from->cap);
-    table->hashes  = xmalloc(sizeof(uint32_t) * from->cap);
-    table->cmp_fn  = from->cmp_fn;
+    *table = *from;
+    table->elems  = xmalloc(from->esize * from->cap);
+    table->hashes = xmalloc(sizeof(uint32_t) * from->cap);
     memcpy(table->elems,  from->elems,  from->esize * from->cap);
     memcpy(table->hashes, from->hashes, sizeof(uint32_t) * from->cap);
+#ifdef HTABLE_SWISS
+    table->ctrl   = xmalloc(from->cap);
+    table->epochs = xmalloc(htable_ngroups(from->cap));
+    memcpy(table->ctrl,   from->ctrl,   from->cap);
+    memcpy(table->epochs, from->epochs, htable_ngroups(from->cap));
+#else
+    table->epochs = xmalloc(from->cap);
+    memcpy(table->epochs, from->epochs, from->cap);
+#endif
+    table->ninserts  = 0;
+    table->nlookups  = 0;
+    table->nremoves  = 0;
+    table->nrehashes = 0;
     return table;
 }
+
+htable_stats_t htable_stats(const htable_t* table) {
+    htable_stats_t stats = {
+        .cap       = table->cap,
+        .nelems    = table->nelems,
+#ifdef HTABLE_SWISS
+        .bytes     = sizeof(htable_t) + (table->esize + sizeof(uint32_t) + 1) * table->cap + htable_ngroups(table->cap),
+#else
+        .bytes     = sizeof(htable_t) + (table->esize + sizeof(uint32_t) + 1) * table->cap,
+#endif
+        .ninserts  = table->ninserts,
+        .nlookups  = table->nlookups,
+        .nremoves  = table->nremoves,
+        .nrehashes = table->nrehashes,
+        .max_dib   = 0,
+        .dibs      = { 0 }
+    };
+    for (size_t i = 0; i < table->cap; ++i) {
+        if (!htable_is_occupied(table, i))
+            continue;
+        size_t dib = htable_slot_dib(table, i);
+        stats.dibs[dib < HTABLE_DIB_BUCKETS ? dib : HTABLE_DIB_BUCKETS - 1]++;
+        stats.max_dib = dib > stats.max_dib ? dib : stats.max_dib;
+    }
+    return stats;
+}
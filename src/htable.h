@@ -4,21 +4,67 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+
+#if defined(HTABLE_SWISS) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-#define OCCUPIED_HASH_MASK 0x80000000
 #define INVALID_INDEX ((size_t)-1)
+#define HTABLE_DIB_BUCKETS 16
+#define HTABLE_MAX_EPOCH   255
+
+#ifdef HTABLE_SWISS
+#define HTABLE_GROUP_SIZE   16
+#define HTABLE_CTRL_EMPTY   0x80
+#define HTABLE_CTRL_DELETED 0xFE
+#endif
 
-typedef struct htable_s htable_t;
+typedef struct htable_s       htable_t;
+typedef struct htable_stats_s htable_stats_t;
 
 typedef bool (*cmpfn_t)(const void*, const void*);
 
+// By default, hash tables use Robin Hood hashing. When HTABLE_SWISS is
+// defined, they are Swiss tables that probe groups of slots using control bytes.
+// Slots (or groups of slots, for Swiss tables) are tagged with the epoch of the
+// table when they are filled, and those with an older epoch are considered empty.
+// Clearing a table thus only increments its epoch. Epochs are kept apart from
+// the hashes, which are stored in full.
 struct htable_s {
     size_t esize;
     size_t cap;
     size_t nelems;
     void* elems;
     uint32_t* hashes;
+    uint8_t* epochs;    // One per slot, or per group for Swiss tables
+#ifdef HTABLE_SWISS
+    uint8_t* ctrl;
+    size_t ndeleted;
+#endif
+    uint32_t epoch;
+    // Number of consecutive clears with a low occupancy, and the largest number of elements during those
+    size_t nsparse_clears;
+    size_t sparse_peak;
     cmpfn_t cmp_fn;
+    size_t ninserts;
+    size_t nlookups;
+    size_t nremoves;
+    size_t nrehashes;
+};
+
+struct htable_stats_s {
+    size_t cap;
+    size_t nelems;
+    size_t bytes;
+    size_t ninserts;
+    size_t nlookups;
+    size_t nremoves;
+    size_t nrehashes;
+    size_t max_dib;
+    // Number of elements per Distance to Initial Bucket (in groups
+    // for Swiss tables), the last bucket gathering all the larger distances
+    size_t dibs[HTABLE_DIB_BUCKETS];
 };
 
 htable_t* htable_create(size_t, size_t, cmpfn_t);
@@ -30,5 +76,237 @@ bool htable_remove(htable_t*, const void*, uint32_t);
 void htable_remove_by_index(htable_t*, size_t);
 size_t htable_lookup(htable_t*, const void*, uint32_t);
 htable_t* htable_copy(const htable_t*);
+htable_stats_t htable_stats(const htable_t*);
+
+static inline bool htable_is_occupied(const htable_t* table, size_t index) {
+#ifdef HTABLE_SWISS
+    return table->epochs[index / HTABLE_GROUP_SIZE] == table->epoch && !(table->ctrl[index] & HTABLE_CTRL_EMPTY);
+#else
+    return table->epochs[index] == table->epoch;
+#endif
+}
+
+// The functions below take the element size and the comparison function as
+// arguments. The HSET and HMAP macros pass constants for both, so that once
+// inlined, the probing code is specialized for the type of the elements.
+#ifdef __GNUC__
+#define HTABLE_INLINE static inline __attribute__((always_inline))
+#else
+#define HTABLE_INLINE static inline
+#endif
+
+HTABLE_INLINE void* htable_elem(void* elems, size_t index, size_t esize) {
+    return ((uint8_t*)elems) + index * esize;
+}
+
+#ifdef HTABLE_SWISS
+
+// Swiss table: the slots are split in groups of HTABLE_GROUP_SIZE, which are
+// probed one after the other using triangular numbers. Each slot has a control
+// byte that is either HTABLE_CTRL_EMPTY, HTABLE_CTRL_DELETED, or the lowest 7
+// bits of the hash of the element in the slot. The control bytes of an entire
+// group are compared at once, which filters out almost every mismatch without
+// calling the comparison function.
+
+HTABLE_INLINE size_t htable_ngroups(size_t cap) {
+    return cap / HTABLE_GROUP_SIZE;
+}
+
+HTABLE_INLINE size_t htable_group(uint32_t hash, size_t cap) {
+    return (hash >> 7) & (htable_ngroups(cap) - 1);
+}
+
+HTABLE_INLINE uint8_t htable_ctrl(uint32_t hash) {
+    return hash & 0x7F;
+}
+
+// Returns a mask with one bit set for each slot of the group whose control byte is equal to the given one
+HTABLE_INLINE uint32_t htable_match(const uint8_t* ctrl, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < HTABLE_GROUP_SIZE; ++i)
+        mask |= (uint32_t)(ctrl[i] == byte) << i;
+    return mask;
+#endif
+}
+
+// Returns a mask with one bit set for each empty or deleted slot of the group
+HTABLE_INLINE uint32_t htable_match_free(const uint8_t* ctrl) {
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < HTABLE_GROUP_SIZE; ++i)
+        mask |= (uint32_t)(ctrl[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+HTABLE_INLINE size_t htable_first_bit(uint32_t mask) {
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    size_t i = 0;
+    while (!(mask & 1)) mask >>= 1, i++;
+    return i;
+#endif
+}
+
+HTABLE_INLINE size_t htable_find_free(const htable_t* table, uint32_t hash) {
+    size_t group = htable_group(hash, table->cap);
+    for (size_t step = 1; ; ++step) {
+        if (table->epochs[group] != table->epoch)
+            return group * HTABLE_GROUP_SIZE;
+        uint32_t mask = htable_match_free(table->ctrl + group * HTABLE_GROUP_SIZE);
+        if (mask)
+            return group * HTABLE_GROUP_SIZE + htable_first_bit(mask);
+        group = (group + step) & (htable_ngroups(table->cap) - 1);
+    }
+}
+
+HTABLE_INLINE size_t htable_find(const htable_t* table, const void* elem, uint32_t hash, size_t esize, cmpfn_t cmp_fn) {
+    size_t group = htable_group(hash, table->cap);
+    uint8_t byte = htable_ctrl(hash);
+    // This loop terminates because the table always contains empty slots
+    for (size_t step = 1; ; ++step) {
+        // Groups from an older epoch are empty
+        if (table->epochs[group] != table->epoch)
+            return INVALID_INDEX;
+        const uint8_t* ctrl = table->ctrl + group * HTABLE_GROUP_SIZE;
+        for (uint32_t mask = htable_match(ctrl, byte); mask; mask &= mask - 1) {
+            size_t index = group * HTABLE_GROUP_SIZE + htable_first_bit(mask);
+            if (table->hashes[index] == hash && cmp_fn(htable_elem(table->elems, index, esize), elem))
+                return index;
+        }
+        // Probing stops at the first group that was never full
+        if (htable_match(ctrl, HTABLE_CTRL_EMPTY))
+            return INVALID_INDEX;
+        group = (group + step) & (htable_ngroups(table->cap) - 1);
+    }
+}
+
+// Places an element that is not in the table yet, without growing it
+HTABLE_INLINE void htable_place(htable_t* table, const void* elem, uint32_t hash, size_t esize) {
+    size_t index = htable_find_free(table, hash);
+    size_t group = index / HTABLE_GROUP_SIZE;
+    if (table->epochs[group] != table->epoch) {
+        // Groups from an older epoch are emptied when they are first written to
+        memset(table->ctrl + group * HTABLE_GROUP_SIZE, HTABLE_CTRL_EMPTY, HTABLE_GROUP_SIZE);
+        table->epochs[group] = table->epoch;
+    }
+    if (table->ctrl[index] == HTABLE_CTRL_DELETED)
+        table->ndeleted--;
+    table->ctrl[index]   = htable_ctrl(hash);
+    table->hashes[index] = hash;
+    memcpy(htable_elem(table->elems, index, esize), elem, esize);
+    table->nelems++;
+}
+
+HTABLE_INLINE bool htable_insert_with(htable_t* table, const void* elem, uint32_t hash, size_t esize, cmpfn_t cmp_fn) {
+    table->ninserts++;
+    if (htable_find(table, elem, hash, esize, cmp_fn) != INVALID_INDEX)
+        return false;
+    htable_place(table, elem, hash, esize);
+
+    // Test if the number of used slots reaches 87.5% of the capacity,
+    // in which case the table either grows or gets rid of deleted slots
+    if ((table->nelems + table->ndeleted) * 8 > table->cap * 7)
+        htable_rehash(table, table->nelems * 2 > table->cap ? table->cap * 2 : table->cap);
+    return true;
+}
+
+#else // HTABLE_SWISS
+
+HTABLE_INLINE size_t htable_index(uint32_t hash, size_t cap) {
+    return hash & (cap - 1);
+}
+
+HTABLE_INLINE size_t htable_dib(size_t index, size_t expected_index, size_t cap) {
+    return index < expected_index ? (cap + index) - expected_index : index - expected_index;
+}
+
+// Robin Hood hashing keeps the elements of a cluster sorted by initial bucket.
+// This returns the index at which an element with the given hash belongs, or
+// INVALID_INDEX if the comparison function is not NULL and finds an equal element.
+HTABLE_INLINE size_t htable_find_slot(const htable_t* table, const void* elem, uint32_t hash, size_t esize, cmpfn_t cmp_fn) {
+    size_t index = htable_index(hash, table->cap);
+    for (size_t dib = 0; ; ++dib) {
+        if (table->epochs[index] != table->epoch)
+            return index;
+        uint32_t next_hash = table->hashes[index];
+
+        size_t next_index = htable_index(next_hash, table->cap);
+        if (htable_dib(index, next_index, table->cap) < dib)
+            return index;
+        if (cmp_fn && next_hash == hash && cmp_fn(htable_elem(table->elems, index, esize), elem))
+            return INVALID_INDEX;
+        index = htable_index(index + 1, table->cap);
+    }
+}
+
+HTABLE_INLINE size_t htable_find(const htable_t* table, const void* elem, uint32_t hash, size_t esize, cmpfn_t cmp_fn) {
+    size_t index = htable_index(hash, table->cap);
+    for (size_t dib = 0; ; ++dib) {
+        if (table->epochs[index] != table->epoch)
+            return INVALID_INDEX;
+        uint32_t next_hash = table->hashes[index];
+
+        size_t next_index = htable_index(next_hash, table->cap);
+        if (htable_dib(index, next_index, table->cap) < dib)
+            return INVALID_INDEX;
+        if (next_hash == hash && cmp_fn(htable_elem(table->elems, index, esize), elem))
+            return index;
+        index = htable_index(index + 1, table->cap);
+    }
+}
+
+// Places an element at the given index, shifting the rest of the cluster by one bucket
+HTABLE_INLINE void htable_place(htable_t* table, size_t index, const void* elem, uint32_t hash, size_t esize) {
+    size_t last = index;
+    while (htable_is_occupied(table, last))
+        last = htable_index(last + 1, table->cap);
+    table->epochs[last] = table->epoch;
+    while (last != index) {
+        size_t prev = htable_index(last + table->cap - 1, table->cap);
+        memcpy(htable_elem(table->elems, last, esize), htable_elem(table->elems, prev, esize), esize);
+        table->hashes[last] = table->hashes[prev];
+        last = prev;
+    }
+    memcpy(htable_elem(table->elems, index, esize), elem, esize);
+    table->hashes[index] = hash;
+    table->nelems++;
+}
+
+HTABLE_INLINE bool htable_insert_with(htable_t* table, const void* elem, uint32_t hash, size_t esize, cmpfn_t cmp_fn) {
+    table->ninserts++;
+    size_t index = htable_find_slot(table, elem, hash, esize, cmp_fn);
+    if (index == INVALID_INDEX)
+        return false;
+    htable_place(table, index, elem, hash, esize);
+
+    // Test if the number of elements reaches 80% of the capacity
+    const size_t max_load_factor = 80;
+    if (table->nelems * 100 > max_load_factor * table->cap)
+        htable_rehash(table, table->cap * 2);
+    return true;
+}
+
+#endif // HTABLE_SWISS
+
+HTABLE_INLINE size_t htable_lookup_with(htable_t* table, const void* elem, uint32_t hash, size_t esize, cmpfn_t cmp_fn) {
+    table->nlookups++;
+    return htable_find(table, elem, hash, esize, cmp_fn);
+}
+
+HTABLE_INLINE bool htable_remove_with(htable_t* table, const void* elem, uint32_t hash, size_t esize, cmpfn_t cmp_fn) {
+    size_t index = htable_lookup_with(table, elem, hash, esize, cmp_fn);
+    if (index == INVALID_INDEX)
+        return false;
+    htable_remove_by_index(table, index);
+    return true;
+}
 
 #endif // HTABLE_H
@@ -253,9 +253,11 @@ bool mod_save(const mod_t* mod, io_t* io) {
 
     // Then types
     off = write_dummy_block(io);
-    count = mod->types.table->nelems;
+    count = mod->types.nelems;
     if (io->write(io, &count, sizeof(uint32_t)) != sizeof(uint32_t))
         goto error;
+    // Types and nodes are visited in insertion order, so their operands usually
+    // come first and these loops rarely need more than one pass
     todo = true;
     while (todo) {
         todo = false;
@@ -267,7 +269,7 @@ bool mod_save(const mod_t* mod, io_t* io) {
 
     // Then nodes
     off = write_dummy_block(io);
-    count = mod->nodes.table->nelems;
+    count = mod->nodes.nelems;
     if (io->write(io, &count, sizeof(uint32_t)) != sizeof(uint32_t))
         goto error;
     // Insert all functions in the map
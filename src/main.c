@@ -23,13 +23,17 @@
 #endif
 
 static default_log_t global_log;
+static bool mem_stats = false;
+static bool mod_stats_enabled = false;
 
 static void usage(void) {
     static const char* usage_str =
         "usage: anf [options] file...\n"
         "options:\n"
         "  --help       display this information\n"
-        "  --must-fail  invert the return code\n";
+        "  --must-fail  invert the return code\n"
+        "  --mem-stats  report memory usage after each phase\n"
+        "  --stats      report the contents of modules after each IR phase\n";
     fputs(usage_str, stdout);
 }
 
@@ -59,6 +63,103 @@ static char* read_file(const char* file, size_t* size) {
     return buf;
 }
 
+static void print_pool_stats(printer_t* printer, const char* name, const mpool_t* pool) {
+    mpool_stats_t stats = mpool_stats(pool);
+    print(printer, "  {0:s} pool: {1:u64} requested, {2:u64} used, {3:u64} reserved, {4:u64} wasted, {5:u64} free, {6:u64} chunk(s)\n",
+        { .s = name },
+        { .u64 = stats.requested },
+        { .u64 = stats.used },
+        { .u64 = stats.reserved },
+        { .u64 = stats.wasted },
+        { .u64 = stats.free },
+        { .u64 = stats.nchunks });
+}
+
+static void print_table_stats(printer_t* printer, const char* name, const htable_t* table) {
+    htable_stats_t stats = htable_stats(table);
+    print(printer, "  {0:s} table: {1:u64}/{2:u64} element(s), {3:u64} bytes, {4:u64} insert(s), {5:u64} lookup(s), {6:u64} removal(s), {7:u64} rehash(es), max. probe length {8:u64}\n",
+        { .s = name },
+        { .u64 = stats.nelems },
+        { .u64 = stats.cap },
+        { .u64 = stats.bytes },
+        { .u64 = stats.ninserts },
+        { .u64 = stats.nlookups },
+        { .u64 = stats.nremoves },
+        { .u64 = stats.nrehashes },
+        { .u64 = stats.max_dib });
+    print(printer, "  {0:s} probe lengths:", { .s = name });
+    for (size_t i = 0; i < HTABLE_DIB_BUCKETS; ++i)
+        print(printer, " {0:u64}", { .u64 = stats.dibs[i] });
+    print(printer, "\n");
+}
+
+static void print_mem_stats(const char* phase, const mpool_t* pool, const ast_t* ast) {
+    file_printer_t file_printer = printer_from_file(stderr);
+    printer_t* printer = &file_printer.printer;
+    print(printer, "memory after {0:s}:\n", { .s = phase });
+    print_pool_stats(printer, "ast", pool);
+    if (!ast)
+        return;
+    FORALL_AST(ast->data.prog.mods, mod, {
+        const mod_t* ir_mod = mod->data.mod.mod;
+        if (!ir_mod)
+            continue;
+        print(printer, "  module '{0:s}':\n", { .s = mod->data.mod.id->data.id.str });
+        print_pool_stats(printer, "  ir", ir_mod->pool);
+        print_table_stats(printer, "  nodes", ir_mod->nodes.table);
+        print_table_stats(printer, "  types", ir_mod->types.table);
+    })
+}
+
+static void print_mod_stats(const char* phase, const ast_t* ast) {
+    static const char* node_names[] = {
+#define NODE(name, str) str,
+        NODE_LIST(NODE)
+#undef NODE
+    };
+    static const char* type_names[] = {
+#define TYPE(name, str) str,
+        TYPE_LIST(TYPE)
+#undef TYPE
+    };
+    file_printer_t file_printer = printer_from_file(stderr);
+    printer_t* printer = &file_printer.printer;
+    print(printer, "modules after {0:s}:\n", { .s = phase });
+    FORALL_AST(ast->data.prog.mods, mod, {
+        const mod_t* ir_mod = mod->data.mod.mod;
+        if (!ir_mod)
+            continue;
+        mod_stats_t stats = mod_stats(ir_mod);
+        print(printer, "  module '{0:s}': {1:u64} node(s), {2:u64} type(s), {3:u64} function(s), {4:u64} pool byte(s)\n",
+            { .s = mod->data.mod.id->data.id.str },
+            { .u64 = stats.nnodes },
+            { .u64 = stats.ntypes },
+            { .u64 = stats.nfns },
+            { .u64 = stats.pool.used });
+        print(printer, "    nodes:");
+        for (size_t i = 0; i < NODE_NTAGS; ++i) {
+            if (stats.nodes_per_tag[i] > 0)
+                print(printer, " {0:s} {1:u64}", { .s = node_names[i] }, { .u64 = stats.nodes_per_tag[i] });
+        }
+        print(printer, "\n    types:");
+        for (size_t i = 0; i < TYPE_NTAGS; ++i) {
+            if (stats.types_per_tag[i] > 0)
+                print(printer, " {0:s} {1:u64}", { .s = type_names[i] }, { .u64 = stats.types_per_tag[i] });
+        }
+        print(printer, "\n    {0:u64} use(s), avg. fan-in {1:f64} (max. {2:u64}), avg. fan-out {3:f64} (max. {4:u64})\n",
+            { .u64 = stats.nuses },
+            { .f64 = stats.nusers ? (double)stats.nuses / stats.nusers : 0.0 },
+            { .u64 = stats.max_fan_in },
+            { .f64 = stats.nused ? (double)stats.nuses / stats.nused : 0.0 },
+            { .u64 = stats.max_fan_out });
+        print(printer, "    hash-consing: {0:u64}/{1:u64} node hit(s), {2:u64}/{3:u64} type hit(s)\n",
+            { .u64 = stats.nnode_hits },
+            { .u64 = stats.nnode_lookups },
+            { .u64 = stats.ntype_hits },
+            { .u64 = stats.ntype_lookups });
+    })
+}
+
 static bool process_file(const char* file) {
     size_t file_size = 0;
     char* file_data = read_file(file, &file_size);
@@ -86,6 +187,8 @@ static bool process_file(const char* file) {
     // Parse program
     ast_t* ast = parse(&parser);
     bool ok = !file_log.log.errs;
+    if (mem_stats)
+        print_mem_stats("parse", pool, ast);
     if (ok) {
         // Bind identifiers to AST nodes
         id2ast_t id2ast = id2ast_create();
@@ -96,6 +199,8 @@ static bool process_file(const char* file) {
         id2ast_destroy(&id2ast);
         bind(&binder, ast);
         ok &= !file_log.log.errs;
+        if (mem_stats)
+            print_mem_stats("bind", pool, ast);
     }
 
     if (ok) {
@@ -108,6 +213,8 @@ static bool process_file(const char* file) {
         infer(&checker, ast);
         ast_set_destroy(&defs);
         ok &= !file_log.log.errs;
+        if (mem_stats)
+            print_mem_stats("check", pool, ast);
     }
 
     if (ok) {
@@ -120,6 +227,10 @@ static bool process_file(const char* file) {
         emit(&emitter, ast);
         type2type_destroy(&types);
         ok &= !file_log.log.errs;
+        if (mem_stats)
+            print_mem_stats("emit", pool, ast);
+        if (mod_stats_enabled)
+            print_mod_stats("emit", ast);
     }
 
     // Display program on success
@@ -159,6 +270,10 @@ int main(int argc, char** argv) {
                 return 0;
             } else if (!strcmp(argv[i], "--must-fail")) {
                 must_fail = true;
+            } else if (!strcmp(argv[i], "--mem-stats")) {
+                mem_stats = true;
+            } else if (!strcmp(argv[i], "--stats")) {
+                mod_stats_enabled = true;
             } else {
                 log_error(&global_log.log, NULL, "unknown option '{0:s}'", { .s = argv[i] });
                 return 1;
@@ -156,7 +156,7 @@ static size_t find_loads_stores(mod_t* mod, const node_set_t* allocs, const node
                         node_set_insert(loads, node);
                     else {
                         elim_loads++;
-                        node_replace(node, node_tuple_args(mod, 2, node->dbg, node->ops[0], load_value));
+                        node_replace(mod, node, node_tuple_args(mod, 2, node->dbg, node->ops[0], load_value));
                     }
                 } else {
                     node_set_insert(stores, node);
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <pthread.h>
 
 #include "mod.h"
 #include "node.h"
@@ -30,8 +31,7 @@ uint32_t node_hash(const void* ptr) {
     h = hash_ptr(h, node->type);
     for (size_t i = 0; i < node->nops; ++i)
         h = hash_ptr(h, node->ops[i]);
-    for (size_t i = 0; i < node->dsize; ++i)
-        h = hash_uint8(h, ((uint8_t*)&node->data)[i]);
+    h = hash_bytes(h, &node->data, node->dsize);
     return h;
 }
 
@@ -55,25 +55,69 @@ uint32_t type_hash(const void* ptr) {
     h = hash_uint32(h, type->tag);
     for (size_t i = 0; i < type->nops; ++i)
         h = hash_ptr(h, type->ops[i]);
-    for (size_t i = 0; i < type->dsize; ++i)
-        h = hash_uint8(h, ((uint8_t*)&type->data)[i]);
+    h = hash_bytes(h, &type->data, type->dsize);
     return h;
 }
 
+#define MOD_SHARD_BITS 6
+#define MOD_NSHARDS    (1 << MOD_SHARD_BITS)
+
+typedef struct mod_shard_s mod_shard_t;
+
+// Part of the hash-consing tables, selected with the upper bits of the hash
+struct mod_shard_s {
+    pthread_mutex_t lock;
+    htable_t* nodes;
+    htable_t* types;
+    size_t nnode_lookups;
+    size_t nnode_hits;
+    size_t ntype_lookups;
+    size_t ntype_hits;
+};
+
+VEC(pool_vec, mpool_t**)
+
+struct mod_conc_s {
+    pthread_mutex_t lock;       // Protects the module itself
+    pthread_key_t   pool_key;   // Pool of the current thread
+    pool_vec_t      pools;
+    mod_shard_t     shards[MOD_NSHARDS];
+};
+
 mod_t* mod_create(void) {
     mod_t* mod = xmalloc(sizeof(mod_t));
     mod->pool  = mpool_create();
     mod->fns   = node_vec_create();
     mod->nodes = internal_node_set_create();
     mod->types = internal_type_set_create();
+    mod->undo  = undo_vec_create();
+    mod->checkpoints = 0;
+    mod->nnode_ids = 0;
+    mod->ntype_ids = 0;
+    mod->conc = NULL;
+    mod->implies_cache  = implies_cache_create_with_cap(0);
+    mod->implies_bound  = 0;
+    mod->implies_budget = MOD_IMPLIES_BUDGET;
+    mod->facts_cache    = facts_cache_create();
+    mod->scope_cache    = scope_cache_create();
+    mod->nnode_lookups = 0;
+    mod->nnode_hits = 0;
+    mod->ntype_lookups = 0;
+    mod->ntype_hits = 0;
     return mod;
 }
 
 void mod_destroy(mod_t* mod) {
+    if (mod->conc)
+        mod_end_concurrent(mod);
     mpool_destroy(mod->pool);
     node_vec_destroy(&mod->fns);
     internal_node_set_destroy(&mod->nodes);
     internal_type_set_destroy(&mod->types);
+    undo_vec_destroy(&mod->undo);
+    implies_cache_destroy(&mod->implies_cache);
+    facts_cache_destroy(&mod->facts_cache);
+    scope_cache_destroy(mod->scope_cache);
     free(mod);
 }
 
@@ -82,17 +126,48 @@ void mod_opt(mod_t** mod) {
     (void)mod;
 }
 
+static inline void count_node(mod_stats_t* stats, const node_t* node) {
+    size_t fan_out = use_count(node->uses);
+    stats->nodes_per_tag[node->tag]++;
+    stats->nuses  += fan_out;
+    stats->nused  += fan_out > 0;
+    stats->nusers += node->nops > 0;
+    if (fan_out > stats->max_fan_out)
+        stats->max_fan_out = fan_out;
+    if (node->nops > stats->max_fan_in)
+        stats->max_fan_in = node->nops;
+}
+
+mod_stats_t mod_stats(const mod_t* mod) {
+    mod_stats_t stats = {
+        .nnodes = mod->nodes.nelems + mod->fns.nelems,
+        .ntypes = mod->types.nelems,
+        .nfns   = mod->fns.nelems,
+        .nnode_lookups = mod->nnode_lookups,
+        .nnode_hits    = mod->nnode_hits,
+        .ntype_lookups = mod->ntype_lookups,
+        .ntype_hits    = mod->ntype_hits,
+        .pool = mpool_stats(mod->pool)
+    };
+    FORALL_NODES(mod, node, {
+        count_node(&stats, node);
+    })
+    FORALL_FNS(mod, fn, {
+        count_node(&stats, fn);
+    })
+    FORALL_TYPES(mod, type, {
+        stats.types_per_tag[type->tag]++;
+    })
+    return stats;
+}
+
 void mod_dump(mod_t* mod) {
-    scope_t scope = { .entry = NULL, .nodes = node_set_create() };
-    node_set_t seen = node_set_create();
+    node_bitset_t seen = node_bitset_create_with_cap(mod->nnode_ids);
     node_vec_t stack = node_vec_create();
     FORALL_FNS(mod, fn, {
-        node_set_clear(&scope.nodes);
-        node_set_clear(&seen);
+        node_bitset_clear(&seen);
         node_vec_clear(&stack);
-
-        scope.entry = fn;
-        scope_compute(mod, &scope);
+        const scope_t* scope = scope_get(mod, fn);
 
         node_dump(fn);
         node_vec_push(&stack, fn->ops[0]);
@@ -101,11 +176,11 @@ void mod_dump(mod_t* mod) {
             const node_t* node = stack.elems[stack.nelems - 1];
             // Do not print nodes outside the scope except TAPPs
             if (node->tag != NODE_TAPP &&
-                (node->nops == 0 || node->tag == NODE_FN || !node_set_lookup(&scope.nodes, node)))
+                (node->nops == 0 || node->tag == NODE_FN || !node_set_lookup(&scope->nodes, node)))
                 goto done;
             bool all_seen = true;
             for (size_t i = 0; i < node->nops; ++i) {
-                if (!node_set_lookup(&seen, node->ops[i])) {
+                if (!node_bitset_lookup(&seen, node->ops[i])) {
                     node_vec_push(&stack, node->ops[i]);
                     all_seen = false;
                 }
@@ -117,89 +192,646 @@ void mod_dump(mod_t* mod) {
             }
             continue;
         done:
-            node_set_insert(&seen, node);
+            node_bitset_insert(&seen, node);
             node_vec_pop(&stack);
         }
         printf("\n");
     });
     node_vec_destroy(&stack);
-    node_set_destroy(&seen);
-    node_set_destroy(&scope.nodes);
+    node_bitset_destroy(&seen);
 }
 
-static inline void register_use(mod_t* mod, size_t index, const node_t* used, const node_t* user) {
-    use_t* use = mpool_alloc(&mod->pool, sizeof(use_t));
+static inline size_t type_size(size_t nops) {
+    return sizeof(type_t) + sizeof(type_t*) * nops;
+}
+
+static inline size_t node_size(size_t nops) {
+    return sizeof(node_t) + (sizeof(node_t*) + sizeof(use_t)) * nops;
+}
+
+static inline use_t* slot_use(const node_t* user, size_t index) {
+    return (use_t*)(user->ops + user->nops) + index;
+}
+
+static inline void register_use(size_t index, const node_t* used, const node_t* user) {
+    use_t* use = slot_use(user, index);
     use->index = index;
     use->user  = user;
     use->next  = used->uses;
-    ((node_t*)used)->uses = use;
+    use->prev  = &((node_t*)used)->uses;
+    if (use->next)
+        use->next->prev = &use->next;
+    *use->prev = use;
 }
 
-static inline void unregister_use(size_t index, const node_t* used, const node_t* user) {
-    use_t* use = used->uses;
-    use_t** prev = &((node_t*)used)->uses;
-    while (use) {
-        if (use->index == index && use->user  == user)
-            break;
-        prev = &use->next;
-        use  = use->next;
+static inline void unregister_use(size_t index, const node_t* user) {
+    use_t* use = slot_use(user, index);
+    *use->prev = use->next;
+    if (use->next)
+        use->next->prev = use->prev;
+}
+
+static inline void clear_implies_cache(mod_t* mod) {
+    implies_cache_clear(&mod->implies_cache);
+    mod->implies_bound = 0;
+}
+
+// Forgets the facts about nodes whose identifier is at least the given one
+static inline void truncate_facts_cache(mod_t* mod, uint32_t first_node_id) {
+    if (mod->facts_cache.nelems > first_node_id)
+        mod->facts_cache.nelems = first_node_id;
+}
+
+static inline void record_undo(mod_t* mod, undo_t undo) {
+    if (mod->checkpoints > 0)
+        undo_vec_push(&mod->undo, undo);
+}
+
+static inline type_t* alloc_type(mpool_t** pool, const type_t* type) {
+    type_t* type_ptr = mpool_alloc(pool, type_size(type->nops));
+    memcpy(type_ptr, type, sizeof(type_t));
+    type_ptr->ops = (const type_t**)(type_ptr + 1);
+    for (size_t i = 0; i < type->nops; ++i) type_ptr->ops[i] = type->ops[i];
+    return type_ptr;
+}
+
+static inline void add_type(mod_t* mod, type_t* type_ptr) {
+    type_ptr->id = mod->ntype_ids++;
+    bool success = internal_type_set_insert(&mod->types, type_ptr);
+    assert(success), (void)success;
+    record_undo(mod, (undo_t) { .tag = UNDO_TYPE, .data.type = type_ptr });
+}
+
+static inline node_t* alloc_node(mpool_t** pool, const node_t* node) {
+    node_t* node_ptr = mpool_alloc(pool, node_size(node->nops));
+    memcpy(node_ptr, node, sizeof(node_t));
+    node_ptr->ops = (const node_t**)(node_ptr + 1);
+    for (size_t i = 0; i < node->nops; ++i) node_ptr->ops[i] = node->ops[i];
+    return node_ptr;
+}
+
+static inline void add_node(mod_t* mod, node_t* node_ptr) {
+    node_ptr->id = mod->nnode_ids++;
+    for (size_t i = 0; i < node_ptr->nops; ++i)
+        register_use(i, node_ptr->ops[i], node_ptr);
+    if (node_ptr->tag != NODE_FN) {
+        bool success = internal_node_set_insert(&mod->nodes, node_ptr);
+        assert(success), (void)success;
+    } else {
+        node_vec_push(&mod->fns, node_ptr);
     }
-    assert(use);
-    *prev = use->next;
+    record_undo(mod, (undo_t) { .tag = UNDO_NODE, .data.node = node_ptr });
 }
 
 void node_bind(mod_t* mod, const node_t* node, size_t i, const node_t* op) {
     assert(i < node->nops && node->ops[i]);
-    unregister_use(i, node->ops[i], node);
+    // Use lists are shared between threads
+    if (mod->conc) pthread_mutex_lock(&mod->conc->lock);
+    unregister_use(i, node);
+    record_undo(mod, (undo_t) {
+        .tag = UNDO_BIND,
+        .data.bind = { .node = node, .index = i, .op = node->ops[i] }
+    });
     node->ops[i] = op;
-    register_use(mod, i, node->ops[i], node);
+    register_use(i, op, node);
+    scope_cache_bind(mod, node, op);
+    if (mod->conc) pthread_mutex_unlock(&mod->conc->lock);
+}
+
+void mod_remove_node(mod_t* mod, const node_t* node) {
+    assert(mod->checkpoints == 0 && !mod->conc);
+    node_small_vec_t worklist = node_small_vec_create();
+    node_small_vec_push(&worklist, node);
+    while (worklist.nelems > 0) {
+        node_t* dead = (node_t*)node_small_vec_pop(&worklist);
+        assert(!dead->uses && dead->tag != NODE_FN);
+        bool success = internal_node_set_remove(&mod->nodes, dead);
+        assert(success), (void)success;
+        for (size_t i = 0; i < dead->nops; ++i) {
+            const node_t* op = dead->ops[i];
+            unregister_use(i, dead);
+            // Operands are removed once all their uses are gone
+            if (!op->uses && op->tag != NODE_FN)
+                node_small_vec_push(&worklist, op);
+        }
+        scope_cache_invalidate(mod, dead);
+        mpool_free(mod->pool, dead, node_size(dead->nops));
+    }
+    node_small_vec_destroy(&worklist);
+}
+
+static inline void mark_node(node_bitset_t* marked, node_vec_t* worklist, const node_t* node) {
+    if (node && node_bitset_insert(marked, node))
+        node_vec_push(worklist, node);
+}
+
+static inline void mark_type(type_bitset_t* marked, type_vec_t* worklist, const type_t* type) {
+    if (type && type_bitset_insert(marked, type))
+        type_vec_push(worklist, type);
+}
+
+void mod_gc(mod_t* mod) {
+    assert(mod->checkpoints == 0 && !mod->conc);
+    scope_cache_clear(mod);
+    node_bitset_t live_nodes = node_bitset_create_with_cap(mod->nnode_ids);
+    type_bitset_t live_types = type_bitset_create_with_cap(mod->ntype_ids);
+    node_vec_t nodes = node_vec_create();
+    type_vec_t types = type_vec_create();
+
+    // Mark everything that can be reached from the exported functions
+    FORALL_FNS(mod, fn, {
+        if (fn->data.fn_flags & FN_EXPORTED)
+            mark_node(&live_nodes, &nodes, fn);
+    })
+    while (nodes.nelems > 0) {
+        const node_t* node = node_vec_pop(&nodes);
+        for (size_t i = 0; i < node->nops; ++i)
+            mark_node(&live_nodes, &nodes, node->ops[i]);
+        mark_node(&live_nodes, &nodes, node->rep);
+        mark_type(&live_types, &types, node->type);
+        if (node->tag == NODE_TAPP)
+            mark_type(&live_types, &types, node->data.map);
+    }
+    while (types.nelems > 0) {
+        const type_t* type = type_vec_pop(&types);
+        for (size_t i = 0; i < type->nops; ++i)
+            mark_type(&live_types, &types, type->ops[i]);
+        if (type->tag == TYPE_STRUCT) {
+            mark_type(&live_types, &types, type->data.struct_def->type);
+            for (size_t i = 0; i < type->nops; ++i)
+                mark_type(&live_types, &types, type->data.struct_def->vars[i]);
+        } else if (type->tag == TYPE_VAR) {
+            for (size_t i = 0; i < type->data.var_def->ntraits; ++i)
+                mark_type(&live_types, &types, type->data.var_def->traits[i]);
+        }
+    }
+
+    // Unlink the uses of all dead nodes before freeing any of them
+    FORALL_NODES(mod, node, {
+        if (!node_bitset_lookup(&live_nodes, node))
+            node_vec_push(&nodes, node);
+    })
+    size_t nfns = 0;
+    FORALL_FNS(mod, fn, {
+        if (node_bitset_lookup(&live_nodes, fn))
+            mod->fns.elems[nfns++] = fn;
+        else
+            node_vec_push(&nodes, fn);
+    })
+    mod->fns.nelems = nfns;
+    FORALL_VEC(nodes, const node_t*, node, {
+        for (size_t j = 0; j < node->nops; ++j)
+            unregister_use(j, node);
+    })
+    FORALL_VEC(nodes, const node_t*, node, {
+        if (node->tag != NODE_FN) {
+            bool success = internal_node_set_remove(&mod->nodes, node);
+            assert(success), (void)success;
+        }
+        mpool_free(mod->pool, (node_t*)node, node_size(node->nops));
+    })
+
+    FORALL_TYPES(mod, type, {
+        if (!type_bitset_lookup(&live_types, type))
+            type_vec_push(&types, type);
+    })
+    FORALL_VEC(types, const type_t*, type, {
+        bool success = internal_type_set_remove(&mod->types, type);
+        assert(success), (void)success;
+        mpool_free(mod->pool, (type_t*)type, type_size(type->nops));
+    })
+
+    node_bitset_destroy(&live_nodes);
+    type_bitset_destroy(&live_types);
+    node_vec_destroy(&nodes);
+    type_vec_destroy(&types);
+}
+
+static inline bool is_new_node(const node_t* node, uint32_t first_id) {
+    return node->id >= first_id && node->tag != NODE_FN;
+}
+
+static inline bool is_new_type(const type_t* type, uint32_t first_id) {
+    return type && type->id >= first_id;
+}
+
+// Post order walk over the new operands of a node
+static void order_new_nodes(const node_t* root, uint32_t first_id, node_bitset_t* done, node_vec_t* stack, node_vec_t* order) {
+    node_vec_push(stack, root);
+    while (stack->nelems > 0) {
+        const node_t* node = stack->elems[stack->nelems - 1];
+        if (node_bitset_lookup(done, node)) {
+            node_vec_pop(stack);
+            continue;
+        }
+        // Operands are pushed in reverse, so that they are numbered in order
+        bool ready = true;
+        for (size_t i = node->nops; i-- > 0;) {
+            const node_t* op = node->ops[i];
+            if (is_new_node(op, first_id) && !node_bitset_lookup(done, op)) {
+                node_vec_push(stack, op);
+                ready = false;
+            }
+        }
+        if (ready) {
+            node_vec_pop(stack);
+            node_bitset_insert(done, node);
+            if (node != root || is_new_node(node, first_id))
+                node_vec_push(order, node);
+        }
+    }
+}
+
+static void order_new_types(const type_t* root, uint32_t first_id, type_bitset_t* done, type_vec_t* stack, type_vec_t* order) {
+    if (!is_new_type(root, first_id))
+        return;
+    type_vec_push(stack, root);
+    while (stack->nelems > 0) {
+        const type_t* type = stack->elems[stack->nelems - 1];
+        if (type_bitset_lookup(done, type)) {
+            type_vec_pop(stack);
+            continue;
+        }
+        size_t nelems = stack->nelems;
+        for (size_t i = 0; i < type->nops; ++i) {
+            if (is_new_type(type->ops[i], first_id) && !type_bitset_lookup(done, type->ops[i]))
+                type_vec_push(stack, type->ops[i]);
+        }
+        if (type->tag == TYPE_STRUCT) {
+            const struct_def_t* struct_def = type->data.struct_def;
+            if (is_new_type(struct_def->type, first_id) && !type_bitset_lookup(done, struct_def->type))
+                type_vec_push(stack, struct_def->type);
+            for (size_t i = 0; i < type->nops; ++i) {
+                if (is_new_type(struct_def->vars[i], first_id) && !type_bitset_lookup(done, struct_def->vars[i]))
+                    type_vec_push(stack, struct_def->vars[i]);
+            }
+        } else if (type->tag == TYPE_VAR) {
+            const var_def_t* var_def = type->data.var_def;
+            for (size_t i = 0; i < var_def->ntraits; ++i) {
+                if (is_new_type(var_def->traits[i], first_id) && !type_bitset_lookup(done, var_def->traits[i]))
+                    type_vec_push(stack, var_def->traits[i]);
+            }
+        }
+        if (stack->nelems == nelems) {
+            type_vec_pop(stack);
+            type_bitset_insert(done, type);
+            type_vec_push(order, type);
+        }
+    }
+}
+
+void mod_canonicalize(mod_t* mod, uint32_t first_node_id, uint32_t first_type_id) {
+    assert(mod->checkpoints == 0 && !mod->conc);
+    // The new nodes are about to be renumbered
+    if (first_node_id < mod->implies_bound)
+        clear_implies_cache(mod);
+    truncate_facts_cache(mod, first_node_id);
+    scope_cache_truncate(mod, first_node_id);
+    node_bitset_t done_nodes = node_bitset_create_with_cap(mod->nnode_ids);
+    type_bitset_t done_types = type_bitset_create_with_cap(mod->ntype_ids);
+    node_vec_t node_stack = node_vec_create(), node_order = node_vec_create(), new_nodes = node_vec_create();
+    type_vec_t type_stack = type_vec_create(), type_order = type_vec_create(), new_types = type_vec_create();
+
+    // The new nodes are ordered as they are reached from the functions, and
+    // the new types as they are reached from the types of those nodes
+    FORALL_FNS(mod, fn, {
+        assert(fn->id < first_node_id);
+        order_new_nodes(fn, first_node_id, &done_nodes, &node_stack, &node_order);
+    })
+    FORALL_VEC(node_order, const node_t*, node, {
+        order_new_types(node->type, first_type_id, &done_types, &type_stack, &type_order);
+        if (node->tag == NODE_TAPP)
+            order_new_types(node->data.map, first_type_id, &done_types, &type_stack, &type_order);
+    })
+
+    // Take all the new nodes and types out of the module, the most recent first
+    FORALL_NODES(mod, node, {
+        if (is_new_node(node, first_node_id))
+            node_vec_push(&new_nodes, node);
+    })
+    FORALL_TYPES(mod, type, {
+        if (is_new_type(type, first_type_id))
+            type_vec_push(&new_types, type);
+    })
+    FORALL_VEC(new_nodes, const node_t*, node, {
+        for (size_t j = 0; j < node->nops; ++j)
+            unregister_use(j, node);
+    })
+    FORALL_FNS(mod, fn, {
+        for (size_t j = 0; j < fn->nops; ++j)
+            unregister_use(j, fn);
+    })
+    while (new_nodes.nelems > 0) {
+        const node_t* node = node_vec_pop(&new_nodes);
+        bool success = internal_node_set_remove(&mod->nodes, node);
+        assert(success), (void)success;
+        if (!node_bitset_lookup(&done_nodes, node))
+            mpool_free(mod->pool, (node_t*)node, node_size(node->nops));
+    }
+    while (new_types.nelems > 0) {
+        const type_t* type = type_vec_pop(&new_types);
+        bool success = internal_type_set_remove(&mod->types, type);
+        assert(success), (void)success;
+        if (!type_bitset_lookup(&done_types, type))
+            mpool_free(mod->pool, (type_t*)type, type_size(type->nops));
+    }
+
+    // Put back those that can be reached, in order
+    mod->ntype_ids = first_type_id;
+    FORALL_VEC(type_order, const type_t*, type, {
+        add_type(mod, (type_t*)type);
+    })
+    // Operands are numbered before their users, which can then be ordered again
+    mod->nnode_ids = first_node_id;
+    FORALL_VEC(node_order, const node_t*, node, {
+        node_order_ops((node_t*)node);
+        add_node(mod, (node_t*)node);
+    })
+    FORALL_FNS(mod, fn, {
+        for (size_t j = 0; j < fn->nops; ++j)
+            register_use(j, fn->ops[j], fn);
+    })
+
+    node_bitset_destroy(&done_nodes);
+    type_bitset_destroy(&done_types);
+    node_vec_destroy(&node_stack);
+    node_vec_destroy(&node_order);
+    node_vec_destroy(&new_nodes);
+    type_vec_destroy(&type_stack);
+    type_vec_destroy(&type_order);
+    type_vec_destroy(&new_types);
+}
+
+void mod_apply_replacements(mod_t* mod) {
+    assert(!mod->conc);
+    // Nodes are visited after their operands, which are thus already rewritten
+    FORALL_NODES(mod, node, {
+        if (node->rep || node->nops == 0)
+            continue;
+        TMP_BUF_ALLOC(ops, const node_t*, node->nops)
+        bool changed = false;
+        for (size_t i = 0; i < node->nops; ++i) {
+            ops[i] = node_resolve(node->ops[i]);
+            changed |= ops[i] != node->ops[i];
+        }
+        if (changed)
+            node_replace(mod, node, node_rebuild(mod, node, ops, node->type));
+        TMP_BUF_FREE(ops)
+    })
+    FORALL_FNS(mod, fn, {
+        for (size_t i = 0; i < fn->nops; ++i) {
+            const node_t* op = node_resolve(fn->ops[i]);
+            if (op != fn->ops[i])
+                node_bind(mod, fn, i, op);
+        }
+    })
+}
+
+mod_mark_t mod_checkpoint(mod_t* mod) {
+    assert(!mod->conc);
+    mod->checkpoints++;
+    return (mod_mark_t) {
+        .pool = mpool_mark(mod->pool),
+        .undo = mod->undo.nelems,
+        .nfns = mod->fns.nelems,
+        .nnode_ids = mod->nnode_ids,
+        .ntype_ids = mod->ntype_ids
+    };
+}
+
+static inline void undo_change(mod_t* mod, const undo_t* undo) {
+    switch (undo->tag) {
+        case UNDO_NODE:
+            {
+                const node_t* node = undo->data.node;
+                for (size_t i = 0; i < node->nops; ++i)
+                    unregister_use(i, node);
+                if (node->tag != NODE_FN) {
+                    bool success = internal_node_set_remove(&mod->nodes, node);
+                    assert(success), (void)success;
+                }
+            }
+            break;
+        case UNDO_TYPE:
+            {
+                bool success = internal_type_set_remove(&mod->types, undo->data.type);
+                assert(success), (void)success;
+            }
+            break;
+        case UNDO_BIND:
+            {
+                // Link the operand slot back to the previous operand
+                const node_t* node = undo->data.bind.node;
+                size_t index = undo->data.bind.index;
+                unregister_use(index, node);
+                node->ops[index] = undo->data.bind.op;
+                register_use(index, node->ops[index], node);
+                scope_cache_bind(mod, node, node->ops[index]);
+            }
+            break;
+        case UNDO_DBG:
+            ((node_t*)undo->data.dbg.node)->dbg = undo->data.dbg.dbg;
+            break;
+        default:
+            assert(false);
+            break;
+    }
+}
+
+void mod_rollback(mod_t* mod, mod_mark_t mark) {
+    assert(mod->checkpoints > 0);
+    assert(mark.undo <= mod->undo.nelems);
+    // Scopes computed since the checkpoint may contain nodes about to be removed
+    scope_cache_truncate(mod, mark.nnode_ids);
+    // Changes are undone in reverse order, before the memory is released
+    while (mod->undo.nelems > mark.undo)
+        undo_change(mod, &mod->undo.elems[--mod->undo.nelems]);
+    mpool_release(&mod->pool, mark.pool);
+    mod->fns.nelems = mark.nfns;
+    mod->nnode_ids = mark.nnode_ids;
+    mod->ntype_ids = mark.ntype_ids;
+    mod->checkpoints--;
+    // The identifiers of the removed nodes will be given to other nodes
+    if (mark.nnode_ids < mod->implies_bound)
+        clear_implies_cache(mod);
+    truncate_facts_cache(mod, mark.nnode_ids);
+}
+
+void mod_commit(mod_t* mod, mod_mark_t mark) {
+    assert(mod->checkpoints > 0);
+    mpool_commit(mod->pool, mark.pool);
+    // The journal is only needed as long as there is an enclosing checkpoint
+    if (--mod->checkpoints == 0)
+        undo_vec_clear(&mod->undo);
+}
+
+static inline mod_shard_t* find_shard(mod_t* mod, uint32_t hash) {
+    return &mod->conc->shards[hash >> (32 - MOD_SHARD_BITS)];
+}
+
+static mpool_t** thread_pool(mod_t* mod) {
+    mpool_t** pool = pthread_getspecific(mod->conc->pool_key);
+    if (!pool) {
+        pool = xmalloc(sizeof(mpool_t*));
+        *pool = mpool_create();
+        pthread_setspecific(mod->conc->pool_key, pool);
+        pthread_mutex_lock(&mod->conc->lock);
+        pool_vec_push(&mod->conc->pools, pool);
+        pthread_mutex_unlock(&mod->conc->lock);
+    }
+    return pool;
+}
+
+void mod_begin_concurrent(mod_t* mod) {
+    assert(!mod->conc && mod->checkpoints == 0);
+    mod_conc_t* conc = xmalloc(sizeof(mod_conc_t));
+    pthread_mutex_init(&conc->lock, NULL);
+    pthread_key_create(&conc->pool_key, NULL);
+    conc->pools = pool_vec_create();
+    size_t cap = 16;
+    while (cap * MOD_NSHARDS < (mod->nodes.nelems + mod->types.nelems) * 2)
+        cap *= 2;
+    for (size_t i = 0; i < MOD_NSHARDS; ++i) {
+        pthread_mutex_init(&conc->shards[i].lock, NULL);
+        conc->shards[i].nodes = htable_create(sizeof(const node_t*), cap, node_cmp);
+        conc->shards[i].types = htable_create(sizeof(const type_t*), cap, type_cmp);
+        conc->shards[i].nnode_lookups = 0;
+        conc->shards[i].nnode_hits = 0;
+        conc->shards[i].ntype_lookups = 0;
+        conc->shards[i].ntype_hits = 0;
+    }
+    mod->conc = conc;
+    FORALL_NODES(mod, node, {
+        uint32_t hash = node_hash(&node);
+        htable_insert(find_shard(mod, hash)->nodes, &node, hash);
+    })
+    FORALL_TYPES(mod, type, {
+        uint32_t hash = type_hash(&type);
+        htable_insert(find_shard(mod, hash)->types, &type, hash);
+    })
+}
+
+void mod_end_concurrent(mod_t* mod) {
+    mod_conc_t* conc = mod->conc;
+    assert(conc);
+    FORALL_VEC(conc->pools, mpool_t**, pool, {
+        mpool_merge(mod->pool, *pool);
+        free(pool);
+    })
+    for (size_t i = 0; i < MOD_NSHARDS; ++i) {
+        mod->nnode_lookups += conc->shards[i].nnode_lookups;
+        mod->nnode_hits    += conc->shards[i].nnode_hits;
+        mod->ntype_lookups += conc->shards[i].ntype_lookups;
+        mod->ntype_hits    += conc->shards[i].ntype_hits;
+        pthread_mutex_destroy(&conc->shards[i].lock);
+        htable_destroy(conc->shards[i].nodes);
+        htable_destroy(conc->shards[i].types);
+    }
+    pool_vec_destroy(&conc->pools);
+    pthread_key_delete(conc->pool_key);
+    pthread_mutex_destroy(&conc->lock);
+    free(conc);
+    mod->conc = NULL;
+}
+
+void mod_lock(mod_t* mod) {
+    if (mod->conc) pthread_mutex_lock(&mod->conc->lock);
+}
+
+void mod_unlock(mod_t* mod) {
+    if (mod->conc) pthread_mutex_unlock(&mod->conc->lock);
+}
+
+static const type_t* insert_type_concurrent(mod_t* mod, const type_t* type) {
+    uint32_t hash = type_hash(&type);
+    mod_shard_t* shard = find_shard(mod, hash);
+    pthread_mutex_lock(&shard->lock);
+    size_t index = htable_lookup_with(shard->types, &type, hash, sizeof(const type_t*), type_cmp);
+    const type_t* found;
+    shard->ntype_lookups++;
+    if (index != INVALID_INDEX) {
+        shard->ntype_hits++;
+        found = ((const type_t**)shard->types->elems)[index];
+    } else {
+        type_t* type_ptr = alloc_type(thread_pool(mod), type);
+        pthread_mutex_lock(&mod->conc->lock);
+        add_type(mod, type_ptr);
+        pthread_mutex_unlock(&mod->conc->lock);
+        htable_insert_with(shard->types, &type_ptr, hash, sizeof(const type_t*), type_cmp);
+        found = type_ptr;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+static const node_t* insert_node_concurrent(mod_t* mod, const node_t* node) {
+    if (node->tag == NODE_FN) {
+        node_t* node_ptr = alloc_node(thread_pool(mod), node);
+        pthread_mutex_lock(&mod->conc->lock);
+        add_node(mod, node_ptr);
+        pthread_mutex_unlock(&mod->conc->lock);
+        return node_ptr;
+    }
+    uint32_t hash = node_hash(&node);
+    mod_shard_t* shard = find_shard(mod, hash);
+    pthread_mutex_lock(&shard->lock);
+    size_t index = htable_lookup_with(shard->nodes, &node, hash, sizeof(const node_t*), node_cmp);
+    const node_t* found;
+    shard->nnode_lookups++;
+    if (index != INVALID_INDEX) {
+        shard->nnode_hits++;
+        // Existing nodes keep their debug information, which other threads may be reading
+        found = ((const node_t**)shard->nodes->elems)[index];
+    } else {
+        node_t* node_ptr = alloc_node(thread_pool(mod), node);
+        pthread_mutex_lock(&mod->conc->lock);
+        add_node(mod, node_ptr);
+        pthread_mutex_unlock(&mod->conc->lock);
+        htable_insert_with(shard->nodes, &node_ptr, hash, sizeof(const node_t*), node_cmp);
+        found = node_ptr;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return found;
 }
 
 const type_t* mod_insert_type(mod_t* mod, const type_t* type) {
+    if (mod->conc)
+        return insert_type_concurrent(mod, type);
+
     const type_t** lookup = internal_type_set_lookup(&mod->types, type);
-    if (lookup)
+    mod->ntype_lookups++;
+    if (lookup) {
+        mod->ntype_hits++;
         return *lookup;
-
-    type_t* type_ptr = mpool_alloc(&mod->pool, sizeof(type_t));
-    memcpy(type_ptr, type, sizeof(type_t));
-    if (type->nops > 0) {
-        const type_t** type_ops = mpool_alloc(&mod->pool, sizeof(type_t*) * type->nops);
-        for (size_t i = 0; i < type->nops; ++i) type_ops[i] = type->ops[i];
-        type_ptr->ops = type_ops;
     }
 
-    bool success = internal_type_set_insert(&mod->types, type_ptr);
-    assert(success), (void)success;
+    type_t* type_ptr = alloc_type(&mod->pool, type);
+    add_type(mod, type_ptr);
     return type_ptr;
 }
 
 const node_t* mod_insert_node(mod_t* mod, const node_t* node) {
+    if (mod->conc)
+        return insert_node_concurrent(mod, node);
+
     // Functions are not hashed
     if (node->tag != NODE_FN) {
         const node_t** lookup = internal_node_set_lookup(&mod->nodes, node);
+        mod->nnode_lookups++;
         if (lookup) {
-            if (node->dbg && !(*lookup)->dbg)
+            mod->nnode_hits++;
+            if (node->dbg && !(*lookup)->dbg) {
+                record_undo(mod, (undo_t) {
+                    .tag = UNDO_DBG,
+                    .data.dbg = { .node = *lookup, .dbg = NULL }
+                });
                 (*(node_t**)lookup)->dbg = node->dbg;
+            }
             return *lookup;
         }
     }
 
-    node_t* node_ptr = mpool_alloc(&mod->pool, sizeof(node_t));
-    memcpy(node_ptr, node, sizeof(node_t));
-    if (node->nops > 0) {
-        const node_t** node_ops = mpool_alloc(&mod->pool, sizeof(node_t*) * node->nops);
-        for (size_t i = 0; i < node->nops; ++i) {
-            register_use(mod, i, node->ops[i], node_ptr);
-            node_ops[i] = node->ops[i];
-        }
-        node_ptr->ops = node_ops;
-    }
-
-    if (node->tag != NODE_FN) {
-        bool success = internal_node_set_insert(&mod->nodes, node_ptr);
-        assert(success), (void)success;
-    } else {
-        node_vec_push(&mod->fns, node_ptr);
-    }
+    node_t* node_ptr = alloc_node(&mod->pool, node);
+    add_node(mod, node_ptr);
     return node_ptr;
 }
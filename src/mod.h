@@ -4,20 +4,32 @@
 #include "adt.h"
 #include "mpool.h"
 
-typedef struct mod_s  mod_t;
-typedef struct type_s type_t;
-typedef struct node_s node_t;
+typedef struct mod_s      mod_t;
+typedef struct mod_mark_s mod_mark_t;
+typedef struct undo_s     undo_t;
+typedef struct type_s     type_t;
+typedef struct node_s     node_t;
+typedef struct dbg_s      dbg_t;
+typedef struct use_s      use_t;
+typedef struct mod_conc_s mod_conc_t;
+typedef struct mod_stats_s mod_stats_t;
+typedef struct implies_key_s implies_key_t;
+typedef struct node_facts_s node_facts_t;
+typedef struct cached_scope_s cached_scope_t;
+typedef struct scope_cache_s scope_cache_t;
 
 VEC(type_vec, const type_t*)
 HSET_DEFAULT(type_set, const type_t*)
 HMAP_DEFAULT(type2type, const type_t*, const type_t*)
 
 VEC(node_vec, const node_t*)
+SMALL_VEC(node_small_vec, const node_t*, 16)
 HSET_DEFAULT(node_set, const node_t*)
 HMAP_DEFAULT(node2node, const node_t*, const node_t*)
 
-#define FORALL_TYPES(mod, type, ...) FORALL_HSET(mod->types, const type_t*, type, __VA_ARGS__)
-#define FORALL_NODES(mod, node, ...) FORALL_HSET(mod->nodes, const node_t*, node, __VA_ARGS__)
+// Nodes and types are visited in the order in which they were inserted in the module
+#define FORALL_TYPES(mod, type, ...) FORALL_OHSET(mod->types, const type_t*, type, __VA_ARGS__)
+#define FORALL_NODES(mod, node, ...) FORALL_OHSET(mod->nodes, const node_t*, node, __VA_ARGS__)
 #define FORALL_FNS(mod, fn, ...)     FORALL_VEC(mod->fns, const node_t*, fn, __VA_ARGS__)
 
 bool node_cmp(const void*, const void*);
@@ -25,24 +37,148 @@ uint32_t node_hash(const void* ptr);
 bool type_cmp(const void*, const void*);
 uint32_t type_hash(const void*);
 
-HSET(internal_type_set, const type_t*, type_cmp, type_hash)
-HSET(internal_node_set, const node_t*, node_cmp, node_hash)
+OHSET(internal_type_set, const type_t*, type_cmp, type_hash)
+OHSET(internal_node_set, const node_t*, node_cmp, node_hash)
+
+enum undo_tag_e {
+    UNDO_NODE,
+    UNDO_TYPE,
+    UNDO_BIND,
+    UNDO_DBG
+};
+
+// Journal entry recording a change to the module made after a checkpoint
+struct undo_s {
+    uint32_t tag;
+    union {
+        const node_t* node;
+        const type_t* type;
+        struct {
+            const node_t* node;
+            size_t index;
+            const node_t* op;
+        } bind;
+        struct {
+            const node_t* node;
+            const dbg_t* dbg;
+        } dbg;
+    } data;
+};
+
+VEC(undo_vec, undo_t)
+
+// Key of the results of node_implies() cached in a module. The two flags
+// record whether the left and right operands are negated.
+struct implies_key_s {
+    uint32_t left;
+    uint32_t right;
+    uint32_t flags;
+};
+
+HMAP_DEFAULT(implies_cache, implies_key_t, bool)
+
+// Default number of steps after which node_implies() gives up
+#define MOD_IMPLIES_BUDGET 256
+
+// What is known about the value of an integer or boolean node (see facts.h).
+// Bounds are sign-extended to 64 bits for signed types, and booleans are
+// treated as unsigned integers with one bit.
+struct node_facts_s {
+    uint64_t zeros;     // Bits known to be zero
+    uint64_t ones;      // Bits known to be one
+    uint64_t min;
+    uint64_t max;
+};
+
+// Indexed by node identifier
+VEC(facts_cache, node_facts_t)
+
+// Number of levels of operands that node_facts() looks through in
+// concurrent mode, where its results are not cached
+#define MOD_FACTS_DEPTH 4
 
 struct mod_s {
     mpool_t*            pool;
     node_vec_t          fns;
     internal_node_set_t nodes;
     internal_type_set_t types;
+    undo_vec_t          undo;
+    size_t              checkpoints;
+    // Number of identifiers given to nodes and types so far
+    uint32_t            nnode_ids;
+    uint32_t            ntype_ids;
+    mod_conc_t*         conc;   // Only set in concurrent mode
+    // Only refers to nodes with an identifier lower than the bound
+    implies_cache_t     implies_cache;
+    uint32_t            implies_bound;
+    size_t              implies_budget;
+    facts_cache_t       facts_cache;
+    scope_cache_t*      scope_cache;
+    // Hash-consing statistics, reported by mod_stats()
+    size_t              nnode_lookups;
+    size_t              nnode_hits;
+    size_t              ntype_lookups;
+    size_t              ntype_hits;
+};
+
+struct mod_mark_s {
+    mpool_mark_t pool;
+    size_t undo;
+    size_t nfns;
+    uint32_t nnode_ids;
+    uint32_t ntype_ids;
 };
 
 mod_t* mod_create(void);
 void mod_destroy(mod_t*);
 void mod_dump(mod_t*);
 
+// Checkpoints can be nested, and must be closed in reverse order with either
+// mod_rollback(), which removes every node, type, use and allocation made since
+// the checkpoint, or mod_commit(), which keeps them. Replacements registered
+// with node_replace() on older nodes are not undone by a rollback.
+mod_mark_t mod_checkpoint(mod_t*);
+void mod_rollback(mod_t*, mod_mark_t);
+void mod_commit(mod_t*, mod_mark_t);
+
 void mod_opt(mod_t**);
 
 void node_bind(mod_t*, const node_t*, size_t, const node_t*);
 
+// Rewrites the nodes and functions of the module so that their operands are
+// the representatives given by node_resolve(). Rewritten nodes are replaced.
+void mod_apply_replacements(mod_t*);
+
+// Removes a node without uses from the module and recycles its memory, along
+// with the operands that become unused as a result (except functions). No
+// other reference to the removed nodes may be kept, including replacements.
+void mod_remove_node(mod_t*, const node_t*);
+
+// Removes the nodes and types that cannot be reached from the exported functions,
+// and recycles their memory. References to removed nodes or types become invalid.
+void mod_gc(mod_t*);
+
+// Reorders and renumbers the nodes and types created after the given numbers of
+// identifiers, so that they only depend on the functions of the module, and
+// removes those that cannot be reached from the functions. No function may have
+// been created after these identifiers, and no other reference to the removed
+// nodes or types may be kept.
+void mod_canonicalize(mod_t*, uint32_t, uint32_t);
+
+// In concurrent mode, several threads may create nodes and types, and bind
+// the operands of functions, at the same time. Hash-consing goes through
+// sharded tables with one lock each, and every thread allocates from its own
+// pool, which is merged into the module when the mode ends. Checkpoints and
+// the functions that inspect or remove nodes are not allowed in that mode,
+// and the order of insertion depends on the scheduling of the threads.
+void mod_begin_concurrent(mod_t*);
+void mod_end_concurrent(mod_t*);
+
+// Serializes the accesses to the state of the module that is shared between
+// threads in concurrent mode, and does nothing otherwise
+void mod_lock(mod_t*);
+void mod_unlock(mod_t*);
+
 const type_t* mod_insert_type(mod_t*, const type_t*);
 const node_t* mod_insert_node(mod_t*, const node_t*);
 
@@ -1,30 +1,56 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <assert.h>
 
 #include "mpool.h"
 #include "util.h"
 
-#define MPOOL_DEFAULT_CAP 4096
+#define MPOOL_DEFAULT_CAP     4096
+#define MPOOL_DEFAULT_MAX_CAP (1024 * 1024)
+#define MPOOL_ALIGN           8
+// Requests larger than a fraction of the next chunk capacity get their own chunk
+#define MPOOL_LARGE_RATIO     4
+// Freed blocks up to this size are recycled, in classes of MPOOL_ALIGN bytes
+#define MPOOL_MAX_BIN_SIZE    256
+#define MPOOL_NBINS           (MPOOL_MAX_BIN_SIZE / MPOOL_ALIGN)
 
 static inline void* mpool_ptr(mpool_t* pool) {
     return ((uint8_t*)pool->begin) + pool->size;
 }
 
-mpool_t* mpool_create_with_cap(size_t cap) {
+static inline size_t mpool_align(size_t size) {
+    return (size + MPOOL_ALIGN - 1) & ~(size_t)(MPOOL_ALIGN - 1);
+}
+
+static inline size_t mpool_bin(size_t size) {
+    return size / MPOOL_ALIGN - 1;
+}
+
+static inline mpool_t* mpool_chunk(size_t cap, size_t max_cap) {
     mpool_t* pool = xmalloc(sizeof(mpool_t));
-    pool->begin = xmalloc(cap);
-    pool->cap   = cap;
-    pool->size  = 0;
-    pool->next  = NULL;
+    pool->begin   = xmalloc(cap);
+    pool->cap     = cap;
+    pool->max_cap = max_cap;
+    pool->size    = 0;
+    pool->requested = 0;
+    pool->bins    = NULL;
+    pool->next    = NULL;
     return pool;
 }
 
+mpool_t* mpool_create_with_cap(size_t cap, size_t max_cap) {
+    cap = mpool_align(cap);
+    assert(cap > 0 && cap <= max_cap);
+    return mpool_chunk(cap, max_cap);
+}
+
 mpool_t* mpool_create(void) {
-    return mpool_create_with_cap(MPOOL_DEFAULT_CAP);
+    return mpool_create_with_cap(MPOOL_DEFAULT_CAP, MPOOL_DEFAULT_MAX_CAP);
 }
 
 void mpool_destroy(mpool_t* pool) {
+    free(pool->bins);
     while (pool) {
         mpool_t* next = pool->next;
         free(pool->begin);
@@ -34,19 +60,173 @@ void mpool_destroy(mpool_t* pool) {
 }
 
 void* mpool_alloc(mpool_t** root, size_t size) {
-    const size_t align = 8;
     mpool_t* pool = *root;
-    while (true) {
-        if (pool->cap - pool->size >= size) {
-            void*  ptr = mpool_ptr(pool);
-            size_t pad = size % align;
-            pool->size += size + (pad == 0 ? 0 : align - pad);
-            return ptr;
+    size_t requested = size;
+    size = mpool_align(size);
+    if (pool->bins && size <= MPOOL_MAX_BIN_SIZE && size > 0) {
+        void** block = pool->bins[mpool_bin(size)];
+        if (block) {
+            pool->bins[mpool_bin(size)] = *block;
+            pool->requested += requested;
+            return block;
+        }
+    }
+    if (pool->cap - pool->size >= size) {
+        void* ptr = mpool_ptr(pool);
+        pool->size += size;
+        pool->requested += requested;
+        return ptr;
+    }
+
+    size_t next_cap = pool->cap * 2 < pool->max_cap ? pool->cap * 2 : pool->max_cap;
+    if (size > next_cap / MPOOL_LARGE_RATIO) {
+        // Large requests are served by a dedicated chunk, placed after the
+        // current one so that the remaining space in the latter is not lost
+        mpool_t* large = mpool_chunk(size, pool->max_cap);
+        large->size = size;
+        large->next = pool->next;
+        pool->requested += requested;
+        pool->next  = large;
+        return large->begin;
+    }
+
+    mpool_t* next = mpool_chunk(next_cap, pool->max_cap);
+    next->size = size;
+    next->requested = pool->requested + requested;
+    next->bins = pool->bins;
+    next->next = pool;
+    pool->bins = NULL;
+    *root = next;
+    return next->begin;
+}
+
+void mpool_free(mpool_t* pool, void* ptr, size_t size) {
+    size_t requested = size;
+    size = mpool_align(size);
+    // Larger blocks are not recycled
+    if (size > MPOOL_MAX_BIN_SIZE || size == 0)
+        return;
+    pool->requested -= requested;
+    if (!pool->bins)
+        pool->bins = xcalloc(MPOOL_NBINS, sizeof(void*));
+    void** block = ptr;
+    *block = pool->bins[mpool_bin(size)];
+    pool->bins[mpool_bin(size)] = block;
+}
+
+mpool_mark_t mpool_mark(mpool_t* pool) {
+    mpool_mark_t mark = {
+        .chunk = pool,
+        .next  = pool->next,
+        .size  = pool->size,
+        .requested = pool->requested,
+        .bins  = pool->bins
+    };
+    pool->bins = NULL;
+    return mark;
+}
+
+static inline bool in_chunk(const mpool_t* chunk, const void* ptr, size_t begin) {
+    const uint8_t* byte = ptr;
+    return byte >= (const uint8_t*)chunk->begin + begin && byte < (const uint8_t*)chunk->begin + chunk->cap;
+}
+
+static inline bool is_released(const mpool_t* root, const mpool_mark_t* mark, const void* ptr) {
+    for (const mpool_t* chunk = root; chunk != mark->chunk; chunk = chunk->next) {
+        if (in_chunk(chunk, ptr, 0))
+            return true;
+    }
+    for (const mpool_t* chunk = mark->chunk->next; chunk != mark->next; chunk = chunk->next) {
+        if (in_chunk(chunk, ptr, 0))
+            return true;
+    }
+    return in_chunk(mark->chunk, ptr, mark->size);
+}
+
+// Moves the blocks of the given free lists into the others, except those that
+// the mark releases, if any, and frees the given lists
+static void move_bins(void*** bins, void** from, const mpool_t* root, const mpool_mark_t* mark) {
+    if (!from)
+        return;
+    if (!*bins)
+        *bins = xcalloc(MPOOL_NBINS, sizeof(void*));
+    for (size_t i = 0; i < MPOOL_NBINS; ++i) {
+        void** block = from[i];
+        while (block) {
+            void** next = *block;
+            if (!mark || !is_released(root, mark, block)) {
+                *block = (*bins)[i];
+                (*bins)[i] = block;
+            }
+            block = next;
         }
+    }
+    free(from);
+}
 
-        mpool_t* next = mpool_create_with_cap(size > pool->cap ? size : pool->cap);
-        next->next = pool;
-        *root = next;
-        pool  = next;
+void mpool_release(mpool_t** root, mpool_mark_t mark) {
+    // Blocks allocated since the mark did not come from the free lists it set
+    // aside, which can thus be restored along with the blocks freed since then
+    mpool_t* pool = *root;
+    void** bins = mark.bins;
+    move_bins(&bins, pool->bins, pool, &mark);
+    pool->bins = NULL;
+
+    // Free the chunks created after the mark: those placed before the
+    // marked chunk, and the large chunks inserted right after it
+    while (pool != mark.chunk) {
+        assert(pool);
+        mpool_t* next = pool->next;
+        free(pool->begin);
+        free(pool);
+        pool = next;
+    }
+    pool = mark.chunk->next;
+    while (pool != mark.next) {
+        assert(pool);
+        mpool_t* next = pool->next;
+        free(pool->begin);
+        free(pool);
+        pool = next;
+    }
+    mark.chunk->next = mark.next;
+    mark.chunk->size = mark.size;
+    mark.chunk->requested = mark.requested;
+    mark.chunk->bins = bins;
+    *root = mark.chunk;
+}
+
+void mpool_commit(mpool_t* pool, mpool_mark_t mark) {
+    void** bins = mark.bins;
+    move_bins(&bins, pool->bins, pool, NULL);
+    pool->bins = bins;
+}
+
+void mpool_merge(mpool_t* pool, mpool_t* from) {
+    move_bins(&pool->bins, from->bins, from, NULL);
+    from->bins = NULL;
+    // The chunks are placed after the first one, like large chunks
+    mpool_t* last = from;
+    while (last->next) last = last->next;
+    last->next = pool->next;
+    pool->next = from;
+    pool->requested += from->requested;
+    from->requested = 0;
+}
+
+mpool_stats_t mpool_stats(const mpool_t* pool) {
+    mpool_stats_t stats = { .requested = pool->requested };
+    if (pool->bins) {
+        for (size_t i = 0; i < MPOOL_NBINS; ++i) {
+            for (void** block = pool->bins[i]; block; block = *block)
+                stats.free += (i + 1) * MPOOL_ALIGN;
+        }
+    }
+    for (const mpool_t* chunk = pool; chunk; chunk = chunk->next) {
+        stats.used      += chunk->size;
+        stats.reserved  += chunk->cap;
+        stats.wasted    += chunk != pool ? chunk->cap - chunk->size : 0;
+        stats.nchunks++;
     }
+    return stats;
 }
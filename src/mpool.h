@@ -3,18 +3,57 @@
 
 #include <stddef.h>
 
-typedef struct mpool_s mpool_t;
+typedef struct mpool_s      mpool_t;
+typedef struct mpool_mark_s  mpool_mark_t;
+typedef struct mpool_stats_s mpool_stats_t;
 
+// A memory pool is a linked list of chunks, the first of which is the one
+// currently used for allocation. Chunk capacities grow geometrically
+// (doubling) from the initial capacity up to max_cap.
+// Freed blocks are kept in free lists, one per size class, that are created
+// on the first call to mpool_free() and owned by the first chunk. A mark sets
+// the free lists aside until it is released or committed, so that the blocks
+// allocated after it never come from them.
 struct mpool_s {
     void*  begin;
     size_t size;
     size_t cap;
+    size_t requested;   // Only meaningful for the first chunk
+    size_t max_cap;
+    void** bins;
     mpool_t* next;
 };
 
-mpool_t* mpool_create_with_cap(size_t);
+// Position in a pool, used to release every allocation made after it
+struct mpool_mark_s {
+    mpool_t* chunk;
+    mpool_t* next;
+    size_t   size;
+    size_t   requested;
+    void**   bins;      // Free lists of the pool when the mark was taken
+};
+
+struct mpool_stats_s {
+    size_t requested;   // Bytes requested by live allocations, before alignment
+    size_t used;        // Bytes taken in chunks, including alignment padding
+    size_t reserved;    // Total capacity of all chunks
+    size_t wasted;      // Unused bytes at the end of chunks other than the first
+    size_t free;        // Bytes waiting in free lists
+    size_t nchunks;
+};
+
+mpool_t* mpool_create_with_cap(size_t, size_t);
 mpool_t* mpool_create(void);
 void mpool_destroy(mpool_t*);
 void* mpool_alloc(mpool_t**, size_t);
+void mpool_free(mpool_t*, void*, size_t);
+mpool_mark_t mpool_mark(mpool_t*);
+// Marks must be either released or committed, in reverse order. Releasing keeps
+// the blocks freed since the mark, except those in the memory being released.
+void mpool_release(mpool_t**, mpool_mark_t);
+void mpool_commit(mpool_t*, mpool_mark_t);
+// Moves the chunks and free blocks of the second pool into the first one
+void mpool_merge(mpool_t*, mpool_t*);
+mpool_stats_t mpool_stats(const mpool_t*);
 
 #endif // MPOOL_H
@@ -2,6 +2,8 @@
 
 #include "node.h"
 #include "type.h"
+#include "facts.h"
+#include "scope.h"
 
 static inline size_t box_size(uint32_t tag) {
     switch (tag) {
@@ -273,6 +275,25 @@ const node_t* node_literal(mod_t* mod, const type_t* type, box_t box) {
     });
 }
 
+const node_t* node_int_literal(mod_t* mod, const type_t* type, uint64_t value) {
+    box_t box;
+    switch (type->tag) {
+        case TYPE_BOOL: box.b   = value & 1;        break;
+        case TYPE_I8:   box.i8  = (int8_t)value;   break;
+        case TYPE_I16:  box.i16 = (int16_t)value;  break;
+        case TYPE_I32:  box.i32 = (int32_t)value;  break;
+        case TYPE_I64:  box.i64 = (int64_t)value;  break;
+        case TYPE_U8:   box.u8  = (uint8_t)value;  break;
+        case TYPE_U16:  box.u16 = (uint16_t)value; break;
+        case TYPE_U32:  box.u32 = (uint32_t)value; break;
+        case TYPE_U64:  box.u64 = value;           break;
+        default:
+            assert(false);
+            return NULL;
+    }
+    return node_literal(mod, type, box);
+}
+
 bool node_is_not(const node_t* node) {
     return node->tag == NODE_XOR && node_is_all_ones(node->ops[0]);
 }
@@ -286,7 +307,9 @@ bool node_is_cmp(const node_t* node) {
            node->tag == NODE_CMPEQ;
 }
 
-bool node_implies(mod_t* mod, const node_t* left, const node_t* right, bool not_left, bool not_right) {
+static bool implies(mod_t*, size_t*, const node_t*, const node_t*, bool, bool);
+
+static bool implies_uncached(mod_t* mod, size_t* budget, const node_t* left, const node_t* right, bool not_left, bool not_right) {
     assert(left->type->tag  == TYPE_BOOL);
     assert(right->type->tag == TYPE_BOOL);
     if (left->tag == NODE_LITERAL) {
@@ -300,77 +323,77 @@ bool node_implies(mod_t* mod, const node_t* left, const node_t* right, bool not_
     if (left->tag == NODE_AND) {
         if (not_left) {
             // ~(X & Y) => right <=> (~X | ~Y) => right
-            return node_implies(mod, left->ops[0], right, !not_left, not_right) &&
-                   node_implies(mod, left->ops[1], right, !not_left, not_right);
+            return implies(mod, budget, left->ops[0], right, !not_left, not_right) &&
+                   implies(mod, budget, left->ops[1], right, !not_left, not_right);
         } else {
             // (X & Y) => right <=> (X => right) | (Y => right)
-            return node_implies(mod, left->ops[0], right, not_left, not_right) ||
-                   node_implies(mod, left->ops[1], right, not_left, not_right);
+            return implies(mod, budget, left->ops[0], right, not_left, not_right) ||
+                   implies(mod, budget, left->ops[1], right, not_left, not_right);
         }
     } else if (left->tag == NODE_OR) {
         if (not_left) {
             // ~(X | Y) => right <=> (~X & ~Y) => right
-            return node_implies(mod, left->ops[0], right, !not_left, not_right) ||
-                   node_implies(mod, left->ops[1], right, !not_left, not_right);
+            return implies(mod, budget, left->ops[0], right, !not_left, not_right) ||
+                   implies(mod, budget, left->ops[1], right, !not_left, not_right);
         } else {
             // X | Y => right <=> (X => right) & (Y => right)
-            return node_implies(mod, left->ops[0], right, not_left, not_right) &&
-                   node_implies(mod, left->ops[1], right, not_left, not_right);
+            return implies(mod, budget, left->ops[0], right, not_left, not_right) &&
+                   implies(mod, budget, left->ops[1], right, not_left, not_right);
         }
     } else if (left->tag == NODE_XOR) {
         if (node_is_not(left)) {
-            return node_implies(mod, left->ops[1], right, !not_left, not_right);
+            return implies(mod, budget, left->ops[1], right, !not_left, not_right);
         } else {
             if (not_left) {
                 // ~(X ^ Y) => right <=> (~X | Y) & (X | ~Y) => right
-                return (node_implies(mod, left->ops[0], right, !not_left, not_right) &&
-                        node_implies(mod, left->ops[1], right,  not_left, not_right)) ||
-                       (node_implies(mod, left->ops[0], right,  not_left, not_right) &&
-                        node_implies(mod, left->ops[1], right, !not_left, not_right));
+                return (implies(mod, budget, left->ops[0], right, !not_left, not_right) &&
+                        implies(mod, budget, left->ops[1], right,  not_left, not_right)) ||
+                       (implies(mod, budget, left->ops[0], right,  not_left, not_right) &&
+                        implies(mod, budget, left->ops[1], right, !not_left, not_right));
             } else {
                 // (X ^ Y) => right <=> (X & ~Y) | (~X & Y) => right
-                return (node_implies(mod, left->ops[0], right, !not_left, not_right) ||
-                        node_implies(mod, left->ops[1], right,  not_left, not_right)) &&
-                       (node_implies(mod, left->ops[0], right,  not_left, not_right) ||
-                        node_implies(mod, left->ops[1], right, !not_left, not_right));
+                return (implies(mod, budget, left->ops[0], right, !not_left, not_right) ||
+                        implies(mod, budget, left->ops[1], right,  not_left, not_right)) &&
+                       (implies(mod, budget, left->ops[0], right,  not_left, not_right) ||
+                        implies(mod, budget, left->ops[1], right, !not_left, not_right));
             }
         }
     } else if (right->tag == NODE_AND) {
         if (not_right) {
             // left => ~(X & Y) <=> left => (~X | ~Y)
-            return node_implies(mod, left, right->ops[0], not_left, !not_right) ||
-                   node_implies(mod, left, right->ops[1], not_left, !not_right);
+            return implies(mod, budget, left, right->ops[0], not_left, !not_right) ||
+                   implies(mod, budget, left, right->ops[1], not_left, !not_right);
         } else {
             // left => X & Y <=> (left => X) & (left => Y)
-            return node_implies(mod, left, right->ops[0], not_left, not_right) &&
-                   node_implies(mod, left, right->ops[1], not_left, not_right);
+            return implies(mod, budget, left, right->ops[0], not_left, not_right) &&
+                   implies(mod, budget, left, right->ops[1], not_left, not_right);
         }
     } else if (right->tag == NODE_OR) {
         if (not_right) {
             // left => ~(X | Y) <=> left => (~X & ~Y)
-            return node_implies(mod, left, right->ops[0], not_left, !not_right) &&
-                   node_implies(mod, left, right->ops[1], not_left, !not_right);
+            return implies(mod, budget, left, right->ops[0], not_left, !not_right) &&
+                   implies(mod, budget, left, right->ops[1], not_left, !not_right);
         } else {
             // left => X | Y <=> (left => X) | (left => Y)
-            return node_implies(mod, left, right->ops[0], not_left, not_right) ||
-                   node_implies(mod, left, right->ops[1], not_left, not_right);
+            return implies(mod, budget, left, right->ops[0], not_left, not_right) ||
+                   implies(mod, budget, left, right->ops[1], not_left, not_right);
         }
     } else if (right->tag == NODE_XOR) {
         if (node_is_not(right)) {
-            return node_implies(mod, left, right->ops[1], not_left, !not_right);
+            return implies(mod, budget, left, right->ops[1], not_left, !not_right);
         } else {
             if (not_right) {
                 // left => ~(X ^ Y) <=> left => (~X | Y) & (X | ~Y)
-                return (node_implies(mod, left, right->ops[0], not_left, !not_right) ||
-                        node_implies(mod, left, right->ops[1], not_left,  not_right)) &&
-                       (node_implies(mod, left, right->ops[0], not_left,  not_right) ||
-                        node_implies(mod, left, right->ops[1], not_left, !not_right));
+                return (implies(mod, budget, left, right->ops[0], not_left, !not_right) ||
+                        implies(mod, budget, left, right->ops[1], not_left,  not_right)) &&
+                       (implies(mod, budget, left, right->ops[0], not_left,  not_right) ||
+                        implies(mod, budget, left, right->ops[1], not_left, !not_right));
             } else {
                 // left => (X ^ Y) <=> left => (X & ~Y) | (~X & Y)
-                return (node_implies(mod, left, right->ops[0], not_left, !not_right) &&
-                        node_implies(mod, left, right->ops[1], not_left,  not_right)) ||
-                       (node_implies(mod, left, right->ops[0], not_left,  not_right) &&
-                        node_implies(mod, left, right->ops[1], not_left, !not_right));
+                return (implies(mod, budget, left, right->ops[0], not_left, !not_right) &&
+                        implies(mod, budget, left, right->ops[1], not_left,  not_right)) ||
+                       (implies(mod, budget, left, right->ops[0], not_left,  not_right) &&
+                        implies(mod, budget, left, right->ops[1], not_left, !not_right));
             }
         }
     } else {
@@ -417,6 +440,49 @@ bool node_implies(mod_t* mod, const node_t* left, const node_t* right, bool not_
     }
 }
 
+static bool implies(mod_t* mod, size_t* budget, const node_t* left, const node_t* right, bool not_left, bool not_right) {
+    // Queries that run out of steps are assumed to fail
+    if (*budget == 0)
+        return false;
+    // In concurrent mode, the cache of the module cannot be shared
+    if (mod->conc) {
+        (*budget)--;
+        return implies_uncached(mod, budget, left, right, not_left, not_right);
+    }
+    implies_key_t key = {
+        .left  = left->id,
+        .right = right->id,
+        .flags = (not_left ? 1 : 0) | (not_right ? 2 : 0)
+    };
+    const bool* cached = implies_cache_lookup(&mod->implies_cache, key);
+    if (cached)
+        return *cached;
+    (*budget)--;
+    bool res = implies_uncached(mod, budget, left, right, not_left, not_right);
+    // Failures caused by the budget are not cached
+    if (res || *budget > 0) {
+        implies_cache_insert(&mod->implies_cache, key, res);
+        uint32_t bound = (left->id > right->id ? left->id : right->id) + 1;
+        if (bound > mod->implies_bound)
+            mod->implies_bound = bound;
+    }
+    return res;
+}
+
+bool node_implies(mod_t* mod, const node_t* left, const node_t* right, bool not_left, bool not_right) {
+    size_t budget = mod->implies_budget;
+    // In concurrent mode, checkpoints are not available, and the temporary
+    // nodes are left in the module until they are collected
+    if (mod->conc)
+        return implies(mod, &budget, left, right, not_left, not_right);
+    // The nodes built while testing the implication are only needed
+    // temporarily, and are removed from the module afterwards
+    mod_mark_t mark = mod_checkpoint(mod);
+    bool res = implies(mod, &budget, left, right, not_left, not_right);
+    mod_rollback(mod, mark);
+    return res;
+}
+
 static inline const node_t* try_fold_tuple(size_t nops, const node_t** ops) {
     const node_t* base = NULL;
     for (size_t i = 0; i < nops; ++i) {
@@ -692,6 +758,10 @@ const node_t* node_extend(mod_t* mod, const node_t* value, const type_t* type, c
     }
     if (type == value->type)
         return value;
+    // Values that are known even though they are not literals
+    const node_t* folded = node_fold_facts(mod, NODE_EXTEND, type, 1, &value);
+    if (folded)
+        return folded;
     return make_node(mod, (node_t) {
         .tag  = NODE_EXTEND,
         .nops = 1,
@@ -759,6 +829,10 @@ const node_t* node_trunc(mod_t* mod, const node_t* value, const type_t* type, co
         if (ext->type == type)
             return ext;
     }
+    // trunc(x & 0xFF00, u8) <=> 0
+    const node_t* folded = node_fold_facts(mod, NODE_TRUNC, type, 1, &value);
+    if (folded)
+        return folded;
     return make_node(mod, (node_t) {
         .tag  = NODE_TRUNC,
         .nops = 1,
@@ -874,8 +948,9 @@ static inline bool node_can_switch_comparands(uint32_t tag, const type_t* type)
 static inline bool node_should_switch_ops(const node_t* left, const node_t* right) {
     // Establish a standardized order for operands in commutative expressions/comparisons
     // - Literals always go to the left
-    // - Non-literal operands are ordered by address
-    return right->tag == NODE_LITERAL || ((uintptr_t)left > (uintptr_t)right && left->tag != NODE_LITERAL);
+    // - Non-literal operands are ordered by identifier, which unlike addresses
+    //   does not depend on the allocator
+    return right->tag == NODE_LITERAL || (left->id > right->id && left->tag != NODE_LITERAL);
 }
 
 static inline void node_switch_ops(const node_t** left, const node_t** right) {
@@ -884,6 +959,32 @@ static inline void node_switch_ops(const node_t** left, const node_t** right) {
     *right = tmp;
 }
 
+// Returns the comparison that gives the same result once its comparands are switched
+static inline uint32_t node_switch_comparison(uint32_t tag) {
+    switch (tag) {
+        case NODE_CMPGT: return NODE_CMPLT;
+        case NODE_CMPGE: return NODE_CMPLE;
+        case NODE_CMPLT: return NODE_CMPGT;
+        case NODE_CMPLE: return NODE_CMPGE;
+        default:
+            assert(tag == NODE_CMPEQ || tag == NODE_CMPNE);
+            return tag;
+    }
+}
+
+void node_order_ops(node_t* node) {
+    if (node->nops != 2 || !node_should_switch_ops(node->ops[0], node->ops[1]))
+        return;
+    if (node_is_commutative(node->tag)) {
+        node_switch_ops(&node->ops[0], &node->ops[1]);
+    } else if (node_is_cmp(node) && node_can_switch_comparands(node->tag, node->ops[0]->type)) {
+        node_switch_ops(&node->ops[0], &node->ops[1]);
+        node->tag = node_switch_comparison(node->tag);
+    }
+}
+
+#include "peephole.inc"
+
 #define CMPOP_B(op, res, left, right) \
     case TYPE_BOOL: res = left.b op right.b; break;
 
@@ -943,35 +1044,21 @@ static inline const node_t* make_cmpop(mod_t* mod, uint32_t tag, const node_t* l
 
     if (node_should_switch_ops(left, right) && node_can_switch_comparands(tag, left->type)) {
         node_switch_ops(&left, &right);
-        switch (tag) {
-            case NODE_CMPGT: tag = NODE_CMPLT; break;
-            case NODE_CMPGE: tag = NODE_CMPLE; break;
-            case NODE_CMPLT: tag = NODE_CMPGT; break;
-            case NODE_CMPLE: tag = NODE_CMPGE; break;
-            default:
-                assert(tag == NODE_CMPEQ || tag == NODE_CMPNE);
-                break;
-        }
+        tag = node_switch_comparison(tag);
     }
 
-    if (left == right) {
-        // X > X  <=> false
-        // X < X  <=> false
-        // X != X <=> false
-        if (tag == NODE_CMPNE || tag == NODE_CMPGT || tag == NODE_CMPLT) return node_bool(mod, false);
-        // X == X <=> true
-        // X >= X <=> true
-        // X <= X <=> true
-        if (tag == NODE_CMPEQ || tag == NODE_CMPGE || tag == NODE_CMPLE) return node_bool(mod, true);
-    }
-    if (type_is_u(left->type) && node_is_zero(left)) {
-        // 0 > X <=> false
-        if (tag == NODE_CMPGT) return node_bool(mod, false);
-        // 0 <= X <=> true
-        if (tag == NODE_CMPLE) return node_bool(mod, true);
-    }
+    // Simplification rules, generated from peephole.rules
+    const node_t* res = apply_rules(mod, tag, left, right, dbg);
+    if (res)
+        return res;
 
+    // Comparisons decided by the known bits and bounds of the operands
+    // (x & 0xFF) < 256 <=> true
     const node_t* ops[] = { left, right };
+    res = node_fold_facts(mod, tag, type_bool(mod), 2, ops);
+    if (res)
+        return res;
+
     return make_node(mod, (node_t) {
         .tag = tag,
         .nops = 2,
@@ -1071,112 +1158,20 @@ static inline const node_t* make_binop(mod_t* mod, uint32_t tag, const node_t* l
     if (node_should_switch_ops(left, right) && node_is_commutative(tag))
         node_switch_ops(&left, &right);
 
-    // Simplification rules
-    if (node_is_zero(left)) {
-        // 0 + a <=> a
-        // 0 | a <=> a
-        // 0 ^ a <=> a
-        if (tag == NODE_ADD || tag == NODE_OR || tag == NODE_XOR) return right;
-        // 0 * a <=> 0
-        // 0 & a <=> 0
-        if (tag == NODE_MUL || tag == NODE_AND) return node_zero(mod, left->type);
-    }
-    if (node_is_all_ones(left)) {
-        // 1 & a <=> a
-        if (tag == NODE_AND) return right;
-        // 1 | a <=> 1
-        if (tag == NODE_OR) return left;
-        // ~(a cmp b) <=> a ~(cmp) b
-        if (tag == NODE_XOR && node_is_cmp(right) && node_can_switch_comparands(right->tag, right->type)) {
-            switch (right->tag) {
-                case NODE_CMPGT: return node_cmple(mod, right->ops[0], right->ops[1], dbg);
-                case NODE_CMPGE: return node_cmplt(mod, right->ops[0], right->ops[1], dbg);
-                case NODE_CMPLT: return node_cmpge(mod, right->ops[0], right->ops[1], dbg);
-                case NODE_CMPLE: return node_cmpgt(mod, right->ops[0], right->ops[1], dbg);
-                case NODE_CMPNE: return node_cmpeq(mod, right->ops[0], right->ops[1], dbg);
-                case NODE_CMPEQ: return node_cmpne(mod, right->ops[0], right->ops[1], dbg);
-                default:
-                    assert(false);
-                    break;
-            }
-        }
-    }
-    // 1 * a <=> a
-    if (tag == NODE_MUL && node_is_one(left))
-        return right;
-    if (node_is_zero(right)) {
-        // a * 0 <=> 0
-        if (tag == NODE_MUL) return node_zero(mod, left->type);
-        // a + 0 <=> 0
-        if (tag == NODE_ADD) return node_zero(mod, left->type);
-        // a >> 0 <=> a
-        // a << 0 <=> a
-        // a - 0 <=> a
-        if (tag == NODE_LSHFT || tag == NODE_RSHFT || tag == NODE_SUB) return left;
-        assert(tag != NODE_AND && tag != NODE_OR); // Commutative operations should be handled before
-    }
-    if (node_is_one(right)) {
-        // a / 1 <=> a
-        // a * 1 <=> a
-        if (tag == NODE_DIV || tag == NODE_MUL) return left;
-        // a % 1 <=> 0
-        if (tag == NODE_REM) return node_zero(mod, left->type);
-    }
-    if (left == right) {
-        // a & a <=> a
-        // a | a <=> a
-        if (tag == NODE_AND || tag == NODE_OR)  return left;
-        // a ^ a <=> 0
-        // a % a <=> 0
-        // a - a <=> 0
-        if (tag == NODE_XOR || tag == NODE_REM || tag == NODE_SUB) return node_zero(mod, left->type);
-        // a / a <=> 1
-        if (tag == NODE_DIV) return node_one(mod, left->type);
+    // Simplification rules, generated from peephole.rules
+    const node_t* res = apply_rules(mod, tag, left, right, dbg);
+    if (res)
+        return res;
+
+    // Shifts that only leave known bits
+    // (x & 0xFF) >> 8 <=> 0
+    if (tag == NODE_RSHFT) {
+        const node_t* ops[] = { left, right };
+        res = node_fold_facts(mod, tag, left->type, 2, ops);
+        if (res)
+            return res;
     }
-    if (tag == NODE_AND) {
-        // a & (a | b) <=> a
-        // a & (b | a) <=> a
-        if (right->tag == NODE_OR && (right->ops[0] == left || right->ops[1] == left))
-            return left;
-        // (a | b) & a <=> a
-        // (b | a) & a <=> a
-        if (left->tag == NODE_OR && (left->ops[0] == right || left->ops[1] == right))
-            return right;
-        // a & ~a <=> 0
-        // ~a & a <=> 0
-        if ((right->tag == NODE_XOR && node_is_not(right) && right->ops[1] == left) ||
-            (left->tag  == NODE_XOR && node_is_not(left)  && left->ops[1]  == right))
-            return node_zero(mod, left->type);
 
-    }
-    if (tag == NODE_OR) {
-        // a | (a & b) <=> a
-        // a | (b & a) <=> a
-        if (right->tag == NODE_AND && (right->ops[0] == left || right->ops[1] == left))
-            return left;
-        // (a & b) | a <=> a
-        // (b & a) | a <=> a
-        if (left->tag == NODE_AND && (left->ops[0] == right || left->ops[1] == right))
-            return right;
-        // a | ~a <=> 1
-        // ~a | a <=> 1
-        if ((right->tag == NODE_XOR && node_is_not(right) && right->ops[1] == left) ||
-            (left->tag  == NODE_XOR && node_is_not(left)  && left->ops[1]  == right))
-            return node_all_ones(mod, left->type);
-    }
-    if (tag == NODE_XOR) {
-        if (right->tag == NODE_XOR) {
-            // a ^ (a ^ b) <=> b
-            if (right->ops[0] == left) return right->ops[1];
-            // a ^ (b ^ a) <=> b
-            if (right->ops[1] == left) return right->ops[0];
-        } else if (left->tag == NODE_XOR) {
-            // (a ^ b) ^ a <=> b
-            if (left->ops[0] == right) return left->ops[1];
-            // (b ^ a) ^ a <=> b
-            if (left->ops[1] == right) return left->ops[0];
-        }
-    }
     // Factorizations
     bool left_factorizable = node_is_distributive(right->tag, tag, left->type);
     if (left_factorizable && right->ops[0]->tag == NODE_LITERAL && right->ops[1] == left) {
@@ -1386,6 +1381,10 @@ const node_t* node_select(mod_t* mod, const node_t* cond, const node_t* if_true,
         return if_true; // Arbitrary, could be if_false
     if (if_true == if_false)
         return if_true;
+    // Conditions that are known even though they are not literals
+    node_facts_t facts = node_facts(mod, cond);
+    if (node_facts_is_const(&facts))
+        return facts.min ? if_true : if_false;
     // select(~a, b, c) => select(a, c, b)
     if (node_is_not(cond)) {
         cond = cond->ops[1];
@@ -1517,33 +1516,41 @@ const node_t* node_rebuild(mod_t* mod, const node_t* node, const node_t** ops, c
     }
 }
 
-void node_replace(const node_t* node, const node_t* with) {
-    assert(node->type == with->type);
-    while (with->rep) with = with->rep;
-    if (with == node)
-        return;
-    do {
+const node_t* node_resolve(const node_t* node) {
+    const node_t* root = node;
+    while (root->rep) root = root->rep;
+    // Compress the path so that the next lookups are direct
+    while (node != root) {
         const node_t* rep = node->rep;
-        ((node_t*)node)->rep = with;
+        ((node_t*)node)->rep = root;
         node = rep;
-    } while(node);
+    }
+    return root;
+}
+
+void node_replace(mod_t* mod, const node_t* node, const node_t* with) {
+    assert(node->type == with->type);
+    mod_lock(mod);
+    scope_cache_invalidate(mod, node);
+    mod_unlock(mod);
+    with = node_resolve(with);
+    node = node_resolve(node);
+    if (with != node)
+        ((node_t*)node)->rep = with;
 }
 
 const use_t* use_find(const use_t* use, size_t index, const node_t* user) {
-    while (use) {
+    for (; use; use = use->next) {
         if ((index == INVALID_INDEX || use->index == index) &&
             (user  == NULL || use->user == user))
             return use;
-        use = use->next;
     }
     return NULL;
 }
 
 size_t use_count(const use_t* use) {
     size_t i = 0;
-    while (use) {
+    for (; use; use = use->next)
         i++;
-        use = use->next;
-    }
     return i;
 }
@@ -47,13 +47,12 @@
 
 typedef union  box_u box_t;
 typedef struct loc_s loc_t;
-typedef struct dbg_s dbg_t;
-typedef struct use_s use_t;
 
 enum node_tag_e {
 #define NODE(name, str) name,
     NODE_LIST(NODE)
 #undef NODE
+    NODE_NTAGS
 };
 
 union box_u {
@@ -83,34 +82,53 @@ struct dbg_s {
     loc_t       loc;
 };
 
+// Every operand slot of a node in a module has its own use, stored after the
+// operands, which links the node into the use list of the operand
 struct use_s {
     size_t index;
     const node_t* user;
-    use_t* next;
+    use_t*  next;
+    use_t** prev;       // Pointer to the link that points to this use
 };
 
+// Iterates over the uses of a node, which may be unlinked from the body
+#define FORALL_USES(node, use, ...) \
+    for (const use_t* use = (node)->uses, *next_use; use && (next_use = use->next, true); use = next_use) { \
+        __VA_ARGS__ \
+    }
+
 enum fn_flags_e {
     FN_EXPORTED = 0x01,  // The function is visible in other modules
     FN_IMPORTED = 0x02,  // The function is from another module
     FN_INTRINSIC = 0x04  // The function is a built-in intrinsic
 };
 
+// Nodes that belong to a module are allocated in one block,
+// with their operands and uses stored right after the header
 struct node_s {
     uint32_t tag;
-    size_t   nops;
+    uint32_t id;        // Unique within the module, assigned on insertion
+    uint32_t nops;
+    uint32_t dsize;
     use_t*   uses;
     union {
         box_t box;
         uint32_t fn_flags;
         const type_t* map;
     } data;
-    size_t dsize;
     const node_t*  rep;
     const node_t** ops;
     const type_t*  type;
     const dbg_t*   dbg;
 };
 
+static inline uint32_t node_id(const node_t* node) {
+    return node->id;
+}
+
+BITSET(node_bitset, const node_t*, node_id)
+SPARSE_SET(node_sset, const node_t*, node_id)
+
 uint64_t node_value_u(const node_t*);
 int64_t  node_value_i(const node_t*);
 double   node_value_f(const node_t*);
@@ -136,10 +154,15 @@ const node_t* node_u64(mod_t*, uint64_t);
 const node_t* node_f32(mod_t*, float, uint32_t);
 const node_t* node_f64(mod_t*, double, uint32_t);
 const node_t* node_literal(mod_t*, const type_t*, box_t);
+// Integer or boolean literal, truncated to the width of the type
+const node_t* node_int_literal(mod_t*, const type_t*, uint64_t);
 
 bool node_is_unit(const node_t*);
 bool node_is_not(const node_t*);
 bool node_is_cmp(const node_t*);
+// Puts the operands of a commutative operation or comparison that is not in
+// the module back in the standard order, after they have been renumbered
+void node_order_ops(node_t*);
 bool node_implies(mod_t*, const node_t*, const node_t*, bool, bool);
 const node_t* node_unit(mod_t*);
 const node_t* node_tuple(mod_t*, size_t, const node_t**, const dbg_t*);
@@ -192,11 +215,35 @@ const node_t* node_tapp(mod_t*, const node_t*, const type_t*, const type_t*, con
 
 const node_t* node_rebuild(mod_t*, const node_t*, const node_t**, const type_t*);
 const node_t* node_rewrite(mod_t*, const node_t*, node2node_t*, type2type_t*, uint32_t);
-void node_replace(const node_t*, const node_t*);
+void node_replace(mod_t*, const node_t*, const node_t*);
+// Returns the node that replaces the given node, or the node itself
+const node_t* node_resolve(const node_t*);
 
 const use_t* use_find(const use_t*, size_t, const node_t*);
 size_t use_count(const use_t*);
 
 void node_dump(const node_t*);
 
+// Summary of the contents of a module, see mod_stats()
+struct mod_stats_s {
+    size_t nnodes;          // Including functions
+    size_t ntypes;
+    size_t nfns;
+    size_t nodes_per_tag[NODE_NTAGS];
+    size_t types_per_tag[TYPE_NTAGS];
+    size_t nuses;           // Use records linked into use lists
+    size_t nusers;          // Nodes with at least one operand
+    size_t nused;           // Nodes with at least one use
+    size_t max_fan_in;
+    size_t max_fan_out;
+    // Hash-consing lookups, and those that found an existing node or type
+    size_t nnode_lookups;
+    size_t nnode_hits;
+    size_t ntype_lookups;
+    size_t ntype_hits;
+    mpool_stats_t pool;
+};
+
+mod_stats_t mod_stats(const mod_t*);
+
 #endif // NODE_H
@@ -0,0 +1,127 @@
+#include <pthread.h>
+
+#include "pass.h"
+#include "adt.h"
+#include "util.h"
+
+HMAP_DEFAULT(fn2index, const node_t*, size_t)
+
+typedef struct pass_job_s pass_job_t;
+
+struct pass_job_s {
+    mod_t*    mod;
+    fn_pass_t pass;
+    void*     data;
+    const node_t** fns;     // Functions of the module, sorted by group
+    size_t*   groups;       // Index of the first function of each group in fns
+    size_t    ngroups;
+    pthread_mutex_t lock;
+    size_t    next_group;
+};
+
+static inline size_t find_group(size_t* parents, size_t i) {
+    while (parents[i] != i) {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
+
+static void partition_fns(pass_job_t* job) {
+    mod_t* mod = job->mod;
+    size_t nfns = mod->fns.nelems;
+    size_t* parents = xmalloc(sizeof(size_t) * nfns);
+    fn2index_t fn2index = fn2index_create();
+    for (size_t k = 0; k < nfns; ++k) {
+        parents[k] = k;
+        fn2index_insert(&fn2index, mod->fns.elems[k], k);
+    }
+
+    // Functions that appear in the scope of another one belong to its group
+    for (size_t k = 0; k < nfns; ++k) {
+        const scope_t* scope = scope_get(mod, mod->fns.elems[k]);
+        FORALL_HSET(scope->nodes, const node_t*, node, {
+            if (node->tag == NODE_FN && node != scope->entry) {
+                size_t a = find_group(parents, k);
+                size_t b = find_group(parents, *fn2index_lookup(&fn2index, node));
+                // The first function of a group is its representative
+                if (a < b) parents[b] = a;
+                else       parents[a] = b;
+            }
+        })
+    }
+    fn2index_destroy(&fn2index);
+
+    // Sort the functions by group, keeping the order of the module within groups
+    size_t* offsets = xcalloc(nfns + 1, sizeof(size_t));
+    for (size_t k = 0; k < nfns; ++k)
+        offsets[find_group(parents, k) + 1]++;
+    job->ngroups = 0;
+    job->groups  = xmalloc(sizeof(size_t) * (nfns + 1));
+    for (size_t k = 0; k < nfns; ++k) {
+        if (offsets[k + 1] > 0)
+            job->groups[job->ngroups++] = offsets[k];
+        offsets[k + 1] += offsets[k];
+    }
+    job->groups[job->ngroups] = nfns;
+    job->fns = xmalloc(sizeof(const node_t*) * (nfns > 0 ? nfns : 1));
+    for (size_t k = 0; k < nfns; ++k)
+        job->fns[offsets[find_group(parents, k)]++] = mod->fns.elems[k];
+    free(offsets);
+    free(parents);
+}
+
+static void* run_groups(void* ptr) {
+    pass_job_t* job = ptr;
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        size_t group = job->next_group++;
+        pthread_mutex_unlock(&job->lock);
+        if (group >= job->ngroups)
+            break;
+        for (size_t k = job->groups[group]; k < job->groups[group + 1]; ++k) {
+            // Scopes that the partition computed are reused unless a previous pass changed them
+            job->pass(job->mod, scope_get(job->mod, job->fns[k]), job->data);
+        }
+    }
+    return NULL;
+}
+
+void pass_run_on_fns(mod_t* mod, fn_pass_t pass, void* data, size_t nthreads) {
+    pass_job_t job = {
+        .mod  = mod,
+        .pass = pass,
+        .data = data,
+        .next_group = 0
+    };
+    pthread_mutex_init(&job.lock, NULL);
+    partition_fns(&job);
+
+    // The module is in concurrent mode even with only one thread, so that
+    // debug information is attached to nodes in the same way in both cases
+    uint32_t nnode_ids = mod->nnode_ids;
+    uint32_t ntype_ids = mod->ntype_ids;
+    size_t nfns = mod->fns.nelems;
+    mod_begin_concurrent(mod);
+    if (nthreads > job.ngroups)
+        nthreads = job.ngroups;
+    if (nthreads <= 1) {
+        run_groups(&job);
+    } else {
+        pthread_t* threads = xmalloc(sizeof(pthread_t) * nthreads);
+        for (size_t k = 0; k < nthreads; ++k)
+            pthread_create(&threads[k], NULL, run_groups, &job);
+        for (size_t k = 0; k < nthreads; ++k)
+            pthread_join(threads[k], NULL);
+        free(threads);
+    }
+    mod_end_concurrent(mod);
+    assert(mod->fns.nelems == nfns), (void)nfns;
+
+    // Nodes are created in an order that depends on the scheduling of the threads
+    mod_canonicalize(mod, nnode_ids, ntype_ids);
+
+    pthread_mutex_destroy(&job.lock);
+    free(job.groups);
+    free(job.fns);
+}
@@ -0,0 +1,17 @@
+#ifndef PASS_H
+#define PASS_H
+
+#include "scope.h"
+
+// A function pass rewrites one function, given its scope. It may create nodes
+// and types, and bind the operands of the functions in that scope, but it may
+// not create functions, nor look at the uses of nodes outside of the scope.
+typedef void (*fn_pass_t)(mod_t*, const scope_t*, void*);
+
+// Runs a function pass on every function of the module. Functions whose scopes
+// are nested form a group that is processed by one thread, in module order,
+// and separate groups are processed in parallel by the given number of threads.
+// The resulting module does not depend on the number of threads.
+void pass_run_on_fns(mod_t*, fn_pass_t, void*, size_t);
+
+#endif // PASS_H
@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+// Generates a matcher for the simplification rules of binary operations and
+// comparisons. Each line of the rule file has the following form:
+//
+//     pattern -> replacement [when condition]
+//
+// Patterns are nested operations whose operands are either variables, which
+// must be equal when they appear several times, or the literals 0, 1 and -1.
+// Replacements are variables, the literals 0, 1, -1, true and false, or calls
+// to node constructors. Conditions are C expressions over the variables.
+// The matcher dispatches on the tag of the operation, then on the tags of its
+// operands, and only tests the remaining conditions of the rules that are left.
+
+#define MAX_RULES 256
+#define MAX_VARS  8
+#define MAX_OPS   3
+
+typedef struct pat_s  pat_t;
+typedef struct rule_s rule_t;
+
+enum pat_tag_e {
+    PAT_VAR,
+    PAT_LIT,
+    PAT_OP
+};
+
+struct pat_s {
+    int tag;
+    char name[32];      // Variable name, literal or operation
+    size_t nops;
+    pat_t* ops[MAX_OPS];
+};
+
+struct rule_s {
+    const char* text;
+    pat_t* pattern;
+    pat_t* replacement;
+    const char* cond;
+    size_t line;
+};
+
+static rule_t rules[MAX_RULES];
+static size_t nrules = 0;
+static const char* cur = NULL;
+static size_t cur_line = 0;
+
+static void error(const char* msg) {
+    fprintf(stderr, "error in rule file (line %zu): %s\n", cur_line, msg);
+    exit(1);
+}
+
+static void skip_spaces(void) {
+    while (*cur == ' ' || *cur == '\t') cur++;
+}
+
+static bool accept(const char* str) {
+    skip_spaces();
+    size_t len = strlen(str);
+    if (strncmp(cur, str, len))
+        return false;
+    cur += len;
+    return true;
+}
+
+static void expect(const char* str) {
+    if (!accept(str))
+        error("unexpected character");
+}
+
+static pat_t* parse_pat(void) {
+    skip_spaces();
+    pat_t* pat = calloc(1, sizeof(pat_t));
+    size_t len = 0;
+    if (*cur == '-' || isdigit((unsigned char)*cur)) {
+        pat->tag = PAT_LIT;
+        pat->name[len++] = *(cur++);
+        while (isdigit((unsigned char)*cur) && len < sizeof(pat->name) - 1)
+            pat->name[len++] = *(cur++);
+        if (strcmp(pat->name, "0") && strcmp(pat->name, "1") && strcmp(pat->name, "-1"))
+            error("only 0, 1 and -1 are supported as literals");
+        return pat;
+    }
+    if (!isalpha((unsigned char)*cur))
+        error("expected variable, literal, or operation");
+    while ((isalnum((unsigned char)*cur) || *cur == '_') && len < sizeof(pat->name) - 1)
+        pat->name[len++] = *(cur++);
+    if (!strcmp(pat->name, "true") || !strcmp(pat->name, "false")) {
+        pat->tag = PAT_LIT;
+        return pat;
+    }
+    if (!accept("(")) {
+        pat->tag = PAT_VAR;
+        return pat;
+    }
+    pat->tag = PAT_OP;
+    do {
+        if (pat->nops == MAX_OPS)
+            error("too many operands");
+        pat->ops[pat->nops++] = parse_pat();
+    } while (accept(","));
+    expect(")");
+    return pat;
+}
+
+static void parse_rule(char* line) {
+    // Remove comments and trailing spaces
+    char* comment = strstr(line, "//");
+    if (comment) *comment = 0;
+    size_t len = strlen(line);
+    while (len > 0 && isspace((unsigned char)line[len - 1])) line[--len] = 0;
+    cur = line;
+    skip_spaces();
+    if (!*cur)
+        return;
+
+    if (nrules == MAX_RULES)
+        error("too many rules");
+    rule_t* rule = &rules[nrules++];
+    rule->text = strdup(cur);
+    rule->line = cur_line;
+    rule->pattern = parse_pat();
+    if (rule->pattern->tag != PAT_OP || rule->pattern->nops != 2)
+        error("patterns must be binary operations");
+    expect("->");
+    rule->replacement = parse_pat();
+    if (accept("when")) {
+        skip_spaces();
+        rule->cond = strdup(cur);
+    } else if (*cur) {
+        error("expected 'when' or end of line");
+    }
+}
+
+static void print_tag(const char* name) {
+    printf("NODE_");
+    for (const char* ptr = name; *ptr; ++ptr)
+        putchar(toupper((unsigned char)*ptr));
+}
+
+// Tag of an operand, as seen by the dispatch, or NULL if the operand can have any tag
+static const char* dispatch_tag(const pat_t* pat) {
+    switch (pat->tag) {
+        case PAT_OP:  return pat->name;
+        case PAT_LIT: return "literal";
+        default:      return NULL;
+    }
+}
+
+static bool is_compatible(const rule_t* rule, size_t index, const char* tag) {
+    const char* op_tag = dispatch_tag(rule->pattern->ops[index]);
+    return !op_tag || (tag && !strcmp(op_tag, tag));
+}
+
+typedef struct {
+    const char* names[MAX_VARS];
+    char paths[MAX_VARS][64];
+    size_t nvars;
+} vars_t;
+
+static const char* find_var(const vars_t* vars, const char* name) {
+    for (size_t i = 0; i < vars->nvars; ++i) {
+        if (!strcmp(vars->names[i], name))
+            return vars->paths[i];
+    }
+    return NULL;
+}
+
+static void print_conds(const pat_t* pat, const char* path, int depth, vars_t* vars, bool* first) {
+    const char* sep = *first ? "" : " && ";
+    switch (pat->tag) {
+        case PAT_VAR:
+            {
+                const char* other = find_var(vars, pat->name);
+                if (other) {
+                    printf("%s%s == %s", sep, path, other);
+                    *first = false;
+                } else {
+                    if (vars->nvars == MAX_VARS)
+                        error("too many variables");
+                    vars->names[vars->nvars] = pat->name;
+                    snprintf(vars->paths[vars->nvars++], 64, "%s", path);
+                }
+            }
+            break;
+        case PAT_LIT:
+            if (!strcmp(pat->name, "0"))       printf("%snode_is_zero(%s)", sep, path);
+            else if (!strcmp(pat->name, "1"))  printf("%snode_is_one(%s)", sep, path);
+            else if (!strcmp(pat->name, "-1")) printf("%snode_is_all_ones(%s)", sep, path);
+            else error("boolean literals are not supported in patterns");
+            *first = false;
+            break;
+        case PAT_OP:
+            // The tags of the operands of the root are already known from the dispatch
+            if (depth > 1) {
+                printf("%s%s->tag == ", sep, path);
+                print_tag(pat->name);
+                *first = false;
+            }
+            for (size_t i = 0; i < pat->nops; ++i) {
+                char op_path[64];
+                if (depth == 0)
+                    snprintf(op_path, 64, "%s", i == 0 ? "left" : "right");
+                else
+                    snprintf(op_path, 64, "%s->ops[%zu]", path, i);
+                print_conds(pat->ops[i], op_path, depth + 1, vars, first);
+            }
+            break;
+    }
+}
+
+static bool uses_var(const pat_t* pat, const char* cond, const char* name) {
+    if (pat->tag == PAT_VAR && !strcmp(pat->name, name))
+        return true;
+    for (size_t i = 0; pat->tag == PAT_OP && i < pat->nops; ++i) {
+        if (uses_var(pat->ops[i], NULL, name))
+            return true;
+    }
+    // Look for the variable as an identifier in the condition
+    size_t len = strlen(name);
+    for (const char* ptr = cond; ptr && (ptr = strstr(ptr, name)); ptr += len) {
+        bool before = ptr > cond && (isalnum((unsigned char)ptr[-1]) || ptr[-1] == '_' || ptr[-1] == '>' || ptr[-1] == '.');
+        bool after  = isalnum((unsigned char)ptr[len]) || ptr[len] == '_';
+        if (!before && !after)
+            return true;
+    }
+    return false;
+}
+
+static void print_replacement(const pat_t* pat, const vars_t* vars) {
+    switch (pat->tag) {
+        case PAT_VAR:
+            if (!find_var(vars, pat->name))
+                error("unbound variable in replacement");
+            printf("%s", pat->name);
+            break;
+        case PAT_LIT:
+            if (!strcmp(pat->name, "0"))          printf("node_zero(mod, left->type)");
+            else if (!strcmp(pat->name, "1"))     printf("node_one(mod, left->type)");
+            else if (!strcmp(pat->name, "-1"))    printf("node_all_ones(mod, left->type)");
+            else printf("node_bool(mod, %s)", pat->name);
+            break;
+        case PAT_OP:
+            printf("node_%s(mod, ", pat->name);
+            for (size_t i = 0; i < pat->nops; ++i) {
+                print_replacement(pat->ops[i], vars);
+                printf(", ");
+            }
+            printf("dbg)");
+            break;
+    }
+}
+
+static void generate_rule(const rule_t* rule, int indent) {
+    vars_t vars = { .nvars = 0 };
+    bool first = true;
+    cur_line = rule->line;
+    printf("%*s// %s\n", indent * 4, "", rule->text);
+    printf("%*sif (", indent * 4, "");
+    print_conds(rule->pattern, NULL, 0, &vars, &first);
+    printf("%s) {\n", first ? "true" : "");
+    for (size_t i = 0; i < vars.nvars; ++i) {
+        if (uses_var(rule->replacement, rule->cond, vars.names[i]))
+            printf("%*sconst node_t* %s = %s;\n", (indent + 1) * 4, "", vars.names[i], vars.paths[i]);
+    }
+    printf("%*s", (indent + 1) * 4, "");
+    if (rule->cond)
+        printf("if (%s) ", rule->cond);
+    printf("return ");
+    print_replacement(rule->replacement, &vars);
+    printf(";\n%*s}\n", indent * 4, "");
+}
+
+// Generates a switch on the tag of the given operand for the given rules,
+// which are tried in order in every case
+static void generate_dispatch(const rule_t** subset, size_t nsubset, size_t index, int indent) {
+    if (index == 2) {
+        for (size_t i = 0; i < nsubset; ++i)
+            generate_rule(subset[i], indent);
+        return;
+    }
+
+    const char* tags[MAX_RULES];
+    size_t ntags = 0;
+    for (size_t i = 0; i < nsubset; ++i) {
+        const char* tag = dispatch_tag(subset[i]->pattern->ops[index]);
+        bool found = !tag;
+        for (size_t j = 0; j < ntags && !found; ++j)
+            found = !strcmp(tags[j], tag);
+        if (!found)
+            tags[ntags++] = tag;
+    }
+    if (ntags == 0) {
+        generate_dispatch(subset, nsubset, index + 1, indent);
+        return;
+    }
+
+    const rule_t* cases[MAX_RULES];
+    printf("%*sswitch (%s->tag) {\n", indent * 4, "", index == 0 ? "left" : "right");
+    for (size_t i = 0; i <= ntags; ++i) {
+        const char* tag = i < ntags ? tags[i] : NULL;
+        size_t ncases = 0;
+        for (size_t j = 0; j < nsubset; ++j) {
+            if (is_compatible(subset[j], index, tag))
+                cases[ncases++] = subset[j];
+        }
+        if (tag) {
+            printf("%*scase ", (indent + 1) * 4, "");
+            print_tag(tag);
+            printf(":\n");
+        } else {
+            printf("%*sdefault:\n", (indent + 1) * 4, "");
+        }
+        generate_dispatch(cases, ncases, index + 1, indent + 2);
+        printf("%*sbreak;\n", (indent + 2) * 4, "");
+    }
+    printf("%*s}\n", indent * 4, "");
+}
+
+static void generate(void) {
+    const char* tags[MAX_RULES];
+    size_t ntags = 0;
+    for (size_t i = 0; i < nrules; ++i) {
+        bool found = false;
+        for (size_t j = 0; j < ntags && !found; ++j)
+            found = !strcmp(tags[j], rules[i].pattern->name);
+        if (!found)
+            tags[ntags++] = rules[i].pattern->name;
+    }
+
+    printf("static inline const node_t* apply_rules(mod_t* mod, uint32_t tag, const node_t* left, const node_t* right, const dbg_t* dbg) {\n");
+    printf("    switch (tag) {\n");
+    const rule_t* subset[MAX_RULES];
+    for (size_t i = 0; i < ntags; ++i) {
+        size_t nsubset = 0;
+        for (size_t j = 0; j < nrules; ++j) {
+            if (!strcmp(rules[j].pattern->name, tags[i]))
+                subset[nsubset++] = &rules[j];
+        }
+        printf("        case ");
+        print_tag(tags[i]);
+        printf(":\n");
+        generate_dispatch(subset, nsubset, 0, 3);
+        printf("            break;\n");
+    }
+    printf("        default:\n");
+    printf("            break;\n");
+    printf("    }\n");
+    printf("    return NULL;\n");
+    printf("}\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: peephole_gen file.rules\n");
+        return 1;
+    }
+    FILE* fp = fopen(argv[1], "r");
+    if (!fp) {
+        fprintf(stderr, "cannot open '%s'\n", argv[1]);
+        return 1;
+    }
+    char buf[1024];
+    while (fgets(buf, sizeof(buf), fp)) {
+        cur_line++;
+        parse_rule(buf);
+    }
+    fclose(fp);
+
+    printf("// Generated by peephole_gen from %s, do not edit\n", argv[1]);
+    generate();
+    return 0;
+}
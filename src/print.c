@@ -485,6 +485,20 @@ static size_t format(char* buf, size_t buf_len, const char* fmt, const fmt_arg_t
                         }
                         ptr++;
                         break;
+                    case 'f':
+                        ptr++;
+                        switch (*ptr) {
+                            case '3':
+                                ptr++; assert(*ptr == '2');
+                                n = snprintf(buf + len, buf_len - len, "%g", args[id].f32);
+                                break;
+                            case '6':
+                                ptr++; assert(*ptr == '4');
+                                n = snprintf(buf + len, buf_len - len, "%g", args[id].f64);
+                                break;
+                        }
+                        ptr++;
+                        break;
                     case 'p':
                         n = snprintf(buf + len, buf_len - len, "%"PRIxPTR, (intptr_t)args[id].p); ptr++;
                         break;
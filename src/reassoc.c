@@ -0,0 +1,206 @@
+#include <stdlib.h>
+
+#include "reassoc.h"
+#include "node.h"
+#include "type.h"
+#include "util.h"
+
+// Rewritten node, along with its rank, which is the length of the longest
+// path from the node to a value that does not depend on any operation
+typedef struct {
+    const node_t* node;
+    size_t rank;
+    uint32_t id;    // Identifier of the original node, which unlike those of
+                    // new nodes does not depend on the scheduling of threads
+} ranked_t;
+
+HMAP_DEFAULT(node2ranked, const node_t*, ranked_t)
+VEC(ranked_vec, ranked_t)
+
+static inline bool is_associative(const node_t* node) {
+    if (node->tag != NODE_ADD && node->tag != NODE_MUL)
+        return false;
+    return !type_is_f(node->type) || (node->type->data.fp_flags & FP_ASSOCIATIVE_MATH);
+}
+
+static inline bool is_rewritable(const scope_t* scope, const node_t* node) {
+    return node->nops > 0 && node->tag != NODE_FN && node->tag != NODE_TAPP &&
+           node_set_lookup(&scope->nodes, node);
+}
+
+// Nodes inside a chain have the same operation and type as its root, and no
+// other use, so that flattening them does not duplicate any computation
+static inline bool is_inside_chain(const scope_t* scope, const node_t* root, const node_t* node) {
+    return node->tag == root->tag && node->type == root->type &&
+           node_set_lookup(&scope->nodes, node) && use_count(node->uses) == 1;
+}
+
+// Collects the operands of the chain of operations that starts at the given node
+static void collect_leaves(const scope_t* scope, const node_t* root, node_vec_t* leaves, node_vec_t* stack) {
+    node_vec_clear(leaves);
+    node_vec_push(stack, root);
+    while (stack->nelems > 0) {
+        const node_t* node = node_vec_pop(stack);
+        for (size_t i = 0; i < node->nops; ++i) {
+            if (is_inside_chain(scope, root, node->ops[i]))
+                node_vec_push(stack, node->ops[i]);
+            else
+                node_vec_push(leaves, node->ops[i]);
+        }
+    }
+}
+
+static int compare_ranked(const void* ptr1, const void* ptr2) {
+    const ranked_t* left  = ptr1;
+    const ranked_t* right = ptr2;
+    if (left->rank != right->rank)
+        return left->rank < right->rank ? -1 : 1;
+    if (left->id != right->id)
+        return left->id < right->id ? -1 : 1;
+    return 0;
+}
+
+static inline const node_t* make_op(mod_t* mod, uint32_t tag, const node_t* left, const node_t* right, const dbg_t* dbg) {
+    return tag == NODE_ADD ? node_add(mod, left, right, dbg) : node_mul(mod, left, right, dbg);
+}
+
+// Rebuilds a chain from its rewritten operands, and returns its rank
+static ranked_t rebuild_chain(mod_t* mod, const node_t* root, ranked_vec_t* ops) {
+    // Constants are folded together, and applied last
+    const node_t* constant = NULL;
+    size_t nops = 0;
+    for (size_t i = 0; i < ops->nelems; ++i) {
+        ranked_t op = ops->elems[i];
+        if (op.node->tag == NODE_LITERAL)
+            constant = constant ? make_op(mod, root->tag, constant, op.node, root->dbg) : op.node;
+        else
+            ops->elems[nops++] = op;
+    }
+    ops->nelems = nops;
+    qsort(ops->elems, nops, sizeof(ranked_t), compare_ranked);
+
+    // Pairs of neighbours are combined level by level, which keeps the tree balanced
+    while (nops > 1) {
+        size_t n = 0;
+        for (size_t i = 0; i + 1 < nops; i += 2) {
+            const ranked_t* left  = &ops->elems[i];
+            const ranked_t* right = &ops->elems[i + 1];
+            ops->elems[n++] = (ranked_t) {
+                .node = make_op(mod, root->tag, left->node, right->node, root->dbg),
+                .rank = (left->rank > right->rank ? left->rank : right->rank) + 1
+            };
+        }
+        if (nops % 2 != 0)
+            ops->elems[n++] = ops->elems[nops - 1];
+        nops = n;
+    }
+    if (nops == 0)
+        return (ranked_t) { .node = constant, .rank = 0 };
+    ranked_t res = ops->elems[0];
+    if (constant) {
+        res.node = make_op(mod, root->tag, constant, res.node, root->dbg);
+        res.rank++;
+    }
+    return res;
+}
+
+typedef struct {
+    mod_t* mod;
+    const scope_t* scope;
+    node2ranked_t new_nodes;
+    node_vec_t stack;
+    node_vec_t leaves;
+    node_vec_t chain;
+    ranked_vec_t ops;
+} reassoc_t;
+
+// Rewrites a node whose dependencies have all been rewritten
+static ranked_t rewrite_node(reassoc_t* reassoc, const node_t* node, size_t ndeps, const node_t** deps) {
+    reassoc->ops.nelems = 0;
+    bool changed = false;
+    for (size_t i = 0; i < ndeps; ++i) {
+        ranked_t op = *node2ranked_lookup(&reassoc->new_nodes, deps[i]);
+        op.id = deps[i]->id;
+        changed |= op.node != deps[i];
+        ranked_vec_push(&reassoc->ops, op);
+    }
+    if (is_associative(node))
+        return rebuild_chain(reassoc->mod, node, &reassoc->ops);
+
+    size_t rank = 0;
+    FORALL_VEC(reassoc->ops, ranked_t, op, {
+        rank = op.rank > rank ? op.rank : rank;
+    })
+    if (!changed)
+        return (ranked_t) { .node = node, .rank = rank + 1 };
+    TMP_BUF_ALLOC(ops, const node_t*, node->nops)
+    for (size_t i = 0; i < node->nops; ++i)
+        ops[i] = reassoc->ops.elems[i].node;
+    const node_t* new_node = node_rebuild(reassoc->mod, node, ops, node->type);
+    TMP_BUF_FREE(ops)
+    return (ranked_t) { .node = new_node, .rank = rank + 1 };
+}
+
+static const node_t* rewrite(reassoc_t* reassoc, const node_t* root) {
+    node_vec_t* stack = &reassoc->stack;
+    node_vec_push(stack, root);
+    // Post order walk, where the dependencies of a chain are its operands
+    while (stack->nelems > 0) {
+        const node_t* node = stack->elems[stack->nelems - 1];
+        if (node2ranked_lookup(&reassoc->new_nodes, node)) {
+            node_vec_pop(stack);
+            continue;
+        }
+        if (!is_rewritable(reassoc->scope, node)) {
+            node2ranked_insert(&reassoc->new_nodes, node, (ranked_t) { .node = node, .rank = 0 });
+            node_vec_pop(stack);
+            continue;
+        }
+        size_t ndeps = node->nops;
+        const node_t** deps = node->ops;
+        if (is_associative(node)) {
+            collect_leaves(reassoc->scope, node, &reassoc->leaves, &reassoc->chain);
+            ndeps = reassoc->leaves.nelems;
+            deps  = reassoc->leaves.elems;
+        }
+        bool ready = true;
+        for (size_t i = 0; i < ndeps; ++i) {
+            if (!node2ranked_lookup(&reassoc->new_nodes, deps[i])) {
+                node_vec_push(stack, deps[i]);
+                ready = false;
+            }
+        }
+        if (!ready)
+            continue;
+        node2ranked_insert(&reassoc->new_nodes, node, rewrite_node(reassoc, node, ndeps, deps));
+        node_vec_pop(stack);
+    }
+    return node2ranked_lookup(&reassoc->new_nodes, root)->node;
+}
+
+void reassociate(mod_t* mod, const scope_t* scope, void* data) {
+    (void)data;
+    reassoc_t reassoc = {
+        .mod       = mod,
+        .scope     = scope,
+        .new_nodes = node2ranked_create(),
+        .stack     = node_vec_create(),
+        .leaves    = node_vec_create(),
+        .chain     = node_vec_create(),
+        .ops       = ranked_vec_create()
+    };
+    const node_t* entry = scope->entry;
+    for (size_t i = 0; i < entry->nops; ++i) {
+        const node_t* op = entry->ops[i];
+        if (!op)
+            continue;
+        const node_t* new_op = rewrite(&reassoc, op);
+        if (new_op != op)
+            node_bind(mod, entry, i, new_op);
+    }
+    node2ranked_destroy(&reassoc.new_nodes);
+    node_vec_destroy(&reassoc.stack);
+    node_vec_destroy(&reassoc.leaves);
+    node_vec_destroy(&reassoc.chain);
+    ranked_vec_destroy(&reassoc.ops);
+}
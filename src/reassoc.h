@@ -0,0 +1,13 @@
+#ifndef REASSOC_H
+#define REASSOC_H
+
+#include "scope.h"
+
+// Function pass (see pass.h) that flattens the chains of additions and
+// multiplications in the body of a function, folds their constants together,
+// and rebuilds them as balanced trees with the operands in a canonical order.
+// Floating point chains are only rewritten when their type allows associative
+// math. Operations that have other uses are kept, and become operands.
+void reassociate(mod_t*, const scope_t*, void*);
+
+#endif // REASSOC_H
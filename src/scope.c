@@ -1,47 +1,276 @@
+#include <assert.h>
+#include <stdlib.h>
+
 #include "node.h"
 #include "scope.h"
+#include "cfg.h"
+#include "util.h"
 
 void scope_compute(mod_t* mod, scope_t* scope) {
-    node_vec_t worklist = node_vec_create();
+    node_small_vec_t worklist = node_small_vec_create();
     node_set_insert(&scope->nodes, scope->entry);
-    node_vec_push(&worklist, node_param(mod, scope->entry, NULL));
+    node_small_vec_push(&worklist, node_param(mod, scope->entry, NULL));
     // Transitively add the uses of the parameter of the entry function to the scope
     while (worklist.nelems > 0) {
-        const node_t* node = node_vec_pop(&worklist);
+        const node_t* node = node_small_vec_pop(&worklist);
         if (node_set_insert(&scope->nodes, node)) {
-            const use_t* use = node->uses;
-            while (use) {
-                node_vec_push(&worklist, use->user);
-                use = use->next;
-            }
+            FORALL_USES(node, use, {
+                node_small_vec_push(&worklist, use->user);
+            })
             if (node->tag == NODE_FN)
-                node_vec_push(&worklist, node_param(mod, node, NULL));
+                node_small_vec_push(&worklist, node_param(mod, node, NULL));
         }
     }
-    node_vec_destroy(&worklist);
+    node_small_vec_destroy(&worklist);
 }
 
 void scope_compute_fvs(const scope_t* scope, node_set_t* fvs) {
-    node_set_t done = node_set_create();
-    node_vec_t worklist = node_vec_create();
+    node_bitset_t done = node_bitset_create();
+    node_small_vec_t worklist = node_small_vec_create();
     // Look through all the expressions contained in the entry
     // function and extract those that are not in the scope
     const node_t* entry = scope->entry;
     for (size_t i = 0; i < entry->nops; ++i)
-        node_vec_push(&worklist, entry->ops[i]);
+        node_small_vec_push(&worklist, entry->ops[i]);
     while (worklist.nelems > 0) {
-        const node_t* node = node_vec_pop(&worklist);
+        const node_t* node = node_small_vec_pop(&worklist);
         if (node->tag == NODE_PARAM || node->tag == NODE_FN) {
             if (!node_set_lookup(&scope->nodes, node))
                 node_set_insert(fvs, node);
         } else {
             for (size_t i = 0; i < node->nops; ++i) {
                 const node_t* op = node->ops[i];
-                if (!node_set_lookup(&done, op))
-                    node_vec_push(&worklist, op);
+                if (node_bitset_insert(&done, op))
+                    node_small_vec_push(&worklist, op);
             }
         }
     }
-    node_set_destroy(&done);
-    node_vec_destroy(&worklist);
+    node_bitset_destroy(&done);
+    node_small_vec_destroy(&worklist);
+}
+
+// Number of members that are left behind before the lists are rebuilt, on top
+// of the number of members that still count
+#define SCOPE_CACHE_MIN_STALE 1024
+
+scope_cache_t* scope_cache_create(void) {
+    scope_cache_t* cache = xmalloc(sizeof(scope_cache_t));
+    cache->scopes   = fn2scope_create();
+    cache->members  = scope_member_vec_create();
+    cache->heads    = scope_head_vec_create();
+    cache->nlive    = 0;
+    cache->nchecks  = 0;
+    cache->stamp    = 0;
+    cache->first_id = UINT32_MAX;
+    cache->last_id  = 0;
+    cache->visited  = node_sset_create();
+    cache->stack    = node_vec_create();
+    cache->reached  = node_vec_create();
+    return cache;
+}
+
+static inline void free_cached_scope(cached_scope_t* cached) {
+    node_set_destroy(&cached->scope.nodes);
+    node_set_destroy(&cached->fvs);
+    if (cached->cfg)
+        cfg_destroy(cached->cfg);
+    free(cached);
+}
+
+void scope_cache_destroy(scope_cache_t* cache) {
+    FORALL_HMAP(cache->scopes, const node_t*, fn, cached_scope_t*, cached, {
+        (void)fn;
+        free_cached_scope(cached);
+    })
+    fn2scope_destroy(&cache->scopes);
+    scope_member_vec_destroy(&cache->members);
+    scope_head_vec_destroy(&cache->heads);
+    node_sset_destroy(&cache->visited);
+    node_vec_destroy(&cache->stack);
+    node_vec_destroy(&cache->reached);
+    free(cache);
+}
+
+static inline bool is_live_member(const scope_member_t* member) {
+    return member->scope->valid && member->scope->stamp == member->stamp;
+}
+
+static inline uint32_t first_member(const scope_cache_t* cache, const node_t* node) {
+    return node->id < cache->heads.nelems ? cache->heads.elems[node->id] : UINT32_MAX;
+}
+
+// Marks a scope as valid, and adds it to the lists of the nodes that it contains
+static void add_members(scope_cache_t* cache, cached_scope_t* cached) {
+    if (cache->nlive == 0 || cached->nnode_ids < cache->first_id)
+        cache->first_id = cached->nnode_ids;
+    cached->stamp = cache->stamp++;
+    cached->valid = true;
+    FORALL_HSET(cached->scope.nodes, const node_t*, node, {
+        size_t nheads = cache->heads.nelems;
+        if (node->id >= nheads) {
+            scope_head_vec_resize(&cache->heads, node->id + 1);
+            for (size_t j = nheads; j <= node->id; ++j)
+                cache->heads.elems[j] = UINT32_MAX;
+        }
+        scope_member_vec_push(&cache->members, (scope_member_t) {
+            .scope = cached,
+            .stamp = cached->stamp,
+            .next  = cache->heads.elems[node->id]
+        });
+        cache->heads.elems[node->id] = cache->members.nelems - 1;
+    })
+    cache->nlive += cached->scope.nodes.table->nelems;
+}
+
+// Removes the members that no longer count from the lists
+static void rebuild_members(scope_cache_t* cache) {
+    scope_member_vec_clear(&cache->members);
+    scope_head_vec_clear(&cache->heads);
+    cache->nlive   = 0;
+    cache->last_id = 0;
+    FORALL_HMAP(cache->scopes, const node_t*, fn, cached_scope_t*, cached, {
+        (void)fn;
+        if (cached->nnode_ids > cache->last_id)
+            cache->last_id = cached->nnode_ids;
+        if (cached->valid)
+            add_members(cache, cached);
+    })
+}
+
+static inline void invalidate_scope(scope_cache_t* cache, cached_scope_t* cached) {
+    cached->valid = false;
+    cache->nlive -= cached->scope.nodes.table->nelems;
+}
+
+// Invalidates the scopes that contain the given node
+static inline void invalidate_members(scope_cache_t* cache, const node_t* node) {
+    for (uint32_t j = first_member(cache, node); j != UINT32_MAX; j = cache->members.elems[j].next) {
+        const scope_member_t* member = &cache->members.elems[j];
+        if (is_live_member(member))
+            invalidate_scope(cache, member->scope);
+        cache->nchecks++;
+    }
+}
+
+const scope_t* scope_get(mod_t* mod, const node_t* fn) {
+    assert(fn->tag == NODE_FN);
+    scope_cache_t* cache = mod->scope_cache;
+    // The cache is shared between threads in concurrent mode
+    mod_lock(mod);
+    const cached_scope_t** found = fn2scope_lookup(&cache->scopes, fn);
+    cached_scope_t* cached = found ? (cached_scope_t*)*found : NULL;
+    if (cached && cached->valid) {
+        mod_unlock(mod);
+        return &cached->scope;
+    }
+    if (!cached) {
+        cached = xmalloc(sizeof(cached_scope_t));
+        cached->scope = (scope_t) { .entry = fn, .nodes = node_set_create() };
+        cached->fvs   = node_set_create();
+        cached->cfg   = NULL;
+        cached->valid = false;
+        fn2scope_insert(&cache->scopes, fn, cached);
+    }
+    cached->nnode_ids = mod->nnode_ids;
+    if (cached->nnode_ids > cache->last_id)
+        cache->last_id = cached->nnode_ids;
+    mod_unlock(mod);
+
+    // Only the thread in charge of the function computes its scope
+    node_set_clear(&cached->scope.nodes);
+    scope_compute(mod, &cached->scope);
+    cached->has_fvs = false;
+    if (cached->cfg) {
+        cfg_destroy(cached->cfg);
+        cached->cfg = NULL;
+    }
+
+    mod_lock(mod);
+    add_members(cache, cached);
+    if (cache->members.nelems - cache->nlive > cache->nlive + SCOPE_CACHE_MIN_STALE)
+        rebuild_members(cache);
+    mod_unlock(mod);
+    return &cached->scope;
+}
+
+const node_set_t* scope_get_fvs(mod_t* mod, const node_t* fn) {
+    cached_scope_t* cached = (cached_scope_t*)scope_get(mod, fn);
+    if (!cached->has_fvs) {
+        node_set_clear(&cached->fvs);
+        scope_compute_fvs(&cached->scope, &cached->fvs);
+        cached->has_fvs = true;
+    }
+    return &cached->fvs;
+}
+
+void scope_cache_bind(mod_t* mod, const node_t* node, const node_t* op) {
+    scope_cache_t* cache = mod->scope_cache;
+    if (cache->nlive == 0)
+        return;
+
+    // The new operand may depend on a scope through nodes that were created after
+    // it was computed, and which are thus missing from it. Functions do not depend
+    // on their operands, which are only part of a scope once they are bound.
+    node_vec_t* reached = &cache->reached;
+    node_vec_clear(reached);
+    node_vec_push(reached, node);
+    if (op->id >= cache->first_id) {
+        node_vec_t* stack = &cache->stack;
+        node_sset_clear(&cache->visited);
+        node_sset_insert(&cache->visited, op);
+        node_vec_push(stack, op);
+        while (stack->nelems > 0) {
+            const node_t* cur = node_vec_pop(stack);
+            cache->nchecks++;
+            if (cur->id < cache->first_id || cur->tag == NODE_FN) {
+                node_vec_push(reached, cur);
+                continue;
+            }
+            for (size_t j = 0; j < cur->nops; ++j) {
+                if (node_sset_insert(&cache->visited, cur->ops[j]))
+                    node_vec_push(stack, cur->ops[j]);
+            }
+        }
+    } else
+        node_vec_push(reached, op);
+
+    for (size_t j = 0; j < reached->nelems && cache->nlive > 0; ++j)
+        invalidate_members(cache, reached->elems[j]);
+}
+
+void scope_cache_invalidate(mod_t* mod, const node_t* node) {
+    invalidate_members(mod->scope_cache, node);
+}
+
+void scope_cache_truncate(mod_t* mod, uint32_t nnode_ids) {
+    scope_cache_t* cache = mod->scope_cache;
+    if (cache->last_id <= nnode_ids)
+        return;
+    node_vec_t fns = node_vec_create();
+    FORALL_HMAP(cache->scopes, const node_t*, fn, cached_scope_t*, cached, {
+        if (cached->nnode_ids > nnode_ids) {
+            free_cached_scope(cached);
+            node_vec_push(&fns, fn);
+        }
+    })
+    FORALL_VEC(fns, const node_t*, fn, {
+        fn2scope_remove(&cache->scopes, fn);
+    })
+    node_vec_destroy(&fns);
+    // The lists may refer to the scopes that were just freed
+    rebuild_members(cache);
+}
+
+void scope_cache_clear(mod_t* mod) {
+    scope_cache_t* cache = mod->scope_cache;
+    FORALL_HMAP(cache->scopes, const node_t*, fn, cached_scope_t*, cached, {
+        (void)fn;
+        free_cached_scope(cached);
+    })
+    fn2scope_clear(&cache->scopes);
+    scope_member_vec_clear(&cache->members);
+    scope_head_vec_clear(&cache->heads);
+    cache->nlive    = 0;
+    cache->first_id = UINT32_MAX;
+    cache->last_id  = 0;
 }
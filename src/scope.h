@@ -1,16 +1,78 @@
 #ifndef SCOPE_H
 #define SCOPE_H
 
-#include "mod.h"
+#include "node.h"
 
 typedef struct scope_s scope_t;
+typedef struct cfg_s   cfg_t;
 
 struct scope_s {
     const node_t* entry;
     node_set_t nodes;
 };
 
+// Scope of a function cached in a module, along with its free variables
+struct cached_scope_s {
+    scope_t    scope;       // Must stay first, see scope_get_fvs()
+    node_set_t fvs;
+    cfg_t*     cfg;         // Built on demand, see cfg_get()
+    uint32_t   nnode_ids;   // Number of node identifiers when the scope was computed
+    uint32_t   stamp;       // Changes every time the scope is computed
+    bool       has_fvs;
+    bool       valid;
+};
+
+// Scopes of functions, allocated separately so that they do not move
+HMAP_DEFAULT(fn2scope, const node_t*, cached_scope_t*)
+
+// Element of the list of the cached scopes that contain a node. Elements are
+// left behind when a scope changes, and only count while the scope is valid
+// and has the same stamp.
+typedef struct {
+    cached_scope_t* scope;
+    uint32_t stamp;
+    uint32_t next;          // UINT32_MAX for the last element
+} scope_member_t;
+
+VEC(scope_member_vec, scope_member_t)
+VEC(scope_head_vec, uint32_t)
+
+// Cached scopes, along with the scopes that contain each node, so that
+// binding an operand only looks at the scopes that it may change
+struct scope_cache_s {
+    fn2scope_t         scopes;
+    scope_member_vec_t members;
+    scope_head_vec_t   heads;       // First member for each node identifier
+    size_t             nlive;       // Number of members that still count
+    size_t             nchecks;     // Nodes and members looked at when binding operands
+    uint32_t           stamp;
+    uint32_t           first_id;    // At most the number of node identifiers of any valid scope
+    uint32_t           last_id;     // At least the number of node identifiers of any cached scope
+    // Temporary storage for scope_cache_bind()
+    node_sset_t        visited;
+    node_vec_t         stack;
+    node_vec_t         reached;
+};
+
 void scope_compute(mod_t*, scope_t*);
 void scope_compute_fvs(const scope_t*, node_set_t*);
 
+// Returns the scope of a function, which is cached in the module until the
+// function or a node of its scope is bound or replaced, or until a node bound
+// to one of them depends on the scope. The returned scope may be used until
+// the scope of the same function is requested again.
+const scope_t* scope_get(mod_t*, const node_t*);
+// Returns the free variables of the scope of a function, cached along with it
+const node_set_t* scope_get_fvs(mod_t*, const node_t*);
+
+scope_cache_t* scope_cache_create(void);
+void scope_cache_destroy(scope_cache_t*);
+// Invalidates the cached scopes that the binding of an operand of a node changes
+void scope_cache_bind(mod_t*, const node_t*, const node_t*);
+// Invalidates the cached scopes that contain the given node
+void scope_cache_invalidate(mod_t*, const node_t*);
+// Removes the scopes computed when the number of node identifiers was higher than the given one
+void scope_cache_truncate(mod_t*, uint32_t);
+void scope_cache_clear(mod_t*);
+
 #endif // SCOPE_H
@@ -0,0 +1,209 @@
+#include "strength.h"
+#include "node.h"
+#include "type.h"
+#include "util.h"
+
+static inline bool is_pow2(uint64_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+static inline size_t log2_floor(uint64_t value) {
+    size_t k = 0;
+    while (value >>= 1) k++;
+    return k;
+}
+
+// Integer type with the same signedness and twice the number of bits
+static inline const type_t* wide_type(mod_t* mod, const type_t* type) {
+    assert(type->tag != TYPE_I64 && type->tag != TYPE_U64);
+    return type_prim(mod, type->tag + 1);
+}
+
+// High half of the product of the value with a constant, computed in the wider type
+static const node_t* make_mulh(mod_t* mod, const node_t* value, uint64_t factor, const dbg_t* dbg) {
+    const type_t* type = value->type;
+    const type_t* wide = wide_type(mod, type);
+    const node_t* prod = node_mul(mod, node_int_literal(mod, wide, factor), node_extend(mod, value, wide, dbg), dbg);
+    const node_t* high = node_rshft(mod, prod, node_int_literal(mod, wide, type_bitwidth(type)), dbg);
+    return node_trunc(mod, high, type, dbg);
+}
+
+// Division by a power of two, rounding towards zero for signed types
+static const node_t* make_div_pow2(mod_t* mod, const node_t* value, size_t k, const dbg_t* dbg) {
+    const type_t* type = value->type;
+    if (type_is_u(type))
+        return node_rshft(mod, value, node_int_literal(mod, type, k), dbg);
+    // Negative values are biased by 2^k - 1 before the shift
+    size_t w = type_bitwidth(type);
+    const node_t* sign = node_rshft(mod, value, node_int_literal(mod, type, w - 1), dbg);
+    const node_t* bias = node_and(mod, node_int_literal(mod, type, (UINT64_C(1) << k) - 1), sign, dbg);
+    return node_rshft(mod, node_add(mod, value, bias, dbg), node_int_literal(mod, type, k), dbg);
+}
+
+// Unsigned division by a constant that is not a power of two, following
+// "Division by invariant integers using multiplication" (Granlund & Montgomery)
+static const node_t* make_div_u(mod_t* mod, const node_t* value, uint64_t d, const dbg_t* dbg) {
+    const type_t* type = value->type;
+    size_t w = type_bitwidth(type);
+    size_t l = log2_floor(d) + 1;
+    uint64_t m = ((((UINT64_C(1) << l) - d) << w) / d) + 1;
+    // q = (t + ((n - t) >> 1)) >> (l - 1) with t = mulh(m, n)
+    const node_t* t   = make_mulh(mod, value, m, dbg);
+    const node_t* one = node_int_literal(mod, type, 1);
+    const node_t* sum = node_add(mod, t, node_rshft(mod, node_sub(mod, value, t, dbg), one, dbg), dbg);
+    return node_rshft(mod, sum, node_int_literal(mod, type, l - 1), dbg);
+}
+
+// Signed division by a constant whose absolute value is not a power of two
+static const node_t* make_div_i(mod_t* mod, const node_t* value, int64_t d, const dbg_t* dbg) {
+    const type_t* type = value->type;
+    size_t w = type_bitwidth(type);
+    uint64_t abs_d = d < 0 ? -(uint64_t)d : (uint64_t)d;
+    size_t l = log2_floor(abs_d) + 1;
+    // The multiplier is in [2^(w-1), 2^w), and is used as a negative number
+    uint64_t m = (UINT64_C(1) << (w + l - 1)) / abs_d + 1;
+    int64_t neg_m = (int64_t)(m - (UINT64_C(1) << w));
+    // q = ((n + mulh(m - 2^w, n)) >> (l - 1)) - (n >> (w - 1)), negated when d < 0
+    const node_t* t    = node_add(mod, value, make_mulh(mod, value, (uint64_t)neg_m, dbg), dbg);
+    const node_t* sign = node_rshft(mod, value, node_int_literal(mod, type, w - 1), dbg);
+    const node_t* q    = node_sub(mod, node_rshft(mod, t, node_int_literal(mod, type, l - 1), dbg), sign, dbg);
+    return d < 0 ? node_sub(mod, node_zero(mod, type), q, dbg) : q;
+}
+
+static const node_t* make_div(mod_t* mod, const node_t* value, const node_t* divisor, const dbg_t* dbg) {
+    const type_t* type = value->type;
+    size_t w = type_bitwidth(type);
+    uint64_t mask = w == 64 ? UINT64_MAX : (UINT64_C(1) << w) - 1;
+    if (type_is_u(type)) {
+        uint64_t d = node_value_u(divisor) & mask;
+        if (is_pow2(d))
+            return make_div_pow2(mod, value, log2_floor(d), dbg);
+        if (d > 2 && w < 64)
+            return make_div_u(mod, value, d, dbg);
+        return NULL;
+    }
+    int64_t d = node_value_i(divisor);
+    uint64_t abs_d = d < 0 ? -(uint64_t)d : (uint64_t)d;
+    // The smallest integer, and -1 which can overflow, are left as they are
+    if (abs_d <= 1 || abs_d > (mask >> 1))
+        return NULL;
+    if (is_pow2(abs_d)) {
+        const node_t* q = make_div_pow2(mod, value, log2_floor(abs_d), dbg);
+        return d < 0 ? node_sub(mod, node_zero(mod, type), q, dbg) : q;
+    }
+    if (w < 64)
+        return make_div_i(mod, value, d, dbg);
+    return NULL;
+}
+
+static const node_t* make_rem(mod_t* mod, const node_t* value, const node_t* divisor, const dbg_t* dbg) {
+    const type_t* type = value->type;
+    size_t w = type_bitwidth(type);
+    uint64_t mask = w == 64 ? UINT64_MAX : (UINT64_C(1) << w) - 1;
+    uint64_t d = node_value_u(divisor) & mask;
+    if (type_is_i(type)) {
+        int64_t i = node_value_i(divisor);
+        d = i < 0 ? -(uint64_t)i : (uint64_t)i;
+        // The remainder has the sign of the dividend, so the divisor can be made positive
+        if (d <= 1 || d > (mask >> 1))
+            return NULL;
+    }
+    if (is_pow2(d)) {
+        size_t k = log2_floor(d);
+        if (type_is_u(type))
+            return node_and(mod, node_int_literal(mod, type, d - 1), value, dbg);
+        // n - ((n + bias) & -2^k), with the same bias as the division
+        const node_t* sign = node_rshft(mod, value, node_int_literal(mod, type, w - 1), dbg);
+        const node_t* bias = node_and(mod, node_int_literal(mod, type, d - 1), sign, dbg);
+        const node_t* sum  = node_add(mod, value, bias, dbg);
+        return node_sub(mod, value, node_and(mod, node_int_literal(mod, type, ~((UINT64_C(1) << k) - 1)), sum, dbg), dbg);
+    }
+    const node_t* lit = node_int_literal(mod, type, d);
+    const node_t* q = make_div(mod, value, lit, dbg);
+    if (!q)
+        return NULL;
+    return node_sub(mod, value, node_mul(mod, lit, q, dbg), dbg);
+}
+
+const node_t* node_reduce_strength(mod_t* mod, const node_t* node) {
+    if ((node->tag != NODE_MUL && node->tag != NODE_DIV && node->tag != NODE_REM) ||
+        !(type_is_i(node->type) || type_is_u(node->type)) || node->type->tag == TYPE_BOOL)
+        return node;
+
+    const node_t* res = NULL;
+    if (node->tag == NODE_MUL) {
+        // Literals are always on the left of multiplications
+        if (node->ops[0]->tag != NODE_LITERAL)
+            return node;
+        size_t w = type_bitwidth(node->type);
+        uint64_t mask = w == 64 ? UINT64_MAX : (UINT64_C(1) << w) - 1;
+        uint64_t k = node_value_u(node->ops[0]) & mask;
+        if (is_pow2(k))
+            res = node_lshft(mod, node->ops[1], node_int_literal(mod, node->type, log2_floor(k)), node->dbg);
+    } else if (node->ops[1]->tag == NODE_LITERAL) {
+        res = node->tag == NODE_DIV
+            ? make_div(mod, node->ops[0], node->ops[1], node->dbg)
+            : make_rem(mod, node->ops[0], node->ops[1], node->dbg);
+    }
+    return res ? res : node;
+}
+
+static inline bool is_rewritable(const scope_t* scope, const node_t* node) {
+    return node->nops > 0 && node->tag != NODE_FN && node->tag != NODE_TAPP &&
+           node_set_lookup(&scope->nodes, node);
+}
+
+static const node_t* rewrite(mod_t* mod, const scope_t* scope, const node_t* root, node2node_t* new_nodes, node_vec_t* stack) {
+    node_vec_push(stack, root);
+    // Post order walk over the nodes of the scope, rebuilding the nodes whose operands changed
+    while (stack->nelems > 0) {
+        const node_t* node = stack->elems[stack->nelems - 1];
+        if (node2node_lookup(new_nodes, node)) {
+            node_vec_pop(stack);
+            continue;
+        }
+        if (!is_rewritable(scope, node)) {
+            node2node_insert(new_nodes, node, node);
+            node_vec_pop(stack);
+            continue;
+        }
+        bool ready = true;
+        for (size_t i = 0; i < node->nops; ++i) {
+            if (!node2node_lookup(new_nodes, node->ops[i])) {
+                node_vec_push(stack, node->ops[i]);
+                ready = false;
+            }
+        }
+        if (!ready)
+            continue;
+
+        TMP_BUF_ALLOC(ops, const node_t*, node->nops)
+        bool changed = false;
+        for (size_t i = 0; i < node->nops; ++i) {
+            ops[i] = *node2node_lookup(new_nodes, node->ops[i]);
+            changed |= ops[i] != node->ops[i];
+        }
+        const node_t* new_node = changed ? node_rebuild(mod, node, ops, node->type) : node;
+        TMP_BUF_FREE(ops)
+        node2node_insert(new_nodes, node, node_reduce_strength(mod, new_node));
+        node_vec_pop(stack);
+    }
+    return *node2node_lookup(new_nodes, root);
+}
+
+void reduce_strength(mod_t* mod, const scope_t* scope, void* data) {
+    (void)data;
+    const node_t* entry = scope->entry;
+    node2node_t new_nodes = node2node_create();
+    node_vec_t stack = node_vec_create();
+    for (size_t i = 0; i < entry->nops; ++i) {
+        const node_t* op = entry->ops[i];
+        if (!op)
+            continue;
+        const node_t* new_op = rewrite(mod, scope, op, &new_nodes, &stack);
+        if (new_op != op)
+            node_bind(mod, entry, i, new_op);
+    }
+    node_vec_destroy(&stack);
+    node2node_destroy(&new_nodes);
+}
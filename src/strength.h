@@ -0,0 +1,16 @@
+#ifndef STRENGTH_H
+#define STRENGTH_H
+
+#include "scope.h"
+
+// Rewrites a multiplication, division or remainder of integers by a literal
+// into shifts, masks, and multiplications in a wider type, or returns the
+// node itself when there is no cheaper form. Division by a constant that is
+// not a power of two requires a wider type, and is thus not reduced on 64 bits.
+const node_t* node_reduce_strength(mod_t*, const node_t*);
+
+// Function pass (see pass.h) that reduces the strength of the operations in
+// the body of a function, and binds the body to the result
+void reduce_strength(mod_t*, const scope_t*, void*);
+
+#endif // STRENGTH_H
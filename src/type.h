@@ -64,11 +64,16 @@ enum type_tag_e {
 #define TYPE(name, str) name,
     TYPE_LIST(TYPE)
 #undef TYPE
+    TYPE_NTAGS
 };
 
+// Types that belong to a module are allocated in one block,
+// with their operands stored right after the header
 struct type_s {
     uint32_t tag;
-    size_t nops;
+    uint32_t id;        // Unique within the module, assigned on insertion
+    uint32_t nops;
+    uint32_t dsize;
     const type_t** ops;
     union {
         uint32_t      fp_flags;
@@ -76,9 +81,14 @@ struct type_s {
         struct_def_t* struct_def;
         enum_def_t*   enum_def;
     } data;
-    size_t dsize;
 };
 
+static inline uint32_t type_id(const type_t* type) {
+    return type->id;
+}
+
+BITSET(type_bitset, const type_t*, type_id)
+
 size_t type_bitwidth(const type_t*);
 bool type_is_unit(const type_t*);
 bool type_is_prim(const type_t*);
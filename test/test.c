@@ -2,12 +2,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <setjmp.h>
+#include <pthread.h>
 
 #include "htable.h"
 #include "mpool.h"
 #include "node.h"
 #include "type.h"
 #include "scope.h"
+#include "cfg.h"
+#include "pass.h"
+#include "strength.h"
+#include "reassoc.h"
+#include "facts.h"
 #include "io.h"
 #include "lex.h"
 #include "parse.h"
@@ -58,6 +64,23 @@ bool test_hset(void) {
     CHECK(set1.table->nelems == N / 2);
     CHECK(set2.table->nelems == N / 2);
 
+    htable_stats_t stats = htable_stats(set1.table);
+    CHECK(stats.ninserts == N && stats.nremoves == N / 2);
+    // Removals look the element up first
+    CHECK(stats.nlookups == N + N / 2 && stats.nrehashes > 0);
+    size_t nelems = 0;
+    for (size_t i = 0; i < HTABLE_DIB_BUCKETS; ++i)
+        nelems += stats.dibs[i];
+    CHECK(nelems == stats.nelems && stats.nelems == N / 2);
+
+    // Insertions shift the elements that follow in the cluster
+    for (size_t i = N / 2; i < N; i += 2)
+        CHECK(elemset_insert(&set1, values[i]));
+    for (size_t i = N / 2 + 1; i < N; i += 2)
+        CHECK(elemset_lookup(&set1, values[i]) == NULL);
+    for (size_t i = 0; i < N; ++i)
+        CHECK((elemset_lookup(&set1, values[i]) != NULL) == (i < N / 2 || i % 2 == 0));
+
 cleanup:
     elemset_destroy(&set1);
     elemset_destroy(&set2);
@@ -65,8 +88,96 @@ cleanup:
     return status == 0;
 }
 
+bool test_hash(void) {
+    size_t counts[256] = { 0 };
+    size_t nflips = 0;
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    // Strided keys, like pointers, are spread over the low bits of the hash
+    for (uint64_t i = 0; i < 256 * 64; ++i)
+        counts[hash_uint64(hash_init(), i * 4096) & 0xFF]++;
+    for (size_t i = 0; i < 256; ++i)
+        CHECK(counts[i] > 32 && counts[i] < 96);
+
+    // Flipping one bit of the input flips about half the bits of the hash
+    for (uint64_t i = 0; i < 64; ++i) {
+        uint32_t h1 = hash_uint64(hash_init(), 0x12345678);
+        uint32_t h2 = hash_uint64(hash_init(), 0x12345678 ^ (UINT64_C(1) << i));
+        for (uint32_t diff = h1 ^ h2; diff; diff &= diff - 1)
+            nflips++;
+    }
+    CHECK(nflips > 64 * 12 && nflips < 64 * 20);
+
+    // Word and byte hashing agree, and pointers are one word on 64-bit targets
+    const void* ptr = &nflips;
+    if (sizeof(void*) == 8)
+        CHECK(hash_ptr(hash_init(), ptr) == hash_bytes(hash_init(), &ptr, sizeof(void*)));
+    CHECK(hash_str(hash_init(), "abcdefghijk") == hash_bytes(hash_init(), "abcdefghijk", 11));
+    CHECK(hash_str(hash_init(), "abc") != hash_str(hash_init(), "abd"));
+
+cleanup:
+    return status == 0;
+}
+
+bool test_clear(void) {
+    elemset_t set = elemset_create();
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    // Clearing does not touch the slots, but they are seen as empty afterwards
+    for (uint32_t i = 0; i < 1000; ++i)
+        CHECK(elemset_insert(&set, i));
+    size_t cap = set.table->cap;
+    elemset_clear(&set);
+    CHECK(set.table->nelems == 0);
+    for (uint32_t i = 0; i < 1000; ++i)
+        CHECK(elemset_lookup(&set, i) == NULL);
+    FORALL_HSET(set, uint32_t, elem, {
+        CHECK(false);
+        (void)elem;
+    })
+
+    // Enough clears for the epoch to wrap around
+    for (uint32_t j = 0; j < 2 * HTABLE_MAX_EPOCH; ++j) {
+        for (uint32_t i = 0; i < 1000; i += 2)
+            CHECK(elemset_insert(&set, i + j));
+        for (uint32_t i = 0; i < 1000; ++i)
+            CHECK((elemset_lookup(&set, i + j) != NULL) == (i % 2 == 0));
+        CHECK(elemset_remove(&set, j));
+        CHECK(elemset_lookup(&set, j) == NULL);
+        CHECK(set.table->cap == cap);
+        elemset_clear(&set);
+    }
+
+    // The table shrinks when it stays mostly empty after several clears
+    for (size_t j = 0; j < 16; ++j) {
+        for (uint32_t i = 0; i < 10; ++i)
+            CHECK(elemset_insert(&set, i));
+        elemset_clear(&set);
+    }
+    CHECK(set.table->cap < cap && set.table->cap >= 40);
+    for (uint32_t i = 0; i < 1000; ++i)
+        CHECK(elemset_insert(&set, i));
+    for (uint32_t i = 0; i < 1000; ++i)
+        CHECK(elemset_lookup(&set, i) != NULL);
+
+cleanup:
+    elemset_destroy(&set);
+    return status == 0;
+}
+
 bool test_mpool(void) {
-    mpool_t* pool = mpool_create_with_cap(1024 * 1024);
+    mpool_t* pool = mpool_create_with_cap(1024 * 1024, 1024 * 1024);
+    mpool_t* growing = mpool_create_with_cap(1024, 8 * 1024);
+    mpool_mark_t mark;
+    char* ptr;
 
     jmp_buf env;
     int status = setjmp(env);
@@ -78,11 +189,56 @@ bool test_mpool(void) {
     CHECK(pool->next == NULL);
     CHECK(pool->cap == pool->size);
     mpool_alloc(&pool, 1024 * 1024 * 2);
-    CHECK(pool->cap == 1024 * 1024 * 2);
+    CHECK(pool->cap == 1024 * 1024);
     CHECK(pool->next != NULL);
+    CHECK(pool->next->cap == 1024 * 1024 * 2);
+
+    // Chunks double in size until they reach the maximum capacity
+    for (size_t i = 0; i < 100; ++i)
+        mpool_alloc(&growing, 100);
+    CHECK(growing->cap == 8 * 1024);
+    CHECK(growing->next->cap == 4 * 1024);
+    CHECK(growing->next->next->cap == 2 * 1024);
+    // Large requests do not waste the current chunk
+    ptr = mpool_alloc(&growing, 6 * 1024);
+    CHECK(growing->cap == 8 * 1024);
+    CHECK(growing->next->cap == 6 * 1024 && growing->next->begin == ptr);
+    ptr = mpool_alloc(&growing, 3);
+    CHECK(ptr == (char*)growing->begin + growing->size - 8);
+
+    // Releasing a mark frees every chunk created after it
+    mark = mpool_mark(growing);
+    mpool_alloc(&growing, 6 * 1024);
+    CHECK(growing->next != mark.next);
+    for (size_t i = 0; i < 20; ++i)
+        mpool_alloc(&growing, 1024);
+    CHECK(growing != mark.chunk);
+    mpool_release(&growing, mark);
+    CHECK(growing == mark.chunk && growing->next == mark.next && growing->size == mark.size);
+    CHECK(mpool_alloc(&growing, 3) == ptr + 8);
+
+    // Freed blocks are reused by allocations of the same size class
+    ptr = mpool_alloc(&growing, 40);
+    mpool_free(growing, ptr, 40);
+    CHECK(mpool_alloc(&growing, 36) == ptr);
+    CHECK(mpool_alloc(&growing, 36) != ptr);
+
+    // Statistics account for alignment, free lists and chunks
+    mpool_stats_t before = mpool_stats(growing);
+    ptr = mpool_alloc(&growing, 20);
+    mpool_free(growing, ptr, 20);
+    mpool_stats_t after = mpool_stats(growing);
+    CHECK(after.requested == before.requested);
+    CHECK(after.used == before.used + 24 && after.free == before.free + 24);
+    CHECK(after.requested <= after.used && after.used <= after.reserved);
+    size_t nchunks = 0;
+    for (mpool_t* chunk = growing; chunk; chunk = chunk->next)
+        nchunks++;
+    CHECK(after.nchunks == nchunks);
 
 cleanup:
     mpool_destroy(pool);
+    mpool_destroy(growing);
     return status == 0;
 }
 
@@ -146,6 +302,932 @@ cleanup:
     return status == 0;
 }
 
+bool test_checkpoint(void) {
+    mod_t* mod = mod_create();
+    mod_mark_t mark;
+    size_t nnodes, ntypes;
+
+    const node_t* fn, *param, *body;
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    fn = node_fn(mod, type_fn(mod, type_i32(mod), type_i32(mod)), FN_EXPORTED, NULL);
+    param = node_param(mod, fn, NULL);
+    body = fn->ops[0];
+    nnodes = mod->nodes.nelems;
+    ntypes = mod->types.nelems;
+
+    mark = mod_checkpoint(mod);
+    node_bind(mod, fn, 0, node_add(mod, param, node_i32(mod, 42), NULL));
+    node_i64(mod, 1);
+    node_fn(mod, type_fn(mod, type_u16(mod), type_i32(mod)), 0, NULL);
+    CHECK(mod->fns.nelems == 2);
+    CHECK(use_count(param->uses) == 1);
+    mod_rollback(mod, mark);
+
+    CHECK(mod->fns.nelems == 1);
+    CHECK(mod->nodes.nelems == nnodes);
+    CHECK(mod->types.nelems == ntypes);
+    CHECK(fn->ops[0] == body);
+    CHECK(use_count(param->uses) == 0);
+    CHECK(use_find(body->uses, 0, fn) != NULL);
+
+    // Committed changes stay in the module
+    mark = mod_checkpoint(mod);
+    node_bind(mod, fn, 0, node_add(mod, param, node_i32(mod, 42), NULL));
+    mod_commit(mod, mark);
+    CHECK(fn->ops[0] == node_add(mod, param, node_i32(mod, 42), NULL));
+    CHECK(mod->undo.nelems == 0);
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
+bool test_replace(void) {
+    mod_t* mod = mod_create();
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    const node_t* fn = node_fn(mod, type_fn(mod, type_i32(mod), type_i32(mod)), FN_EXPORTED, NULL);
+    const node_t* param = node_param(mod, fn, NULL);
+    const node_t* a = node_add(mod, param, node_i32(mod, 1), NULL);
+    const node_t* b = node_add(mod, param, node_i32(mod, 2), NULL);
+    const node_t* c = node_add(mod, param, node_i32(mod, 3), NULL);
+    const node_t* d = node_add(mod, param, node_i32(mod, 4), NULL);
+    node_bind(mod, fn, 0, node_mul(mod, a, param, NULL));
+
+    // Chains are compressed when they are resolved
+    node_replace(mod, a, b);
+    node_replace(mod, b, c);
+    node_replace(mod, c, d);
+    CHECK(node_resolve(a) == d);
+    CHECK(a->rep == d && b->rep == d && c->rep == d);
+    CHECK(node_resolve(d) == d);
+    node_replace(mod, d, a);
+    CHECK(node_resolve(a) == d && !d->rep);
+
+    // Users are rewritten to refer to the representatives
+    const node_t* body = fn->ops[0];
+    mod_apply_replacements(mod);
+    CHECK(node_resolve(body) == node_mul(mod, d, param, NULL));
+    CHECK(fn->ops[0] == node_mul(mod, d, param, NULL));
+    CHECK(use_count(a->uses) == 1);
+    CHECK(use_find(d->uses, INVALID_INDEX, fn->ops[0]));
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
+static size_t pool_size(const mpool_t* pool) {
+    size_t size = 0;
+    for (; pool; pool = pool->next)
+        size += pool->size;
+    return size;
+}
+
+bool test_recycle(void) {
+    mod_t* mod = mod_create();
+    size_t nnodes, nfree, size = 0;
+
+    const node_t* fn, *param, *body, *cmp_gt, *cmp_ge;
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    fn = node_fn(mod, type_fn(mod, type_i32(mod), type_i32(mod)), FN_EXPORTED, NULL);
+    param = node_param(mod, fn, NULL);
+    nnodes = mod->nodes.nelems;
+    for (int i = 0; i < 1000; ++i) {
+        body = fn->ops[0];
+        node_bind(mod, fn, 0, node_mul(mod, node_add(mod, param, node_i32(mod, i + 1), NULL), param, NULL));
+        if (body->tag != NODE_BOTTOM)
+            mod_remove_node(mod, body);
+        if (i == 10)
+            size = pool_size(mod->pool);
+    }
+    // Removed nodes and uses are recycled: the module does not grow
+    CHECK(pool_size(mod->pool) == size);
+    CHECK(mod->nodes.nelems == nnodes + 3);
+    CHECK(use_count(param->uses) == 2);
+    CHECK(fn->ops[0] == node_mul(mod, node_add(mod, param, node_i32(mod, 1000), NULL), param, NULL));
+
+    // Blocks recycled before a query to node_implies() are still recycled after it
+    cmp_gt = node_cmpgt(mod, param, node_i32(mod, 3), NULL);
+    cmp_ge = node_cmpge(mod, param, node_i32(mod, 2), NULL);
+    body = fn->ops[0];
+    node_bind(mod, fn, 0, param);
+    mod_remove_node(mod, body);
+    nfree = mpool_stats(mod->pool).free;
+    CHECK(nfree > 0);
+    CHECK(node_implies(mod, cmp_gt, cmp_ge, false, false));
+    CHECK(mpool_stats(mod->pool).free == nfree);
+    size = pool_size(mod->pool);
+    node_bind(mod, fn, 0, node_mul(mod, node_add(mod, param, node_i32(mod, 1001), NULL), param, NULL));
+    CHECK(pool_size(mod->pool) == size);
+    CHECK(mpool_stats(mod->pool).free < nfree);
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
+bool test_uses(void) {
+    mod_t* mod = mod_create();
+
+    const node_t* fn, *param, *fns[100];
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    fn = node_fn(mod, type_fn(mod, type_i32(mod), type_i32(mod)), FN_EXPORTED, NULL);
+    param = node_param(mod, fn, NULL);
+    node_bind(mod, fn, 0, node_mul(mod, node_add(mod, param, node_i32(mod, 1), NULL), param, NULL));
+    CHECK(use_count(param->uses) == 2);
+
+    // Uses can be unlinked in any order, even while iterating over them
+    for (size_t i = 0; i < 100; ++i) {
+        fns[i] = node_fn(mod, fn->type, 0, NULL);
+        node_bind(mod, fns[i], 0, param);
+    }
+    CHECK(use_count(param->uses) == 102);
+    node_bind(mod, fns[50], 0, fn->ops[0]);
+    CHECK(use_count(param->uses) == 101);
+    CHECK(!use_find(param->uses, 0, fns[50]));
+    CHECK(use_find(param->uses, 0, fns[49]));
+    FORALL_USES(param, use, {
+        if (use->user->tag == NODE_FN)
+            node_bind(mod, use->user, use->index, fn->ops[0]);
+    })
+    CHECK(use_count(param->uses) == 2);
+    CHECK(use_count(fn->ops[0]->uses) == 101);
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
+bool test_gc(void) {
+    mod_t* mod = mod_create();
+    size_t nnodes, ntypes, size;
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    const type_t* fn_type = type_fn(mod, type_i32(mod), type_i32(mod));
+    const node_t* fn = node_fn(mod, fn_type, FN_EXPORTED, NULL);
+    const node_t* callee = node_fn(mod, fn_type, 0, NULL);
+    const node_t* param = node_param(mod, fn, NULL);
+    node_bind(mod, fn, 0, node_app(mod, callee, node_add(mod, param, node_i32(mod, 1), NULL), node_bool(mod, true), NULL));
+    nnodes = mod->nodes.nelems;
+    ntypes = mod->types.nelems;
+
+    // Unreachable nodes, functions and types
+    const node_t* dead_fn = node_fn(mod, type_fn(mod, type_u16(mod), type_u16(mod)), 0, NULL);
+    node_bind(mod, dead_fn, 0, node_u16(mod, 7));
+    node_mul(mod, param, node_i32(mod, 5), NULL);
+    node_tuple_from_args(mod, 2, NULL, node_i64(mod, 1), node_u64(mod, 2));
+    CHECK(use_count(param->uses) == 2);
+
+    mod_gc(mod);
+    CHECK(mod->fns.nelems == 2);
+    CHECK(mod->fns.elems[0] == fn && mod->fns.elems[1] == callee);
+    CHECK(mod->nodes.nelems == nnodes);
+    CHECK(mod->types.nelems == ntypes);
+    CHECK(use_count(param->uses) == 1);
+    FORALL_NODES(mod, node, {
+        CHECK(node->tag != NODE_LITERAL || node->type == type_i32(mod) || node->type == type_bool(mod));
+    })
+
+    // The memory of removed nodes is recycled
+    size = pool_size(mod->pool);
+    node_mul(mod, param, node_i32(mod, 5), NULL);
+    CHECK(pool_size(mod->pool) == size);
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
+#define CONCURRENT_NTHREADS 4
+#define CONCURRENT_NNODES   2000
+
+typedef struct {
+    mod_t* mod;
+    const node_t* global;
+    const node_t* fn;
+    const node_t* nodes[CONCURRENT_NNODES];
+} concurrent_job_t;
+
+static void* build_nodes(void* ptr) {
+    concurrent_job_t* job = ptr;
+    mod_t* mod = job->mod;
+    job->fn = node_fn(mod, type_fn(mod, type_i32(mod), type_i32(mod)), 0, NULL);
+    const node_t* param = node_param(mod, job->fn, NULL);
+    const node_t* global = job->global;
+    for (int32_t i = 0; i < CONCURRENT_NNODES; ++i)
+        job->nodes[i] = node_add(mod, node_and(mod, global, node_i32(mod, i + 2), NULL), node_i32(mod, i), NULL);
+    node_bind(mod, job->fn, 0, node_add(mod, param, job->nodes[CONCURRENT_NNODES - 1], NULL));
+    return NULL;
+}
+
+bool test_concurrent(void) {
+    mod_t* mod = mod_create();
+    mod_t* ref = mod_create();
+    concurrent_job_t jobs[CONCURRENT_NTHREADS];
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    const node_t* fn = node_fn(mod, type_fn(mod, type_i32(mod), type_i32(mod)), FN_EXPORTED, NULL);
+    const node_t* ref_fn = node_fn(ref, type_fn(ref, type_i32(ref), type_i32(ref)), FN_EXPORTED, NULL);
+
+    // Threads building the same expressions get the same nodes
+    mod_begin_concurrent(mod);
+    pthread_t threads[CONCURRENT_NTHREADS];
+    for (size_t i = 0; i < CONCURRENT_NTHREADS; ++i) {
+        jobs[i].mod = mod;
+        jobs[i].global = node_param(mod, fn, NULL);
+        pthread_create(&threads[i], NULL, build_nodes, &jobs[i]);
+    }
+    for (size_t i = 0; i < CONCURRENT_NTHREADS; ++i)
+        pthread_join(threads[i], NULL);
+    mod_end_concurrent(mod);
+
+    for (size_t i = 1; i < CONCURRENT_NTHREADS; ++i) {
+        for (size_t j = 0; j < CONCURRENT_NNODES; ++j)
+            CHECK(jobs[i].nodes[j] == jobs[0].nodes[j]);
+        CHECK(jobs[i].fn != jobs[0].fn);
+    }
+    CHECK(use_count(jobs[0].nodes[CONCURRENT_NNODES - 1]->uses) == CONCURRENT_NTHREADS);
+
+    // The result is the same as when the nodes are built sequentially
+    for (size_t i = 0; i < CONCURRENT_NTHREADS; ++i) {
+        jobs[i].mod = ref;
+        jobs[i].global = node_param(ref, ref_fn, NULL);
+        build_nodes(&jobs[i]);
+    }
+    CHECK(mod->fns.nelems   == ref->fns.nelems);
+    CHECK(mod->nodes.nelems == ref->nodes.nelems);
+    CHECK(mod->types.nelems == ref->types.nelems);
+    CHECK(mod->nnode_ids    == ref->nnode_ids);
+    size_t nnodes = 0;
+    FORALL_NODES(mod, node, {
+        CHECK(mod_insert_node(mod, node) == node);
+        nnodes++;
+    })
+    CHECK(nnodes == mod->nodes.nelems);
+
+cleanup:
+    mod_destroy(mod);
+    mod_destroy(ref);
+    return status == 0;
+}
+
+bool test_stats(void) {
+    mod_t* mod = mod_create();
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    const node_t* fn = node_fn(mod, type_fn(mod, type_i32(mod), type_i32(mod)), FN_EXPORTED, NULL);
+    const node_t* param = node_param(mod, fn, NULL);
+    const node_t* sum = node_add(mod, param, node_i32(mod, 1), NULL);
+    node_bind(mod, fn, 0, node_mul(mod, sum, sum, NULL));
+
+    mod_stats_t stats = mod_stats(mod);
+    CHECK(stats.nnodes == mod->nodes.nelems + mod->fns.nelems);
+    CHECK(stats.ntypes == mod->types.nelems);
+    CHECK(stats.nfns == 1);
+    CHECK(stats.nodes_per_tag[NODE_FN] == 1);
+    CHECK(stats.nodes_per_tag[NODE_PARAM] == 1);
+    CHECK(stats.nodes_per_tag[NODE_ADD] == 1);
+    CHECK(stats.nodes_per_tag[NODE_MUL] == 1);
+    CHECK(stats.types_per_tag[TYPE_I32] == 1);
+    CHECK(stats.types_per_tag[TYPE_FN] == 1);
+    size_t nnodes = 0, ntypes = 0, nuses = 0;
+    for (size_t i = 0; i < NODE_NTAGS; ++i) nnodes += stats.nodes_per_tag[i];
+    for (size_t i = 0; i < TYPE_NTAGS; ++i) ntypes += stats.types_per_tag[i];
+    FORALL_NODES(mod, node, { nuses += node->nops; })
+    nuses += fn->nops;
+    CHECK(nnodes == stats.nnodes && ntypes == stats.ntypes);
+    CHECK(stats.nuses == nuses);
+    CHECK(stats.max_fan_in == 2 && stats.max_fan_out == 2);
+    CHECK(stats.pool.used > 0);
+
+    // Rebuilding existing nodes and types only counts hits
+    node_add(mod, param, node_i32(mod, 1), NULL);
+    type_i32(mod);
+    mod_stats_t next = mod_stats(mod);
+    CHECK(next.nnodes == stats.nnodes && next.ntypes == stats.ntypes);
+    CHECK(next.nnode_hits - stats.nnode_hits == next.nnode_lookups - stats.nnode_lookups);
+    CHECK(next.nnode_hits > stats.nnode_hits);
+    CHECK(next.ntype_hits - stats.ntype_hits == next.ntype_lookups - stats.ntype_lookups);
+    CHECK(next.ntype_hits > stats.ntype_hits);
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
+bool test_implies(void) {
+    mod_t* mod = mod_create();
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    const size_t n = 64;
+    const type_t* type = type_fn(mod, type_i32(mod), type_bool(mod));
+    const node_t* param = node_param(mod, node_fn(mod, type, FN_EXPORTED, NULL), NULL);
+    const node_t* a = node_cmpgt(mod, param, node_i32(mod, 0), NULL);
+    const node_t* b = node_cmpeq(mod, param, node_i32(mod, 20), NULL);
+    CHECK(node_implies(mod, node_and(mod, a, b, NULL), a, false, false));
+    CHECK(node_implies(mod, a, node_or(mod, a, b, NULL), false, false));
+    CHECK(!node_implies(mod, a, b, false, false));
+
+    // Deep exclusive or chains take exponential time without the cache
+    const node_t* chain = a;
+    for (size_t i = 0; i < n; ++i)
+        chain = node_xor(mod, chain, node_cmpeq(mod, param, node_i32(mod, i), NULL), NULL);
+    mod->implies_budget = SIZE_MAX;
+    CHECK(!node_implies(mod, chain, b, false, false));
+    mod->implies_budget = MOD_IMPLIES_BUDGET;
+    CHECK(node_implies(mod, chain, chain, false, false));
+
+    // Failures caused by the budget are not cached
+    const node_t* c = node_cmpne(mod, param, node_i32(mod, 5), NULL);
+    const node_t* and = node_and(mod, node_and(mod, a, b, NULL), c, NULL);
+    mod->implies_budget = 1;
+    CHECK(!node_implies(mod, and, c, false, false));
+    mod->implies_budget = MOD_IMPLIES_BUDGET;
+    CHECK(node_implies(mod, and, c, false, false));
+
+    // Rolling back the nodes used in queries clears the cache
+    mod_mark_t mark = mod_checkpoint(mod);
+    const node_t* d = node_cmpne(mod, param, node_i32(mod, 7), NULL);
+    CHECK(node_implies(mod, node_and(mod, a, d, NULL), d, false, false));
+    CHECK(mod->implies_bound > mark.nnode_ids);
+    mod_rollback(mod, mark);
+    CHECK(mod->implies_bound <= mark.nnode_ids);
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
+bool test_facts(void) {
+    mod_t* mod = mod_create();
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    const node_t* x  = node_param(mod, node_fn(mod, type_fn(mod, type_u32(mod), type_u32(mod)), FN_EXPORTED, NULL), NULL);
+    const node_t* y  = node_param(mod, node_fn(mod, type_fn(mod, type_i32(mod), type_i32(mod)), FN_EXPORTED, NULL), NULL);
+    const node_t* x8 = node_param(mod, node_fn(mod, type_fn(mod, type_u8(mod), type_u8(mod)), FN_EXPORTED, NULL), NULL);
+    const node_t* t = node_bool(mod, true);
+    const node_t* low = node_and(mod, x, node_u32(mod, 0xFF), NULL);
+
+    // Comparisons
+    CHECK(node_cmplt(mod, low, node_u32(mod, 256), NULL) == t);
+    CHECK(node_cmplt(mod, node_and(mod, x, node_u32(mod, 0x1FF), NULL), node_u32(mod, 256), NULL) != t);
+    CHECK(node_cmplt(mod, node_rem(mod, x, node_u32(mod, 10), NULL), node_u32(mod, 10), NULL) == t);
+    CHECK(node_cmpne(mod, node_or(mod, x, node_u32(mod, 1), NULL), node_u32(mod, 0), NULL) == t);
+    const node_t* sum = node_add(mod, node_and(mod, x, node_u32(mod, 0x0F), NULL), node_and(mod, x, node_u32(mod, 0xF0), NULL), NULL);
+    CHECK(node_cmple(mod, sum, node_u32(mod, 0xFF), NULL) == t);
+    const node_t* mul = node_mul(mod, x, node_u32(mod, 4), NULL);
+    CHECK(node_cmpeq(mod, node_and(mod, mul, node_u32(mod, 3), NULL), node_u32(mod, 0), NULL) == t);
+    const node_t* high = node_rshft(mod, y, node_i32(mod, 24), NULL);
+    CHECK(node_cmplt(mod, high, node_i32(mod, 128), NULL) == t);
+    CHECK(node_cmpge(mod, high, node_i32(mod, -128), NULL) == t);
+    CHECK(node_cmplt(mod, high, node_i32(mod, 127), NULL) != t);
+    CHECK(node_cmpge(mod, node_and(mod, y, node_i32(mod, 0x7F), NULL), node_i32(mod, 0), NULL) == t);
+    const node_t* select = node_select(mod, node_cmpeq(mod, y, node_i32(mod, 0), NULL), low, node_and(mod, x, node_u32(mod, 0x7), NULL), NULL);
+    CHECK(node_cmplt(mod, select, node_u32(mod, 256), NULL) == t);
+
+    // Shifts and casts
+    CHECK(node_rshft(mod, low, node_u32(mod, 8), NULL) == node_u32(mod, 0));
+    CHECK(node_trunc(mod, node_and(mod, x, node_u32(mod, 0xFF00), NULL), type_u8(mod), NULL) == node_u8(mod, 0));
+    const node_t* zero = node_and(mod, node_rshft(mod, x8, node_u8(mod, 7), NULL), node_u8(mod, 2), NULL);
+    CHECK(zero->tag == NODE_AND);
+    CHECK(node_extend(mod, zero, type_u32(mod), NULL) == node_u32(mod, 0));
+
+    node_facts_t facts = node_facts(mod, node_rem(mod, x, node_u32(mod, 10), NULL));
+    CHECK(facts.min == 0 && facts.max == 9 && facts.zeros == 0xFFFFFFF0);
+
+    // Rolling back the nodes clears their facts
+    mod_mark_t mark = mod_checkpoint(mod);
+    node_facts(mod, node_and(mod, x, node_u32(mod, 0xF0F0), NULL));
+    CHECK(mod->facts_cache.nelems > mark.nnode_ids);
+    mod_rollback(mod, mark);
+    CHECK(mod->facts_cache.nelems <= mark.nnode_ids);
+    facts = node_facts(mod, node_or(mod, x, node_u32(mod, 0x100), NULL));
+    CHECK(facts.ones == 0x100 && facts.min == 0x100);
+
+    // Facts are computed without the cache in concurrent mode
+    mod_begin_concurrent(mod);
+    size_t nelems = mod->facts_cache.nelems;
+    CHECK(node_cmplt(mod, node_and(mod, x, node_u32(mod, 0x3F), NULL), node_u32(mod, 64), NULL) == t);
+    CHECK(mod->facts_cache.nelems == nelems);
+    mod_end_concurrent(mod);
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
+#define PASS_NFNS 64
+
+static void build_pass_mod(mod_t* mod) {
+    const type_t* fn_type = type_fn(mod, type_i32(mod), type_i32(mod));
+    for (int32_t i = 0; i < PASS_NFNS; ++i) {
+        const node_t* fn = node_fn(mod, fn_type, FN_EXPORTED, NULL);
+        const node_t* param = node_param(mod, fn, NULL);
+        node_bind(mod, fn, 0, node_add(mod, param, node_i32(mod, i % 8), NULL));
+        // Every other function has a nested function
+        if (i % 2 == 0) {
+            const node_t* nested = node_fn(mod, fn_type, 0, NULL);
+            node_bind(mod, nested, 0, node_mul(mod, param, node_param(mod, nested, NULL), NULL));
+        }
+    }
+}
+
+static void rewrite_body(mod_t* mod, const scope_t* scope, void* data) {
+    (void)data;
+    const node_t* fn = scope->entry;
+    const node_t* param = node_param(mod, fn, NULL);
+    // Nodes that are not used in the end are removed
+    node_sub(mod, param, node_i32(mod, 1000), NULL);
+    node_bind(mod, fn, 0, node_add(mod, fn->ops[0], node_mul(mod, param, node_i32(mod, 3), NULL), NULL));
+}
+
+bool test_pass(void) {
+    mod_t* mods[2] = { mod_create(), mod_create() };
+    uint8_t* bufs[2] = { xmalloc(1 << 16), xmalloc(1 << 16) };
+    mem_io_t ios[2];
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    // Serial and parallel runs produce the same module
+    for (size_t i = 0; i < 2; ++i) {
+        build_pass_mod(mods[i]);
+        pass_run_on_fns(mods[i], rewrite_body, NULL, i == 0 ? 1 : 4);
+        ios[i] = io_from_buffer(bufs[i], 1 << 16);
+        CHECK(mod_save(mods[i], &ios[i].io));
+    }
+    CHECK(ios[0].off == ios[1].off);
+    CHECK(!memcmp(bufs[0], bufs[1], ios[0].off));
+    CHECK(mods[0]->nodes.nelems == mods[1]->nodes.nelems);
+    CHECK(mods[0]->nnode_ids == mods[1]->nnode_ids);
+
+    // Temporary nodes are gone, and identifiers stay dense
+    size_t nnodes = 0;
+    FORALL_NODES(mods[1], node, {
+        CHECK(node->tag != NODE_SUB);
+        CHECK(node->id < mods[1]->nnode_ids);
+        nnodes++;
+    })
+    CHECK(nnodes + mods[1]->fns.nelems == mods[1]->nnode_ids);
+    FORALL_FNS(mods[1], fn, {
+        const node_t* param = node_param(mods[1], fn, NULL);
+        CHECK(use_find(fn->ops[0]->uses, 0, fn));
+        CHECK(use_count(param->uses) >= 2);
+    })
+
+cleanup:
+    for (size_t i = 0; i < 2; ++i) {
+        mod_destroy(mods[i]);
+        free(bufs[i]);
+    }
+    return status == 0;
+}
+
+static void bind_commutative(mod_t* mod, const scope_t* scope, void* data) {
+    (void)data;
+    const node_t* fn = scope->entry;
+    const node_t* param = node_param(mod, fn, NULL);
+    const node_t* x = node_mul(mod, param, param, NULL);
+    const node_t* y = node_sub(mod, param, node_and(mod, param, node_i32(mod, 7), NULL), NULL);
+    if (fn->type->ops[1]->tag == TYPE_BOOL)
+        node_bind(mod, fn, 0, node_cmpgt(mod, x, y, NULL));
+    else
+        node_bind(mod, fn, 0, node_add(mod, x, y, NULL));
+}
+
+bool test_pass_order(void) {
+    mod_t* mod = mod_create();
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    const node_t* add_fn = node_fn(mod, type_fn(mod, type_i32(mod), type_i32(mod)), FN_EXPORTED, NULL);
+    const node_t* cmp_fn = node_fn(mod, type_fn(mod, type_i32(mod), type_bool(mod)), FN_EXPORTED, NULL);
+    node_bind(mod, add_fn, 0, node_param(mod, add_fn, NULL));
+    node_bind(mod, cmp_fn, 0, node_bool(mod, false));
+    pass_run_on_fns(mod, bind_commutative, NULL, 1);
+
+    // Operands of commutative operations and comparisons are still in order
+    // once renumbered, so that building them again gives the same nodes
+    size_t nnodes = mod->nodes.nelems;
+    const node_t* add = add_fn->ops[0];
+    const node_t* cmp = cmp_fn->ops[0];
+    CHECK(add->tag == NODE_ADD);
+    CHECK(add->ops[0]->id < add->ops[1]->id);
+    CHECK(node_add(mod, add->ops[0], add->ops[1], NULL) == add);
+    CHECK(node_add(mod, add->ops[1], add->ops[0], NULL) == add);
+    CHECK(cmp->tag == NODE_CMPGT);
+    CHECK(cmp->ops[0]->id < cmp->ops[1]->id);
+    CHECK(node_cmpgt(mod, cmp->ops[0], cmp->ops[1], NULL) == cmp);
+    CHECK(node_cmplt(mod, cmp->ops[1], cmp->ops[0], NULL) == cmp);
+    CHECK(mod->nodes.nelems == nnodes);
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
+static const node_t* eval_node(mod_t* mod, const node_t* node, node2node_t* values) {
+    if (node->nops == 0)
+        return node;
+    const node_t** value = (const node_t**)node2node_lookup(values, node);
+    if (value)
+        return *value;
+    const node_t* ops[3];
+    for (size_t i = 0; i < node->nops; ++i)
+        ops[i] = eval_node(mod, node->ops[i], values);
+    const node_t* res = node_rebuild(mod, node, ops, node->type);
+    node2node_insert(values, node, res);
+    return res;
+}
+
+// Evaluates an expression of the given parameter through constant folding
+static const node_t* eval_with(mod_t* mod, const node_t* node, const node_t* param, const node_t* value) {
+    node2node_t values = node2node_create();
+    node2node_insert(&values, param, value);
+    const node_t* res = eval_node(mod, node, &values);
+    node2node_destroy(&values);
+    return res;
+}
+
+static bool check_strength(mod_t* mod, const node_t* param, const node_t* x, const node_t* d) {
+    const node_t* div = node_reduce_strength(mod, node_div(mod, param, d, NULL));
+    const node_t* rem = node_reduce_strength(mod, node_rem(mod, param, d, NULL));
+    return eval_with(mod, div, param, x) == node_div(mod, x, d, NULL) &&
+           eval_with(mod, rem, param, x) == node_rem(mod, x, d, NULL);
+}
+
+bool test_strength(void) {
+    mod_t* mod = mod_create();
+    const node_t* params[6];
+    static const int64_t divisors[] = {
+        2, 3, 5, 6, 7, 8, 10, 12, 25, 100, 127, 641, 1000, 4096, 30000,
+        -2, -3, -7, -8, -10, -100, -641
+    };
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    const type_t* types[] = { type_i8(mod), type_u8(mod), type_i16(mod), type_u16(mod), type_i32(mod), type_u32(mod) };
+    for (size_t i = 0; i < 6; ++i) {
+        const type_t* type = types[i];
+        params[i] = node_param(mod, node_fn(mod, type_fn(mod, type, type), FN_EXPORTED, NULL), NULL);
+    }
+
+    // 8 bits: every dividend with every divisor, except those that overflow
+    for (int d = -128; d < 256; ++d) {
+        for (int x = -128; x < 256; ++x) {
+            if (d != 0 && d != -1 && d < 128 && x < 128)
+                CHECK(check_strength(mod, params[0], node_i8(mod, x), node_i8(mod, d)));
+            if (d > 0 && x >= 0)
+                CHECK(check_strength(mod, params[1], node_u8(mod, x), node_u8(mod, d)));
+        }
+    }
+
+    // 16 and 32 bits: a selection of dividends and divisors
+    for (size_t i = 2; i < 6; ++i) {
+        const type_t* type = types[i];
+        const node_t* param = params[i];
+        size_t w = type_bitwidth(type);
+        uint64_t x = 0x9E3779B97F4A7C15;
+        for (size_t j = 0; j < sizeof(divisors) / sizeof(divisors[0]); ++j) {
+            int64_t d = divisors[j];
+            if (type_is_u(type) && d < 0)
+                continue;
+            if (w == 16 && (d > 32767 || d < -32768))
+                continue;
+            for (size_t k = 0; k < 256; ++k) {
+                // Include the extreme values, along with pseudo-random ones
+                uint64_t bits = k == 0 ? 0 : k == 1 ? (UINT64_C(1) << (w - 1)) : k == 2 ? (UINT64_C(1) << (w - 1)) - 1 : k == 3 ? UINT64_MAX : (x = x * 6364136223846793005 + 1442695040888963407) >> 17;
+                const node_t* lit = NULL;
+                const node_t* div = NULL;
+                switch (type->tag) {
+                    case TYPE_I16: lit = node_i16(mod, (int16_t)bits);  div = node_i16(mod, d); break;
+                    case TYPE_U16: lit = node_u16(mod, (uint16_t)bits); div = node_u16(mod, d); break;
+                    case TYPE_I32: lit = node_i32(mod, (int32_t)bits);  div = node_i32(mod, d); break;
+                    case TYPE_U32: lit = node_u32(mod, (uint32_t)bits); div = node_u32(mod, d); break;
+                    default: break;
+                }
+                CHECK(check_strength(mod, param, lit, div));
+            }
+        }
+    }
+
+    // The pass removes the multiplications, divisions and remainders by constants
+    const type_t* u32 = type_u32(mod);
+    const node_t* fn = node_fn(mod, type_fn(mod, u32, u32), FN_EXPORTED, NULL);
+    const node_t* x = node_param(mod, fn, NULL);
+    const node_t* body = node_add(mod,
+        node_mul(mod, x, node_u32(mod, 8), NULL),
+        node_add(mod, node_div(mod, x, node_u32(mod, 16), NULL), node_rem(mod, x, node_u32(mod, 10), NULL), NULL), NULL);
+    node_bind(mod, fn, 0, body);
+    pass_run_on_fns(mod, reduce_strength, NULL, 2);
+    CHECK(fn->ops[0] != body);
+    CHECK(eval_with(mod, fn->ops[0], x, node_u32(mod, 1234567)) == node_u32(mod, 1234567 * 8 + 1234567 / 16 + 1234567 % 10));
+    node_vec_t stack = node_vec_create();
+    node_bitset_t seen = node_bitset_create();
+    node_vec_push(&stack, fn->ops[0]);
+    while (stack.nelems > 0) {
+        const node_t* node = node_vec_pop(&stack);
+        if (node->type == u32 && (node->tag == NODE_DIV || node->tag == NODE_REM))
+            break;
+        for (size_t i = 0; i < node->nops; ++i) {
+            if (node_bitset_insert(&seen, node->ops[i]))
+                node_vec_push(&stack, node->ops[i]);
+        }
+    }
+    bool found = stack.nelems > 0;
+    node_bitset_destroy(&seen);
+    node_vec_destroy(&stack);
+    CHECK(!found);
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
+bool test_reassoc(void) {
+    mod_t* mod = mod_create();
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    const type_t* u32 = type_u32(mod);
+    const type_t* param_types[] = { u32, u32, u32, u32 };
+    const type_t* fn_type = type_fn(mod, type_tuple(mod, 4, param_types), u32);
+    const node_t* fns[3];
+    const node_t* vars[3][4];
+    for (size_t i = 0; i < 3; ++i) {
+        fns[i] = node_fn(mod, fn_type, FN_EXPORTED, NULL);
+        const node_t* param = node_param(mod, fns[i], NULL);
+        for (size_t j = 0; j < 4; ++j)
+            vars[i][j] = node_extract(mod, param, node_u32(mod, j), NULL);
+    }
+
+    // Constants are folded together, and equivalent sums become the same node
+    const node_t* a = vars[0][0], *b = vars[0][1];
+    const node_t* sum1 = node_add(mod, node_add(mod, node_add(mod, a, node_u32(mod, 1), NULL), b, NULL), node_u32(mod, 2), NULL);
+    const node_t* sum2 = node_add(mod, node_add(mod, b, node_u32(mod, 3), NULL), a, NULL);
+    CHECK(sum1 != sum2);
+    node_bind(mod, fns[0], 0, node_mul(mod, sum1, sum2, NULL));
+
+    // Chains become balanced trees
+    const node_t* chain = vars[1][0];
+    for (size_t j = 1; j < 4; ++j)
+        chain = node_mul(mod, chain, vars[1][j], NULL);
+    node_bind(mod, fns[1], 0, chain);
+
+    // Operations with other uses are not duplicated
+    const node_t* shared = node_add(mod, vars[2][0], vars[2][1], NULL);
+    const node_t* body = node_mul(mod,
+        node_add(mod, shared, vars[2][2], NULL),
+        node_add(mod, shared, vars[2][3], NULL), NULL);
+    node_bind(mod, fns[2], 0, body);
+
+    // Floating point chains are only rewritten with associative math
+    const type_t* strict  = type_f32(mod, FP_STRICT_MATH);
+    const type_t* relaxed = type_f32(mod, FP_RELAXED_MATH);
+    const node_t* strict_fn  = node_fn(mod, type_fn(mod, strict, strict), FN_EXPORTED, NULL);
+    const node_t* relaxed_fn = node_fn(mod, type_fn(mod, relaxed, relaxed), FN_EXPORTED, NULL);
+    const node_t* x = node_param(mod, strict_fn, NULL);
+    const node_t* y = node_param(mod, relaxed_fn, NULL);
+    const node_t* strict_sum = node_add(mod, node_add(mod, x, node_f32(mod, 1.0f, FP_STRICT_MATH), NULL), node_f32(mod, 2.0f, FP_STRICT_MATH), NULL);
+    node_bind(mod, strict_fn, 0, strict_sum);
+    node_bind(mod, relaxed_fn, 0, node_add(mod, node_add(mod, y, node_f32(mod, 1.0f, FP_RELAXED_MATH), NULL), node_f32(mod, 2.0f, FP_RELAXED_MATH), NULL));
+
+    pass_run_on_fns(mod, reassociate, NULL, 2);
+
+    const node_t* sum = node_add(mod, node_u32(mod, 3), node_add(mod, a, b, NULL), NULL);
+    CHECK(fns[0]->ops[0] == node_mul(mod, sum, sum, NULL));
+    const node_t* tree = fns[1]->ops[0];
+    CHECK(tree->tag == NODE_MUL && tree->ops[0]->tag == NODE_MUL && tree->ops[1]->tag == NODE_MUL);
+    CHECK(fns[2]->ops[0] == body);
+    CHECK(strict_fn->ops[0] == strict_sum);
+    CHECK(relaxed_fn->ops[0] == node_add(mod, node_f32(mod, 3.0f, FP_RELAXED_MATH), y, NULL));
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
+bool test_ids(void) {
+    mod_t* mod = mod_create();
+    node_bitset_t bitset = node_bitset_create_with_cap(0);
+    node_sset_t sset = node_sset_create_with_cap(0);
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    // Identifiers are dense and only given to new nodes
+    const node_t* nodes[200];
+    for (int32_t i = 0; i < 200; ++i)
+        nodes[i] = node_i32(mod, i);
+    CHECK(node_i32(mod, 0) == nodes[0]);
+    for (size_t i = 1; i < 200; ++i)
+        CHECK(nodes[i]->id == nodes[i - 1]->id + 1);
+    CHECK(mod->nnode_ids == nodes[199]->id + 1);
+    CHECK(type_i32(mod)->id < mod->ntype_ids);
+
+    // Identifiers given after a checkpoint are reused after a rollback
+    mod_mark_t mark = mod_checkpoint(mod);
+    uint32_t id = node_i32(mod, 1000)->id;
+    mod_rollback(mod, mark);
+    CHECK(node_i64(mod, 1000)->id == id);
+
+    for (size_t i = 0; i < 200; i += 3) {
+        CHECK(node_bitset_insert(&bitset, nodes[i]));
+        CHECK(node_sset_insert(&sset, nodes[i]));
+    }
+    CHECK(!node_bitset_insert(&bitset, nodes[0]));
+    CHECK(!node_sset_insert(&sset, nodes[0]));
+    CHECK(node_bitset_remove(&bitset, nodes[3]));
+    CHECK(node_sset_remove(&sset, nodes[3]));
+    for (size_t i = 0; i < 200; ++i) {
+        bool member = i % 3 == 0 && i != 3;
+        CHECK(node_bitset_lookup(&bitset, nodes[i]) == member);
+        CHECK(node_sset_lookup(&sset, nodes[i]) == member);
+    }
+    size_t nelems = 0;
+    FORALL_SPARSE_SET(sset, const node_t*, node, {
+        CHECK(node_bitset_lookup(&bitset, node));
+        nelems++;
+    })
+    CHECK(nelems == 66);
+    node_sset_clear(&sset);
+    CHECK(!node_sset_lookup(&sset, nodes[0]));
+
+cleanup:
+    node_bitset_destroy(&bitset);
+    node_sset_destroy(&sset);
+    mod_destroy(mod);
+    return status == 0;
+}
+
+SMALL_VEC(uint32_small_vec, uint32_t, 4)
+VEC(uint32_vec, uint32_t)
+
+bool test_vec(void) {
+    uint32_vec_t vec = uint32_vec_create();
+    uint32_small_vec_t small_vec = uint32_small_vec_create();
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    // Vectors only allocate memory on the first push
+    CHECK(vec.cap == 0 && !vec.elems);
+    for (uint32_t i = 0; i < 100; ++i)
+        uint32_vec_push(&vec, i);
+    for (uint32_t i = 0; i < 100; ++i)
+        CHECK(vec.elems[i] == i);
+    uint32_vec_reserve(&vec, 1000);
+    CHECK(vec.cap >= 1000 && vec.nelems == 100);
+
+    // Small vectors keep their first elements inline
+    for (uint32_t i = 0; i < 4; ++i)
+        uint32_small_vec_push(&small_vec, i);
+    CHECK(!small_vec.heap_elems);
+    for (uint32_t i = 4; i < 100; ++i)
+        uint32_small_vec_push(&small_vec, i);
+    CHECK(small_vec.heap_elems && small_vec.cap >= 100);
+    uint32_t k = 0;
+    FORALL_SMALL_VEC(small_vec, uint32_t, elem, {
+        CHECK(elem == k++);
+    })
+    CHECK(k == 100);
+    for (uint32_t i = 100; i-- > 0;)
+        CHECK(uint32_small_vec_pop(&small_vec) == i);
+
+cleanup:
+    uint32_vec_destroy(&vec);
+    uint32_small_vec_destroy(&small_vec);
+    return status == 0;
+}
+
+static uint32_t hash_uint32_elem(const void* ptr) {
+    return hash_uint32(hash_init(), *(const uint32_t*)ptr);
+}
+
+static bool cmp_uint32_elem(const void* a, const void* b) {
+    return *(const uint32_t*)a == *(const uint32_t*)b;
+}
+
+OHSET(uint32_ohset, uint32_t, cmp_uint32_elem, hash_uint32_elem)
+
+bool test_order(void) {
+    mod_t* mod = mod_create();
+    uint32_ohset_t set = uint32_ohset_create_with_cap(0);
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    // Elements are visited in insertion order, holes included
+    const uint32_t N = 1000;
+    for (uint32_t i = 0; i < N; ++i)
+        CHECK(uint32_ohset_insert(&set, (i * 7919) % N));
+    CHECK(!uint32_ohset_insert(&set, 0));
+    for (uint32_t i = 0; i < N; i += 4)
+        CHECK(uint32_ohset_remove(&set, (i * 7919) % N));
+    CHECK(!uint32_ohset_remove(&set, 0));
+    CHECK(set.nelems == N - N / 4);
+    uint32_t k = 0, nelems = 0;
+    FORALL_OHSET(set, uint32_t, elem, {
+        if (k % 4 == 0) k++;
+        CHECK(elem == (k * 7919) % N);
+        k++, nelems++;
+    })
+    CHECK(nelems == set.nelems);
+
+    // Compaction keeps the order and the lookups intact
+    for (uint32_t i = 0; i < N; ++i) {
+        if (i % 4 == 1 || i % 4 == 2)
+            CHECK(uint32_ohset_remove(&set, (i * 7919) % N));
+    }
+    CHECK(set.nentries < N);
+    k = 3, nelems = 0;
+    FORALL_OHSET(set, uint32_t, elem, {
+        CHECK(elem == (k * 7919) % N);
+        CHECK(*uint32_ohset_lookup(&set, elem) == elem);
+        k += 4, nelems++;
+    })
+    CHECK(nelems == N / 4);
+
+    // Removing the last elements leaves no hole
+    size_t nentries = set.nentries;
+    CHECK(uint32_ohset_insert(&set, N));
+    CHECK(uint32_ohset_insert(&set, N + 1));
+    CHECK(uint32_ohset_remove(&set, N + 1));
+    CHECK(uint32_ohset_remove(&set, N));
+    CHECK(set.nentries == nentries);
+
+    // Nodes are visited in creation order
+    for (int32_t i = 0; i < 100; ++i)
+        node_i32(mod, i);
+    const node_t* prev = NULL;
+    FORALL_NODES(mod, node, {
+        CHECK(!prev || prev->id < node->id);
+        prev = node;
+    })
+
+cleanup:
+    uint32_ohset_destroy(&set);
+    mod_destroy(mod);
+    return status == 0;
+}
+
 bool test_literals(void) {
     mod_t* mod = mod_create();
 
@@ -405,6 +1487,15 @@ bool test_binops(void) {
     CHECK(node_xor(mod, param, node_xor(mod, param, node_i32(mod, 5), NULL), NULL) == node_i32(mod, 5));
     CHECK(node_xor(mod, node_xor(mod, param, node_i32(mod, 5), NULL), param, NULL) == node_i32(mod, 5));
     CHECK(node_xor(mod, param, param, NULL) == node_i32(mod, 0));
+    CHECK(node_and(mod, param, node_not(mod, param, NULL), NULL) == node_i32(mod, 0));
+    CHECK(node_or(mod, node_not(mod, param, NULL), param, NULL) == node_i32(mod, -1));
+
+    x = node_cmpgt(mod, param, node_i32(mod, 5), NULL);
+    CHECK(node_not(mod, x, NULL) == node_cmple(mod, param, node_i32(mod, 5), NULL));
+    CHECK(node_not(mod, node_cmpeq(mod, param, node_i32(mod, 5), NULL), NULL) == node_cmpne(mod, param, node_i32(mod, 5), NULL));
+    // Comparisons on floating point numbers that may be NaN cannot be inverted
+    y = node_cmplt(mod, node_bitcast(mod, param, type_f32(mod, FP_STRICT_MATH), NULL), node_f32(mod, 1.0f, FP_STRICT_MATH), NULL);
+    CHECK(node_not(mod, y, NULL)->tag == NODE_XOR);
 
     CHECK(node_add(mod, node_i8 (mod, 1), node_i8 (mod, 1), NULL) == node_i8 (mod, 2));
     CHECK(node_add(mod, node_i16(mod, 1), node_i16(mod, 1), NULL) == node_i16(mod, 2));
@@ -533,6 +1624,205 @@ cleanup:
     return status == 0;
 }
 
+bool test_scope_cache(void) {
+    mod_t* mod = mod_create();
+
+    const node_t* inner, *outer, *other;
+    const node_t* x, *y, *sum, *dep;
+    const scope_t* scope;
+    mod_mark_t mark;
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    outer = make_const_fn(mod, type_i32(mod));
+    inner = outer->ops[0];
+    x = node_param(mod, outer, NULL);
+    y = node_param(mod, inner, NULL);
+    other = node_fn(mod, type_fn(mod, type_i32(mod), type_i32(mod)), 0, NULL);
+
+    // Scopes are cached until they change
+    scope = scope_get(mod, outer);
+    CHECK(scope->entry == outer && scope->nodes.table->nelems == 4);
+    CHECK(scope_get(mod, outer) == scope && ((const cached_scope_t*)scope)->valid);
+    CHECK(node_set_lookup(scope_get_fvs(mod, inner), x) != NULL);
+    CHECK(scope_get_fvs(mod, inner)->table->nelems == 1);
+
+    // Binding a function outside of the scope keeps it
+    node_bind(mod, other, 0, node_param(mod, other, NULL));
+    CHECK(((const cached_scope_t*)scope)->valid);
+
+    // Binding a function inside the scope invalidates it
+    sum = node_add(mod, x, y, NULL);
+    node_bind(mod, inner, 0, sum);
+    CHECK(!((const cached_scope_t*)scope)->valid);
+    scope = scope_get(mod, outer);
+    CHECK(node_set_lookup(&scope->nodes, sum) != NULL);
+    CHECK(scope->nodes.table->nelems == 5);
+    CHECK(scope_get_fvs(mod, inner)->table->nelems == 1);
+
+    // So does binding a function outside of the scope to a new node that depends on it
+    dep = node_mul(mod, x, node_i32(mod, 3), NULL);
+    node_bind(mod, other, 0, dep);
+    CHECK(!((const cached_scope_t*)scope)->valid);
+    scope = scope_get(mod, outer);
+    CHECK(node_set_lookup(&scope->nodes, dep) != NULL);
+    CHECK(node_set_lookup(&scope->nodes, other) != NULL);
+
+    // Rolling back removes the scopes computed since the checkpoint
+    mark = mod_checkpoint(mod);
+    node_bind(mod, other, 0, node_mul(mod, node_param(mod, other, NULL), node_i32(mod, 5), NULL));
+    scope = scope_get(mod, outer);
+    CHECK(node_set_lookup(&scope->nodes, other) == NULL);
+    mod_rollback(mod, mark);
+    CHECK(fn2scope_lookup(&mod->scope_cache->scopes, outer) == NULL);
+    scope = scope_get(mod, outer);
+    CHECK(node_set_lookup(&scope->nodes, other) != NULL);
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
+#define SCOPE_SCALING_NFNS 4096
+
+static void bind_square(mod_t* mod, const scope_t* scope, void* data) {
+    (void)data;
+    const node_t* fn = scope->entry;
+    const node_t* param = node_param(mod, fn, NULL);
+    node_bind(mod, fn, 0, node_add(mod, fn->ops[0], node_mul(mod, param, param, NULL), NULL));
+}
+
+static const node_t* make_scaling_fns(mod_t* mod, size_t nfns) {
+    const type_t* fn_type = type_fn(mod, type_i32(mod), type_i32(mod));
+    const node_t* fn = NULL;
+    for (size_t i = 0; i < nfns; ++i) {
+        fn = node_fn(mod, fn_type, FN_EXPORTED, NULL);
+        node_bind(mod, fn, 0, node_add(mod, node_param(mod, fn, NULL), node_i32(mod, i % 8), NULL));
+    }
+    return fn;
+}
+
+// Average number of nodes and scopes that the cache looks at per function during a pass
+static size_t count_scope_checks(size_t nfns) {
+    mod_t* mod = mod_create();
+    make_scaling_fns(mod, nfns);
+    size_t nchecks = mod->scope_cache->nchecks;
+    pass_run_on_fns(mod, bind_square, NULL, 1);
+    nchecks = mod->scope_cache->nchecks - nchecks;
+    mod_destroy(mod);
+    return nchecks / nfns;
+}
+
+bool test_scope_scaling(void) {
+    mod_t* mod = mod_create();
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    // Binding a function only invalidates its own scope, however many are cached
+    const node_t* last = make_scaling_fns(mod, SCOPE_SCALING_NFNS);
+    FORALL_FNS(mod, fn, { scope_get(mod, fn); })
+    const node_t* param = node_param(mod, last, NULL);
+    node_bind(mod, last, 0, node_mul(mod, param, param, NULL));
+    size_t nvalid = 0;
+    FORALL_HMAP(mod->scope_cache->scopes, const node_t*, fn, cached_scope_t*, cached, {
+        CHECK(cached->valid == (fn != last));
+        nvalid += cached->valid;
+    })
+    CHECK(nvalid == SCOPE_SCALING_NFNS - 1);
+
+    // The work per function of a pass does not grow with the number of functions
+    size_t small = count_scope_checks(SCOPE_SCALING_NFNS / 16);
+    size_t large = count_scope_checks(SCOPE_SCALING_NFNS);
+    CHECK(small > 0 && large <= 2 * small);
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
+bool test_cfg(void) {
+    mod_t* mod = mod_create();
+
+    const node_t* entry, *head, *body, *next, *exit;
+    const node_t* i, *j, *ret;
+    const cfg_t* cfg;
+    size_t blocks[5];
+
+    jmp_buf env;
+    int status = setjmp(env);
+    if (status)
+        goto cleanup;
+
+    // Loop that counts from the argument to 10, and returns the result
+    const type_t* cn_type = type_cn(mod, type_i32(mod));
+    entry = node_fn(mod, type_cn(mod, type_tuple_from_args(mod, 2, type_i32(mod), cn_type)), FN_EXPORTED, NULL);
+    head  = node_fn(mod, cn_type, 0, NULL);
+    body  = node_fn(mod, cn_type, 0, NULL);
+    next  = node_fn(mod, cn_type, 0, NULL);
+    exit  = node_fn(mod, cn_type, 0, NULL);
+    i   = node_param(mod, head, NULL);
+    j   = node_param(mod, body, NULL);
+    ret = node_extract(mod, node_param(mod, entry, NULL), node_i32(mod, 1), NULL);
+    node_bind(mod, entry, 0, node_app(mod, head, node_extract(mod, node_param(mod, entry, NULL), node_i32(mod, 0), NULL), NULL, NULL));
+    node_bind(mod, head,  0, node_app(mod, node_select(mod, node_cmplt(mod, i, node_i32(mod, 10), NULL), body, exit, NULL), i, NULL, NULL));
+    node_bind(mod, body,  0, node_app(mod, next, j, NULL, NULL));
+    node_bind(mod, next,  0, node_app(mod, head, node_add(mod, j, node_i32(mod, 1), NULL), NULL, NULL));
+    node_bind(mod, exit,  0, node_app(mod, ret, node_param(mod, exit, NULL), NULL, NULL));
+
+    cfg = cfg_get(mod, entry);
+    CHECK(cfg_get(mod, entry) == cfg);
+    CHECK(cfg->nblocks == 6 && cfg->nreachable == 5);
+    blocks[0] = cfg_find_block(cfg, entry);
+    blocks[1] = cfg_find_block(cfg, head);
+    blocks[2] = cfg_find_block(cfg, body);
+    blocks[3] = cfg_find_block(cfg, next);
+    blocks[4] = cfg_find_block(cfg, exit);
+    CHECK(blocks[0] == 0 && blocks[1] == 1);
+    CHECK(cfg->blocks[blocks[1]].nsuccs == 2 && cfg->blocks[blocks[1]].npreds == 2);
+    CHECK(cfg->blocks[blocks[4]].nsuccs == 1 && cfg->blocks[blocks[4]].succs[0] == cfg_exit(cfg));
+
+    CHECK(cfg->blocks[blocks[0]].idom == INVALID_INDEX);
+    CHECK(cfg->blocks[blocks[1]].idom == blocks[0]);
+    CHECK(cfg->blocks[blocks[2]].idom == blocks[1]);
+    CHECK(cfg->blocks[blocks[3]].idom == blocks[2]);
+    CHECK(cfg->blocks[blocks[4]].idom == blocks[1]);
+    CHECK(cfg->blocks[blocks[0]].ipdom == blocks[1]);
+    CHECK(cfg->blocks[blocks[1]].ipdom == blocks[4]);
+    CHECK(cfg->blocks[blocks[2]].ipdom == blocks[3]);
+    CHECK(cfg->blocks[blocks[3]].ipdom == blocks[1]);
+    CHECK(cfg->blocks[blocks[4]].ipdom == cfg_exit(cfg));
+    CHECK(cfg_dominates(cfg, blocks[1], blocks[3]) && !cfg_dominates(cfg, blocks[2], blocks[4]));
+    CHECK(cfg_post_dominates(cfg, blocks[4], blocks[2]));
+
+    CHECK(cfg->nloops == 1);
+    CHECK(cfg->loops[0].header == blocks[1] && cfg->loops[0].nblocks == 3 && cfg->loops[0].depth == 1);
+    CHECK(cfg->blocks[blocks[3]].loop == 0 && cfg->blocks[blocks[4]].loop == INVALID_INDEX);
+
+    // The continuation that uses the parameter of the loop body is nested in it
+    CHECK(cfg->blocks[blocks[0]].parent == INVALID_INDEX);
+    CHECK(cfg->blocks[blocks[1]].parent == blocks[0]);
+    CHECK(cfg->blocks[blocks[3]].parent == blocks[2]);
+
+    // Binding a continuation of the scope rebuilds the graph
+    node_bind(mod, exit, 0, node_app(mod, head, node_extract(mod, node_param(mod, entry, NULL), node_i32(mod, 0), NULL), NULL, NULL));
+    cfg = cfg_get(mod, entry);
+    blocks[1] = cfg_find_block(cfg, head);
+    CHECK(cfg->nreachable == 5);
+    CHECK(cfg->blocks[blocks[1]].ipdom == INVALID_INDEX);
+    CHECK(cfg->blocks[cfg_exit(cfg)].npreds == 0);
+    CHECK(cfg->nloops == 1 && cfg->loops[0].nblocks == 4);
+
+cleanup:
+    mod_destroy(mod);
+    return status == 0;
+}
+
 bool test_io() {
     mod_t* mod = mod_create();
     mod_t* loaded_mod = NULL;
@@ -853,8 +2143,26 @@ bool run_test(const test_t* test) {
 int main(int argc, char** argv) {
     test_t tests[] = {
         {"hset",     test_hset},
+        {"clear",    test_clear},
+        {"hash",     test_hash},
+        {"vec",      test_vec},
         {"mpool",    test_mpool},
         {"types",    test_types},
+        {"checkpoint", test_checkpoint},
+        {"replace",  test_replace},
+        {"recycle",  test_recycle},
+        {"uses",     test_uses},
+        {"gc",       test_gc},
+        {"stats",    test_stats},
+        {"implies",  test_implies},
+        {"facts",    test_facts},
+        {"concurrent", test_concurrent},
+        {"pass",     test_pass},
+        {"pass_order", test_pass_order},
+        {"strength", test_strength},
+        {"reassoc",  test_reassoc},
+        {"ids",      test_ids},
+        {"order",    test_order},
         {"literals", test_literals},
         {"tuples",   test_tuples},
         {"arrays",   test_arrays},
@@ -862,6 +2170,9 @@ int main(int argc, char** argv) {
         {"bitcast",  test_bitcast},
         {"binops",   test_binops},
         {"scope",    test_scope},
+        {"scope_cache", test_scope_cache},
+        {"scope_scaling", test_scope_scaling},
+        {"cfg",      test_cfg},
         {"io",       test_io},
         {"opt",      test_opt},
         {"mem",      test_mem},